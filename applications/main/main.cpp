@@ -210,6 +210,22 @@ struct AppSettings {
     if (!node.isNone()) {
       databasePath = QString::fromStdString(node);
     }
+    node = fs["sift_storage"];
+    if (!node.isNone()) {
+      if (!Database::siftStorageFromString(QString::fromStdString(node),
+                                           siftStorage)) {
+        std::cout << "Unknown sift_storage, using float32" << std::endl;
+        siftStorage = Database::SiftStorage::Float32;
+      }
+    }
+    node = fs["feature_backend"];
+    if (!node.isNone()) {
+      if (!Database::featureBackendFromString(QString::fromStdString(node),
+                                              featureBackend)) {
+        std::cout << "Unknown feature_backend, using sqlite" << std::endl;
+        featureBackend = Database::FeatureBackend::Sqlite;
+      }
+    }
 
     node = fs["train_clean_csv"];
     if (!node.isNone()) {
@@ -242,6 +258,14 @@ struct AppSettings {
     if (!node.isNone()) {
       numThreads = node;
     }
+    node = fs["import_decode_threads"];
+    if (!node.isNone()) {
+      importDecodeThreads = node;
+    }
+    node = fs["import_max_image_dimension"];
+    if (!node.isNone()) {
+      importMaxImageDimension = node;
+    }
 
     node = fs["display_images"];
     if (!node.isNone()) {
@@ -284,6 +308,46 @@ struct AppSettings {
     if (!node.isNone()) {
       useCNNRetrieval = static_cast<int>(node);
     }
+    node = fs["use_ann_index"];
+    if (!node.isNone()) {
+      useAnnIndex = static_cast<int>(node);
+    }
+    node = fs["ann_num_lists"];
+    if (!node.isNone()) {
+      annNumLists = node;
+    }
+    node = fs["ann_nprobe"];
+    if (!node.isNone()) {
+      annNprobe = node;
+    }
+    node = fs["ann_rerank"];
+    if (!node.isNone()) {
+      annRerank = node;
+    }
+    node = fs["ann_benchmark"];
+    if (!node.isNone()) {
+      annBenchmark = static_cast<int>(node);
+    }
+    node = fs["vocab_max_descriptors"];
+    if (!node.isNone()) {
+      vocabMaxDescriptors = node;
+    }
+    node = fs["vocab_from_database"];
+    if (!node.isNone()) {
+      vocabFromDatabase = static_cast<int>(node);
+    }
+    node = fs["fbow_gallery_cache"];
+    if (!node.isNone()) {
+      fbowGalleryCache = QString::fromStdString(node);
+    }
+    node = fs["fbow_benchmark"];
+    if (!node.isNone()) {
+      fbowBenchmark = static_cast<int>(node);
+    }
+    node = fs["fbow_index_mb"];
+    if (!node.isNone()) {
+      fbowIndexMB = node;
+    }
     node = fs["do_registration"];
     if (!node.isNone()) {
       doRegistration = static_cast<int>(node);
@@ -310,6 +374,14 @@ struct AppSettings {
     if (!node.isNone()) {
       superpoint_resize_width = static_cast<int>(node);
     }
+    node = fs["sift_max_keypoints"];
+    if (!node.isNone()) {
+      siftOptions.maxKeypoints = static_cast<int>(node);
+    }
+    node = fs["sift_downscale"];
+    if (!node.isNone()) {
+      siftOptions.downscale = static_cast<double>(node);
+    }
 
     node = fs["evaluate_google_retrieval"];
     if (!node.isNone()) {
@@ -383,6 +455,11 @@ struct AppSettings {
                 : queryImageListPrefix.toStdString())
         << std::endl
         << "    Vocabulary File: " << vocabFilePath.toStdString() << std::endl
+        << "    Vocabulary Training: "
+        << (vocabFromDatabase ? "siftTable" : "training images") << ", "
+        << (vocabMaxDescriptors > 0 ? std::to_string(vocabMaxDescriptors)
+                                    : "all")
+        << " descriptors" << std::endl
         << "    Retrieval CNN Model path: "
         << ((retrievalNetPath.isEmpty()) ? "not set"
                                          : retrievalNetPath.toStdString())
@@ -399,6 +476,12 @@ struct AppSettings {
         << ((databasePath.isEmpty()) ? "not set" : databasePath.toStdString())
         << std::endl
         << "    Use Database: " << (useDatabase ? "yes" : "no") << std::endl
+        << "    SIFT storage (new databases): "
+        << Database::siftStorageToString(siftStorage).toStdString()
+        << std::endl
+        << "    Feature backend (new databases): "
+        << Database::featureBackendToString(featureBackend).toStdString()
+        << std::endl
         << "    Fill Database: " << (fillDatabase ? "yes" : "no") << std::endl
         << "    Use single dir for Database: " << (useSingleDir ? "yes" : "no")
         << std::endl
@@ -412,6 +495,27 @@ struct AppSettings {
         << std::endl
         << "    Number of Images to retrieve: " << retrieveImages << std::endl
         << "    #Threads: " << numThreads << std::endl
+        << "    Import decode threads: " << importDecodeThreads
+        << ", max image dimension: "
+        << (importMaxImageDimension > 0
+                ? std::to_string(importMaxImageDimension)
+                : "original")
+        << std::endl
+        << "    CNN ANN Index: "
+        << (useAnnIndex ? "lists " + std::to_string(annNumLists) +
+                              ", nprobe " + std::to_string(annNprobe) +
+                              ", rerank " + std::to_string(annRerank)
+                        : "no")
+        << std::endl
+        << "    FBoW DB Index: "
+        << (fbowIndexMB < 0
+                ? "off"
+                : (fbowIndexMB == 0 ? "unlimited"
+                                    : std::to_string(fbowIndexMB) + " MB"))
+        << std::endl
+        << "    FBoW Gallery Cache: "
+        << (fbowGalleryCache.isEmpty() ? "no" : fbowGalleryCache.toStdString())
+        << std::endl
         << "    Display Images: " << (displayImages ? "yes" : "no") << std::endl
         << "    Write Match Pairs file: "
         << (matchPairsFile.isEmpty() ? "no" : matchPairsFile.toStdString())
@@ -423,6 +527,11 @@ struct AppSettings {
                 ? std::to_string(superpoint_resize_width)
                 : "original")
         << std::endl
+        << "    SIFT keypoints: "
+        << (siftOptions.maxKeypoints > 0
+                ? "best " + std::to_string(siftOptions.maxKeypoints)
+                : "all")
+        << ", image scale " << siftOptions.downscale << std::endl
         << "    Evaluation: " << (evaluation ? "yes" : "no") << std::endl
         << "    Evaluate Google Retrieval: "
         << (evaluateGoogleRetrieval ? "yes" : "no") << std::endl
@@ -480,19 +589,31 @@ struct AppSettings {
   QString resultDirPath;
   QString trainCleanCSV;
   QString databasePath;
+  Database::SiftStorage siftStorage = Database::SiftStorage::Float32;
+  Database::FeatureBackend featureBackend = Database::FeatureBackend::Sqlite;
   QString matchPairsFile;
   QString superpointModel = "SuperPoint.zip";
   QString superglueModel = "SuperGlue.zip";
   int superpoint_resize_width = -1;
+  SiftHelpers::Options siftOptions;
   QString retrievalNetPath;
   QString evaluateCNNDir;
   QString saveCsvEvaluationDir;
+  QString fbowGalleryCache;
   QString cnnModelPrefix =
       "unknown";  // should be "small" or "large" for traindata size
   int maxNumGalleryImages = -1;
   int numThreads = 1;
+  int importDecodeThreads = 1;
+  int importMaxImageDimension = 0;
   int retrieveImages = 20;
   int retrievalNetBatch = 1;
+  int annNumLists = 1024;
+  int annNprobe = 16;
+  int annRerank = 200;
+  int fbowIndexMB = 0;
+  int vocabMaxDescriptors = 0;
+  bool vocabFromDatabase = false;
   bool displayImages = false;
   bool filterImages = true;
   bool useDatabase = false;
@@ -503,6 +624,9 @@ struct AppSettings {
   bool evaluateGoogleRetrieval = false;
   bool useMultipleModels = false;
   bool useCNNRetrieval = false;
+  bool useAnnIndex = false;
+  bool annBenchmark = false;
+  bool fbowBenchmark = false;
   bool colmapRetrievalEvaluation = false;
   bool doRegistration = false;
   bool evaluateBothRegistrations = false;
@@ -516,17 +640,39 @@ struct AppSettings {
 void fillDatabaseMain(Database &db, const AppSettings &settings,
                       FbowRetrieval &fbowRetr, TorchreidRetriever &torchRetr) {
   auto start = std::chrono::high_resolution_clock::now();
+  // set if the importer already wrote the FBoW vectors / CNN hashes
+  bool bowImported = false;
+  bool hashImported = false;
 
   if (settings.numThreads > 1) {
+    DBImporterMT dbimporter(db, settings.numThreads - 1,
+                            settings.importDecodeThreads,
+                            settings.importMaxImageDimension);
+    // one pass: every image is decoded once and written once
+    bool bowStage = false;
+    if (!settings.vocabFilePath.isEmpty()) {
+      DBImporterMT::BowFunction bow = fbowRetr.bowFunction();
+      if (bow) {
+        dbimporter.setBowStage(bow, fbowRetr.vocabularyKey());
+        bowStage = true;
+      }
+    }
+    if (settings.useCNNRetrieval) {
+      dbimporter.setEmbeddingStage(torchRetr.embeddingFunction(),
+                                   settings.retrievalNetBatch);
+      hashImported = true;
+    }
     std::cout << "FillDatabase: Importing reconstruction and calculating SIFT"
-              << std::endl;
-    DBImporterMT dbimporter(db, settings.numThreads - 1);
+              << (bowStage ? ", FBoW" : "")
+              << (hashImported ? ", CNN hash" : "") << std::endl;
     if (settings.useSingleDir) {
       dbimporter.importSingleReconstruction(settings.galleryDirPath,
                                             settings.reconstructionDirPath);
     } else {
       dbimporter.importRecursive(settings.galleryDirPath);
     }
+    // not run if the database has FBoW vectors of another vocabulary
+    bowImported = dbimporter.bowImported();
     auto tSIFT = std::chrono::high_resolution_clock::now();
     std::cout << "Elapsed: "
               << std::chrono::duration<double>(tSIFT - start).count() << "s"
@@ -555,9 +701,19 @@ void fillDatabaseMain(Database &db, const AppSettings &settings,
 
   auto t1 = std::chrono::high_resolution_clock::now();
 
-  if (settings.useCNNRetrieval) {
+  if (hashImported) {
+    std::cout << "Fill Database: writing embedding matrix" << std::endl;
+    torchRetr.exportEmbeddingMatrix(settings.numThreads);
+  } else if (settings.useCNNRetrieval) {
     std::cout << "Fill Database: calculating CNN hash" << std::endl;
-    torchRetr.fillDatabaseHashes(settings.retrievalNetBatch);
+    torchRetr.fillDatabaseHashes(settings.retrievalNetBatch, settings.numThreads);
+  }
+  if (settings.useCNNRetrieval && settings.useAnnIndex) {
+    std::cout << "Fill Database: building ANN index" << std::endl;
+    IvfPqIndex::Params params;
+    params.numLists = settings.annNumLists;
+    params.numThreads = settings.numThreads;
+    torchRetr.buildAnnIndex(params);
   }
   auto tHash = std::chrono::high_resolution_clock::now();
   if (settings.useCNNRetrieval) {
@@ -566,7 +722,7 @@ void fillDatabaseMain(Database &db, const AppSettings &settings,
               << std::endl;
   }
 
-  if (!settings.vocabFilePath.isEmpty()) {
+  if (!settings.vocabFilePath.isEmpty() && !bowImported) {
     std::cout << "FillDatabase: calculating fbow" << std::endl;
     fbowRetr.fillDBFbow(settings.numThreads);
   }
@@ -687,9 +843,21 @@ void retrieveMultipleCNNModels(
   }
 }
 
-void calculateSIFT(std::shared_ptr<Image> &img) {
-  SiftHelpers::extractSiftFeatures(img->path, img->siftDescriptors,
-                                   img->siftKeypoints);
+void calculateSIFT(const AppSettings &settings,
+                   std::vector<std::shared_ptr<Image>> &images) {
+  std::vector<std::string> paths;
+  for (const auto &img : images) {
+    paths.push_back(img->path);
+  }
+  std::vector<cv::Mat> descriptors;
+  std::vector<std::vector<cv::KeyPoint>> keypoints;
+  SiftHelpers::extractSiftFeaturesBatch(paths, descriptors, &keypoints,
+                                        settings.numThreads,
+                                        settings.siftOptions);
+  for (size_t i = 0; i < images.size(); ++i) {
+    images[i]->siftDescriptors = descriptors[i];
+    images[i]->siftKeypoints = std::move(keypoints[i]);
+  }
 }
 /**
  * @brief loadSIFT from DB or calculate SIFT if it is not possible to load.
@@ -698,15 +866,17 @@ void loadSIFT(const AppSettings &settings, std::unique_ptr<Database> &db,
               std::vector<std::shared_ptr<Image>> &images) {
   if (settings.useDatabase) {
     DBHelper dbhelper = DBHelper(*db.get());
+    std::vector<std::shared_ptr<Image>> missing;
     for (auto &img : images) {
-      if (!dbhelper.getImageByPath(img->path, img)) {
-        calculateSIFT(img);
+      if (img->id >= 0) {
+        dbhelper.getImage(img->id, img);
+      } else if (!dbhelper.getImageByPath(img->path, img)) {
+        missing.push_back(img);
       }
     }
+    calculateSIFT(settings, missing);
   } else {
-    for (auto &img : images) {
-      calculateSIFT(img);
-    }
+    calculateSIFT(settings, images);
   }
 }
 /**
@@ -804,6 +974,19 @@ void runPipeline(AppSettings &settings, std::unique_ptr<Database> &db,
                                    settings.galleryDirPath.toStdString());
     }
 
+    fbowInstance.setGalleryBowCache(settings.fbowGalleryCache.toStdString());
+    FbowRetrieval::VocabularyParams vocabParams;
+    vocabParams.numThreads = settings.numThreads;
+    vocabParams.maxDescriptors =
+        static_cast<size_t>(std::max(0, settings.vocabMaxDescriptors));
+    vocabParams.fromDatabase =
+        settings.vocabFromDatabase && settings.useDatabase;
+    fbowInstance.setVocabularyParams(vocabParams);
+    fbowInstance.setQuerySiftOptions(settings.siftOptions);
+    fbowInstance.setIndexMemoryBudget(
+        settings.fbowIndexMB <= 0 ? settings.fbowIndexMB
+                                  : settings.fbowIndexMB * (1LL << 20));
+
     if (settings.filterImages) {
       fbowInstance.setVocabCreationFilterFile(
           settings.trainCleanCSV.toStdString());
@@ -835,6 +1018,16 @@ void runPipeline(AppSettings &settings, std::unique_ptr<Database> &db,
   auto tRet0 = std::chrono::high_resolution_clock::now();
   if (settings.useCNNRetrieval) {
     if (settings.useDatabase) {
+      if (settings.useAnnIndex) {
+        IvfPqIndex::SearchParams params;
+        params.nprobe = settings.annNprobe;
+        params.rerank = settings.annRerank;
+        params.numThreads = settings.numThreads;
+        cnnRetriever.setAnnSearch(true, params);
+        if (settings.annBenchmark) {
+          cnnRetriever.benchmarkAnnIndex(queryImages, settings.retrieveImages);
+        }
+      }
       retrievedImages = cnnRetriever.findReferenceImagesMultipleQueries(
           queryImages, galleryImages, settings.retrieveImages,
           settings.maxNumGalleryImages, settings.numThreads,
@@ -860,8 +1053,12 @@ void runPipeline(AppSettings &settings, std::unique_ptr<Database> &db,
               << std::endl;
 
     if (settings.useDatabase) {
+      if (settings.fbowBenchmark) {
+        fbowInstance.benchmarkScoring(queryImages);
+      }
       fbowInstance.retrieveImagesDB(queryImages, retrievedImages,
-                                    settings.retrieveImages);
+                                    settings.retrieveImages,
+                                    settings.numThreads);
     } else if (settings.evaluateGoogleRetrieval) {
       fbowInstance.retrieveImagesGalleryDir(
           queryImages, retrievedImages, settings.maxNumGalleryImages,
@@ -882,7 +1079,9 @@ void runPipeline(AppSettings &settings, std::unique_ptr<Database> &db,
   // =======================================
   // FIX IMAGE CREATION
   //
-  if (!settings.evaluateGoogleRetrieval) {
+  // database retrieval already returns images with intrinsics and extrinsics,
+  // the imported gallery is only needed for its evaluation points
+  if (!settings.evaluateGoogleRetrieval && !galleryImages.empty()) {
     std::cout << "--------------------------------------------" << std::endl;
     std::cout << "      STUPID FIX FOR STUPID IMAGE CREATION \n";
     std::cout << "--------------------------------------------" << std::endl;
@@ -999,7 +1198,9 @@ void runPipeline(AppSettings &settings, std::unique_ptr<Database> &db,
           continue;
         }
 
-        if (loadExtrinsicsFromList(retrieved, galleryImages)) {
+        // id >= 0: loaded from the database including extrinsics
+        if (retrieved->id >= 0 ||
+            loadExtrinsicsFromList(retrieved, galleryImages)) {
           retrievedImagesWithExtrinsics.push_back(retrieved);
         }
       }
@@ -1111,7 +1312,8 @@ int main(int argc, char *argv[]) {
   size_t imageNumDB = 0;
   if (settings.useDatabase) {
     auto t0 = std::chrono::high_resolution_clock::now();
-    db = std::make_unique<Database>();
+    db = std::make_unique<Database>(false, settings.siftStorage,
+                                    settings.featureBackend);
     db->createConnection(settings.databasePath);
 
     imageNumDB = db->getNumImages();
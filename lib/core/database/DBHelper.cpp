@@ -83,13 +83,9 @@ void DBHelper::fillDatabaseExtrIntr(const std::string &imgDir, const std::string
 }
 
 bool DBHelper::checkIfPathInDB(const std::string &path) {
-    std::vector<int> idList = this->mDB.getIDList();
-    for (const auto &id: idList) {
-        if (this->mDB.getPath(id) == path) {
-            return true;
-        }
-    }
-    return false;
+    int id;
+    qint64 size, mtime;
+    return this->mDB.getFileInfo(path, id, size, mtime);
 }
 
 void DBHelper::fillDatabaseSIFT() {
@@ -158,15 +154,14 @@ void DBHelper::getImage(const int id, std::shared_ptr<Image> &img) {
 }
 
 bool DBHelper::getImageByPath(std::string &imgPath, std::shared_ptr<Image> &img) {
-    std::vector<int> idList = this->mDB.getIDList();
-
-    for(const auto &id: idList) {
-        if (this->mDB.getPath(id) == imgPath) {
-            getImage(id, img);
-            return true;
-        }
+    // one indexed lookup instead of comparing the path of every image
+    int id;
+    qint64 size, mtime;
+    if (!this->mDB.getFileInfo(imgPath, id, size, mtime)) {
+        return false;
     }
-    return false;
+    getImage(id, img);
+    return true;
 }
 
 /*
@@ -1,86 +1,172 @@
 #include "DBImporterMT.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <thread>
 
+#include <QDateTime>
 #include <QDir>
+#include <QFileInfo>
 
 #include "database.h"
 #include "../import/colmapimporter.h"
 #include "../utils/SiftHelpers.h"
 
-void Queue::push(std::shared_ptr<Image> img)
+DBImporterMT::DBImporterMT(Database& db, int siftThreads, int decodeThreads, int maxImageDimension)
+ : mDB(db), mSiftThreads(siftThreads), mDecodeThreads(std::max(1, decodeThreads)),
+   mMaxImageDimension(maxImageDimension)
 {
-    std::lock_guard<std::mutex> l(mLock);
-    mQ.push(img);
+
 }
 
-std::shared_ptr<Image> Queue::pop()
-{
-    std::shared_ptr<Image> rtn = nullptr;
+namespace {
+    /**
+     * @brief decoded image and its scale relative to the original image
+     */
+    struct DecodedImage
+    {
+        std::shared_ptr<Image> img;
+        double scale = 1.;
+    };
+    using DecodedQueue = BoundedQueue<DecodedImage>;
+
+    /**
+     * @brief per stage counters for the statistics, updated by all workers of the stage
+     */
+    struct StageStats
+    {
+        std::atomic<int> images{0};
+        std::atomic<long long> busyMicroseconds{0};
 
+        void add(std::chrono::steady_clock::time_point start, int count = 1)
+        {
+            images += count;
+            busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+        }
+    };
+
+    /**
+     * @brief decodeImage loads img in grayscale, with maxDimension > 0 fitted into maxDimension.
+     *        Uses the reduced JPEG decoding of OpenCV when the size is known from the intrinsics.
+     * @param keepColor decode in color and keep it in img.colorImage as well; the image is still decoded once
+     * @return width of the decoded image / width of the original image
+     */
+    double decodeImage(Image& img, int maxDimension, bool keepColor)
     {
-        std::lock_guard<std::mutex> l(mLock);
-        if (!mQ.empty())
+        // largest reduction that still decodes at least maxDimension, resize does the rest
+        const int originalMax = std::max(img.intrinsics.width(), img.intrinsics.height());
+        int reduction = 1;
+        if (maxDimension > 0)
         {
-            rtn = mQ.front();
-            mQ.pop();
+            while (reduction < 8 && originalMax >= 2 * reduction * maxDimension)
+                reduction *= 2;
         }
-    }
 
-    return rtn;
-}
+        int flag = keepColor ? cv::IMREAD_COLOR : cv::IMREAD_GRAYSCALE;
+        if (reduction == 2)
+            flag = keepColor ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_REDUCED_GRAYSCALE_2;
+        else if (reduction == 4)
+            flag = keepColor ? cv::IMREAD_REDUCED_COLOR_4 : cv::IMREAD_REDUCED_GRAYSCALE_4;
+        else if (reduction == 8)
+            flag = keepColor ? cv::IMREAD_REDUCED_COLOR_8 : cv::IMREAD_REDUCED_GRAYSCALE_8;
 
-void Queue::setFinished()
-{
-    mFinished = true;
-}
+        cv::Mat decoded = cv::imread(img.path, flag);
+        if (decoded.empty())
+        {
+            return 1.;
+        }
+        const int originalWidth = img.intrinsics.width() > 0 ? img.intrinsics.width() : decoded.cols;
 
-bool Queue::isFinished() const
-{
-    std::lock_guard<std::mutex> l(mLock);
-    return mFinished && mQ.empty();
-}
+        const int decodedMax = std::max(decoded.cols, decoded.rows);
+        if (maxDimension > 0 && decodedMax > maxDimension)
+        {
+            const double f = static_cast<double>(maxDimension) / decodedMax;
+            cv::Mat resized;
+            cv::resize(decoded, resized, cv::Size(), f, f, cv::INTER_AREA);
+            decoded = resized;
+        }
 
-size_t Queue::size() const
-{
-    std::lock_guard<std::mutex> l(mLock);
-    return mQ.size();
+        if (keepColor)
+        {
+            img.colorImage = decoded;
+            cv::cvtColor(decoded, img.grayscaleImage, cv::COLOR_BGR2GRAY);
+        }
+        else
+        {
+            img.grayscaleImage = decoded;
+        }
+        return static_cast<double>(decoded.cols) / originalWidth;
+    }
 }
 
-
-DBImporterMT::DBImporterMT(Database& db, int siftThreads)
- : mDB(db), mSiftThreads(siftThreads)
+/**
+ * @brief ImportCounters: images queued for import and images skipped because they are already in the database
+ */
+struct ImportCounters
 {
+    std::atomic<int> queued{0};
+    std::atomic<int> skipped{0};
+};
+
+/**
+ * @brief RequiredOutputs: what the configured stages write, an unchanged image is only skipped if it has all of it
+ */
+struct RequiredOutputs
+{
+    bool fbow = false;
+    bool hash = false;
+};
 
-}
-
-void checkAndPush(std::shared_ptr<Image>& img, Queue& q, int& id)
+void checkAndPush(std::shared_ptr<Image>& img, Queue& q, Database& db, ImportCounters& counters,
+                  const RequiredOutputs& required)
 {
-    if (QFile::exists(QString::fromStdString(img->path)))
-    {
-        q.push(img);
-        id++;
-    }
-    else
+    QFileInfo fi(QString::fromStdString(img->path));
+    if (!fi.exists())
     {
         std::string inf = "Warning: File not found \"" + img->path + "\"";
         std::cout << inf << std::endl;
+        return;
+    }
+
+    int id;
+    qint64 size, mtime;
+    if (db.getFileInfo(img->path, id, size, mtime))
+    {
+        // -1: imported before file info was recorded, trust the path
+        const bool unchanged = (size < 0 && mtime < 0)
+                || (size == fi.size() && mtime == fi.lastModified().toMSecsSinceEpoch());
+        // stages enabled since the last import: their outputs are missing for unchanged images as well
+        if (unchanged && (!required.fbow || db.hasFbow(id)) && (!required.hash || db.hasHashVector(id)))
+        {
+            counters.skipped++;
+            return;
+        }
+        // calculate again, keeping its id
+        img->id = id;
     }
+
+    q.push(img);
+    counters.queued++;
 }
 
 void runImportReconstructionSingle(const QString& imagesDir, const QString& reconstructionDir,
-                                   Queue& out, int& id)
+                                   Queue& out, Database& db, ImportCounters& counters, RequiredOutputs required)
 {
     std::vector<std::shared_ptr<Image>> images;
     ColmapImporter importer;
     importer.importImages(reconstructionDir, imagesDir, images);
     for (auto& i : images)
     {
-        checkAndPush(i, out, id);
+        checkAndPush(i, out, db, counters, required);
     }
+    db.releaseThreadConnection();
 }
 
-void runImportReconstructionMultiple(const QString& rootDir, Queue& out, int& id)
+void runImportReconstructionMultiple(const QString& rootDir, Queue& out, Database& db, ImportCounters& counters,
+                                     RequiredOutputs required)
 {
     ColmapImporter importer;
 
@@ -95,108 +181,189 @@ void runImportReconstructionMultiple(const QString& rootDir, Queue& out, int& id
 
         for (auto& t : temp)
         {
-            checkAndPush(t, out, id);
+            checkAndPush(t, out, db, counters, required);
         }
         temp.clear();
     }
+    db.releaseThreadConnection();
 }
 
-void runLoadImage(Queue& in, Queue& out, size_t maxQSize)
+void runLoadImage(Queue& in, DecodedQueue& out, int maxImageDimension, bool keepColor, StageStats& stats)
 {
-    while (!in.isFinished())
+    std::shared_ptr<Image> i;
+    while (in.pop(i))
     {
-        auto i = in.pop();
-        if (i == nullptr)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
+        auto start = std::chrono::steady_clock::now();
+        DecodedImage decoded;
+        decoded.scale = decodeImage(*i, maxImageDimension, keepColor);
+        decoded.img = i;
+        stats.add(start);
+        // blocks while out is full, bounding the decoded images in memory
+        out.push(std::move(decoded));
+    }
+}
 
-        i->loadImageGrayscale();
-        while (out.size() >= maxQSize)
+void runSIFT(DecodedQueue& in, Queue& out, const DBImporterMT::BowFunction& bow, StageStats& stats)
+{
+    DecodedImage d;
+    while (in.pop(d))
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto& i = d.img;
+        SiftHelpers::extractSiftFeatures(i->grayscaleImage, i->siftDescriptors, i->siftKeypoints);
+        SiftHelpers::scaleKeypoints(i->siftKeypoints, d.scale);
+        i->forgetGrayscaleImage();
+        if (bow)
         {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            i->bow = bow(i->siftDescriptors);
         }
+        stats.add(start);
         out.push(i);
     }
 }
 
-void runSIFT(Queue& in, Queue& out)
+void runEmbedding(Queue& in, Queue& out, const DBImporterMT::EmbeddingFunction& embedding, int batchSize,
+                  StageStats& stats)
 {
-    while (!in.isFinished())
+    std::vector<std::shared_ptr<Image>> batch;
+    std::vector<cv::Mat> images;
+    while (in.popBatch(batch, batchSize) > 0)
     {
-        auto i = in.pop();
-        if (i == nullptr)
+        auto start = std::chrono::steady_clock::now();
+        images.clear();
+        for (auto& i : batch)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
+            images.push_back(i->colorImage);
+        }
+        std::vector<cv::Mat> embeddings = embedding(images);
+        for (size_t j = 0; j < batch.size(); ++j)
+        {
+            if (j < embeddings.size())
+            {
+                batch[j]->hashVector = embeddings[j];
+            }
+            batch[j]->forgetColorImage();
         }
+        stats.add(start, static_cast<int>(batch.size()));
 
-        SiftHelpers::extractSiftFeatures(i->grayscaleImage, i->siftDescriptors, i->siftKeypoints);
-        i->forgetGrayscaleImage();
-        out.push(i);
+        for (auto& i : batch)
+        {
+            out.push(i);
+        }
+        batch.clear();
     }
 }
 
-void saveBatch(std::vector<std::shared_ptr<Image>>& batch, Database& db, int& id)
+/**
+ * @brief SaveState: ids and progress of the saver thread
+ */
+struct SaveState
+{
+    int nextId = 0;            // first unused id of the database
+    std::atomic<int> saved{0}; // images committed by this import
+    QString checkpoint;        // source of this import, stored with every batch
+};
+
+void saveBatch(std::vector<std::shared_ptr<Image>>& batch, Database& db, SaveState& state)
 {
     db.transaction();
 
     for (auto& i : batch)
     {
-        db.addPathExtrinsicsIntrinsics(id, i->path, i->intrinsics, i->extrinsics);
+        // new images are appended, changed ones keep their id
+        const bool reimported = i->id >= 0;
+        const int imgId = reimported ? i->id : state.nextId++;
+        i->id = imgId;
+        db.addPathExtrinsicsIntrinsics(imgId, i->path, i->intrinsics, i->extrinsics);
 
         std::vector<cv::Point2f> points;
         cv::KeyPoint::convert(i->siftKeypoints, points);
 
-        db.addKeyPointAndSift(id, points, i->siftDescriptors);
-        id++;
+        db.addKeyPointAndSift(imgId, points, i->siftDescriptors);
+        // outputs of the previous file content that are not calculated again are dropped
+        if (i->bow != nullptr)
+        {
+            db.addFbow(imgId, i->bow->toByteArray());
+        }
+        else if (reimported)
+        {
+            db.removeFbow(imgId);
+        }
+        if (!i->hashVector.empty())
+        {
+            db.addHashVector(imgId, i->hashVector);
+        }
+        else if (reimported)
+        {
+            db.removeHashVector(imgId);
+        }
+        QFileInfo fi(QString::fromStdString(i->path));
+        db.setFileInfo(imgId, fi.size(), fi.lastModified().toMSecsSinceEpoch());
+        i->forgetAll();
     }
 
+    // committed with the images: after a crash the next import skips them and continues from here
+    db.setImportCheckpoint(state.checkpoint + "\t" + QString::number(state.saved + batch.size()));
     db.commit();
+    state.saved += static_cast<int>(batch.size());
 }
 
-void runSaveDB(Queue& in, Database& db, int batchSize, int& id)
+void runSaveDB(Queue& in, Database& db, int batchSize, SaveState& state, StageStats& stats)
 {
     std::vector<std::shared_ptr<Image>> batch;
     batch.reserve(batchSize);
-    while (!in.isFinished())
+    while (in.popBatch(batch, batchSize - batch.size()) > 0)
     {
-        auto i = in.pop();
-        if (i == nullptr)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-
-        batch.push_back(i);
         if (batch.size() >= static_cast<size_t>(batchSize))
         {
-            saveBatch(batch, db, id);
+            auto start = std::chrono::steady_clock::now();
+            saveBatch(batch, db, state);
+            stats.add(start, static_cast<int>(batch.size()));
             batch.clear();
         }
     }
 
     if (!batch.empty())
     {
-        saveBatch(batch, db, id);
+        auto start = std::chrono::steady_clock::now();
+        saveBatch(batch, db, state);
+        stats.add(start, static_cast<int>(batch.size()));
     }
 }
 
-void runPrintStatusInfo(int& idsReconstructionLoaded, int& idsDBSaved)
+void runPrintStatusInfo(const ImportCounters& counters, const std::atomic<int>& idsDBSaved,
+                        const Queue& importQ, const DecodedQueue& siftQ, const Queue* embedQ,
+                        const Queue& saveQ, const std::atomic<bool>& done)
 {
-    while (true)
+    while (!done)
     {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        if (idsReconstructionLoaded == 0)
+        if (counters.queued == 0)
             continue;
 
-        std::cout << "\rProcessing " << idsDBSaved << "/" << idsReconstructionLoaded << std::flush;
-
-        if (idsDBSaved >= idsReconstructionLoaded)
-            break;
+        // queue depths show the bottleneck: the stage after the fullest queue
+        std::cout << "\rProcessing " << idsDBSaved << "/" << counters.queued
+                  << " (queued: decode " << importQ.size() << ", SIFT " << siftQ.size();
+        if (embedQ != nullptr)
+            std::cout << ", CNN " << embedQ->size();
+        std::cout << ", save " << saveQ.size() << ")   " << std::flush;
     }
-    std::cout << std::endl;
+    std::cout << "\rProcessing " << idsDBSaved << "/" << counters.queued
+              << ", skipped " << counters.skipped << " images already in the database"
+              << "                    " << std::endl;
+}
+
+void printStageStats(const char* name, int workers, const StageStats& stats, double wallSeconds)
+{
+    const double busySeconds = stats.busyMicroseconds / 1e6;
+    std::cout << "  " << std::left << std::setw(8) << name << std::right
+              << std::setw(3) << workers << " threads, "
+              << std::setw(7) << stats.images << " images, "
+              << std::fixed << std::setprecision(1)
+              << std::setw(7) << (wallSeconds > 0 ? stats.images / wallSeconds : 0.) << " img/s, "
+              << "utilization " << std::setw(5)
+              << (wallSeconds > 0 ? 100. * busySeconds / (workers * wallSeconds) : 0.) << "%"
+              << std::defaultfloat << std::endl;
 }
 
 
@@ -205,41 +372,121 @@ void DBImporterMT::import(const QString& img, const QString& model)
     const int DBSaveBatchSize = 100;
     const int maxLoadedImages = 100;
 
+    // only decoded images waiting for SIFT are expensive, the other queues just hold paths or results
+    Queue importQ;
+    DecodedQueue siftQ(maxLoadedImages);
+    Queue embedQ(std::max(maxLoadedImages, 2 * mEmbeddingBatchSize)); // still holds the color images
+    Queue saveQ(2 * DBSaveBatchSize);
+    const bool useEmbedding = static_cast<bool>(mEmbedding);
+
     std::unique_ptr<std::thread> importerThread;
+    std::vector<std::thread> decodeThreads;
     std::vector<std::thread> siftThreads;
+    std::unique_ptr<std::thread> embeddingThread;
+
+    ImportCounters counters;
+    SaveState saveState;
+    std::atomic<bool> done(false);
+    StageStats decodeStats, siftStats, embeddingStats, saveStats;
+
+    // images already in the database are skipped (see checkAndPush), so an interrupted import
+    // is resumed by running it again. The committed count can not be used to skip the first images:
+    // with several decode and SIFT threads they are not saved in directory order.
+    saveState.checkpoint = model.isEmpty() ? img : img + " " + model;
+    const QStringList previous = mDB.getImportCheckpoint().split('\t');
+    if (previous.size() == 2 && previous[0] == saveState.checkpoint)
+    {
+        std::cout << "Resuming interrupted import of " << previous[0].toStdString() << " ("
+                  << previous[1].toStdString() << " images committed)" << std::endl;
+    }
+    else if (previous.size() == 2)
+    {
+        std::cout << "Previous import of " << previous[0].toStdString() << " was interrupted after "
+                  << previous[1].toStdString() << " images, they stay in the database" << std::endl;
+    }
+    saveState.nextId = mDB.getNextID();
 
-    int idsReconstructionLoaded = 0;
-    int idsDBSaved = 0;
+    // the FBoW vectors already in the database have to be of the same vocabulary, otherwise the stage is
+    // skipped and all of them are calculated again afterwards
+    const QString vocabulary = mDB.getFBowVocabulary();
+    mBowImported = mBow && (saveState.nextId == 0 || (!mBowVocabulary.isEmpty() && vocabulary == mBowVocabulary));
+    if (mBow && !mBowImported)
+    {
+        std::cout << "FBoW vectors in the database are from another vocabulary, skipping the BoW stage" << std::endl;
+    }
+    if (mBowImported)
+    {
+        mDB.setFBowVocabulary(mBowVocabulary);
+    }
+    const BowFunction bow = mBowImported ? mBow : BowFunction();
+    RequiredOutputs required;
+    required.fbow = mBowImported;
+    required.hash = useEmbedding;
+    mDB.setImportCheckpoint(saveState.checkpoint + "\t0");
 
+    auto start = std::chrono::steady_clock::now();
     if (model.isEmpty())
     {
-        importerThread = std::make_unique<std::thread>(runImportReconstructionMultiple, img, std::ref(mImportQ), std::ref(idsReconstructionLoaded));
+        importerThread = std::make_unique<std::thread>(runImportReconstructionMultiple, img, std::ref(importQ), std::ref(mDB),
+                                                       std::ref(counters), required);
     }
     else
     {
-        importerThread = std::make_unique<std::thread>(runImportReconstructionSingle, img, model, std::ref(mImportQ), std::ref(idsReconstructionLoaded));
+        importerThread = std::make_unique<std::thread>(runImportReconstructionSingle, img, model, std::ref(importQ), std::ref(mDB),
+                                                       std::ref(counters), required);
     }
 
-    std::thread imgLoadThread(runLoadImage, std::ref(mImportQ), std::ref(mSiftQ), maxLoadedImages);
+    for (int i = 0; i < mDecodeThreads; ++i)
+    {
+        decodeThreads.push_back(std::thread(runLoadImage, std::ref(importQ), std::ref(siftQ), mMaxImageDimension,
+                                            useEmbedding, std::ref(decodeStats)));
+    }
+    Queue& siftOutQ = useEmbedding ? embedQ : saveQ;
     for (int i = 0; i < mSiftThreads; ++i)
     {
-        siftThreads.push_back(std::thread(runSIFT, std::ref(mSiftQ), std::ref(mSaveQ)));
+        siftThreads.push_back(std::thread(runSIFT, std::ref(siftQ), std::ref(siftOutQ), std::cref(bow), std::ref(siftStats)));
+    }
+    if (useEmbedding)
+    {
+        // the CNN runs on one thread, batches give the parallelism
+        embeddingThread = std::make_unique<std::thread>(runEmbedding, std::ref(embedQ), std::ref(saveQ), std::cref(mEmbedding),
+                                                        mEmbeddingBatchSize, std::ref(embeddingStats));
     }
-    std::thread saveDBThread(runSaveDB, std::ref(mSaveQ), std::ref(mDB), DBSaveBatchSize, std::ref(idsDBSaved));
+    std::thread saveDBThread(runSaveDB, std::ref(saveQ), std::ref(mDB), DBSaveBatchSize, std::ref(saveState), std::ref(saveStats));
 
-    std::thread consoleOutputThread(runPrintStatusInfo, std::ref(idsReconstructionLoaded), std::ref(idsDBSaved));
+    std::thread consoleOutputThread(runPrintStatusInfo, std::cref(counters), std::cref(saveState.saved),
+                                    std::cref(importQ), std::cref(siftQ), useEmbedding ? &embedQ : nullptr,
+                                    std::cref(saveQ), std::cref(done));
 
     importerThread->join();
-    mImportQ.setFinished();
-    imgLoadThread.join();
-    mSiftQ.setFinished();
+    importQ.close();
+    for (auto& t : decodeThreads)
+    {
+        t.join();
+    }
+    siftQ.close();
     for (auto& t : siftThreads)
     {
         t.join();
     }
-    mSaveQ.setFinished();
+    if (embeddingThread)
+    {
+        embedQ.close();
+        embeddingThread->join();
+    }
+    saveQ.close();
     saveDBThread.join();
+    done = true;
     consoleOutputThread.join();
+    mDB.setImportCheckpoint(QString());
+
+    const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Import stages (" << wallSeconds << "s):" << std::endl;
+    printStageStats("decode", mDecodeThreads, decodeStats, wallSeconds);
+    printStageStats(bow ? "SIFT+BoW" : "SIFT", mSiftThreads, siftStats, wallSeconds);
+    if (useEmbedding)
+        printStageStats("CNN", 1, embeddingStats, wallSeconds);
+    printStageStats("save", 1, saveStats, wallSeconds);
 }
 
 void DBImporterMT::importRecursive(const QString &rootDir)
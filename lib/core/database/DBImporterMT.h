@@ -1,67 +1,79 @@
 #pragma once
 
+#include <algorithm>
+#include <functional>
 #include <memory>
-#include <queue>
+#include <vector>
 
 #include <QString>
 
 #include "database.h"
 #include "../types/image.h"
+#include "../utils/BoundedQueue.h"
 
 #include "ppbafloc-core_export.h"
 
 /**
- * @brief Threadsafe FIFO queue
+ * @brief Blocking FIFO queue of images between the import stages
  */
-class PPBAFLOC_CORE_EXPORT Queue
+using Queue = BoundedQueue<std::shared_ptr<Image>>;
+
+/**
+ * @brief Utility class for filling the database
+ *      optimized to use multiple threads
+ */
+class PPBAFLOC_CORE_EXPORT DBImporterMT
 {
 public:
     /**
-     * @brief push an image to the front of the queue
-     */
-    void push(std::shared_ptr<Image> img);
-    /**
-     * @brief pop: remove image from the back of the queue
-     * @return the element from the back or nullptr if queue is empty
+     * @param db Database instance to fill
+     * @param siftThreads number of threads to use for SIFT calculation,
+     *               3 additional but lightweight threads are also created
+     * @param decodeThreads number of threads decoding the images for the SIFT threads
+     * @param maxImageDimension > 0: images larger than this (width or height) are decoded at reduced
+     *               resolution (JPEG DCT scaling 1/2, 1/4, 1/8) and resized to fit.
+     *               Keypoints are stored in coordinates of the original image.
      */
-    std::shared_ptr<Image> pop();
+    DBImporterMT(Database& db, int siftThreads, int decodeThreads = 1, int maxImageDimension = 0);
 
     /**
-     * @brief setFinished: Message mechanism to let consumer threads know that
-     *                      no more elements are coming.
+     * @brief BowFunction: BoW of the SIFT descriptors of one image, called by all SIFT threads at the same time
      */
-    void setFinished();
+    using BowFunction = std::function<std::shared_ptr<BoW>(const cv::Mat& siftDescriptors)>;
     /**
-     * @brief isFinished: Message mechanism to let consumer threads know that
-     *                      no more elements are coming.
-     * @return true if queue is empty and setFinished() was called by a producer thread
+     * @brief EmbeddingFunction: CNN embeddings (one row vector each) of a batch of BGR images,
+     *                           always called from the same thread. An empty embedding (e.g. for an
+     *                           unreadable image) is not saved.
      */
-    bool isFinished() const;
+    using EmbeddingFunction = std::function<std::vector<cv::Mat>(const std::vector<cv::Mat>& images)>;
 
     /**
-     * @return current number of elements in the queue
+     * @brief setBowStage: calculate the BoW of every image right after SIFT and save it with the image
+     *                     (instead of a second pass over the siftTable). Empty function disables the stage.
+     * @param vocabularyKey identifies the vocabulary of bow (see Database::getFBowVocabulary). If the database
+     *                     holds FBoW vectors of another vocabulary, the stage is not run, see bowImported().
      */
-    size_t size() const;
-
-private:
-    bool mFinished = false;
-    std::queue<std::shared_ptr<Image>> mQ;
-    mutable std::mutex mLock;
-};
-
-/**
- * @brief Utility class for filling the database
- *      optimized to use multiple threads
- */
-class PPBAFLOC_CORE_EXPORT DBImporterMT
-{
-public:
+    void setBowStage(BowFunction bow, const QString& vocabularyKey)
+    {
+        mBow = std::move(bow);
+        mBowVocabulary = vocabularyKey;
+    }
     /**
-     * @param db Database instance to fill
-     * @param siftThreads number of threads to use for SIFT calculation,
-     *               4 additional but lightweight threads are also created
+     * @brief bowImported: true if the last import ran the BoW stage, so all images in the database have
+     *                     FBoW vectors of the vocabulary given to setBowStage. Otherwise they have to be
+     *                     calculated again (e.g. FbowRetrieval::fillDBFbow).
+     */
+    bool bowImported() const { return mBowImported; }
+    /**
+     * @brief setEmbeddingStage: calculate the CNN embedding of every image in batches of batchSize from the
+     *                           image decoded for SIFT and save it with the image (instead of decoding all
+     *                           images again). Empty function disables the stage.
      */
-    DBImporterMT(Database& db, int siftThreads);
+    void setEmbeddingStage(EmbeddingFunction embedding, int batchSize)
+    {
+        mEmbedding = std::move(embedding);
+        mEmbeddingBatchSize = std::max(1, batchSize);
+    }
 
     /**
      * @brief importSingleReconstruction: Fill DB with a single COLMAP reconstruction
@@ -82,11 +94,15 @@ private:
     void import(const QString& img, const QString& model);
 
 private:
-    Queue mImportQ;
-    Queue mSiftQ;
-    Queue mSaveQ;
-
     Database& mDB;
 
     int mSiftThreads = 1;
+    int mDecodeThreads = 1;
+    int mMaxImageDimension = 0;
+
+    BowFunction mBow;
+    QString mBowVocabulary;
+    bool mBowImported = false;
+    EmbeddingFunction mEmbedding;
+    int mEmbeddingBatchSize = 1;
 };
@@ -0,0 +1,88 @@
+#ifndef PPBAFLOC_FEATURESTORE_H
+#define PPBAFLOC_FEATURESTORE_H
+
+#include <QByteArray>
+
+#include <functional>
+#include <vector>
+
+#include "ppbafloc-core_export.h"
+
+/**
+ * @brief The FeatureStore class is the storage interface for the per image feature payloads
+ * (SIFT descriptors, keypoints, FBoW and CNN hash vectors). The Database encodes and decodes the
+ * blobs, a FeatureStore only stores them by image id.
+ * Metadata (path, landmark, intrinsics, extrinsics) always stays in SQLite.
+ */
+class PPBAFLOC_CORE_EXPORT FeatureStore
+{
+public:
+    enum class Kind
+    {
+        Sift = 0,
+        KeyPoint,
+        Fbow,
+        Hash
+    };
+    static const int numKinds = 4;
+
+    virtual ~FeatureStore() = default;
+
+    /**
+     * @brief put store (or replace) the blob of one image
+     */
+    virtual bool put(Kind kind, int id, const QByteArray &blob) = 0;
+
+    /**
+     * @brief putBatch store the first size blobs; may be faster than calling put for each of them
+     */
+    virtual bool putBatch(Kind kind, const std::vector<int> &ids, const std::vector<QByteArray> &blobs, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (!put(kind, ids[i], blobs[i]))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief get the blob of one image
+     * @param outBlob empty if there is no blob for id
+     * @return false on a storage error
+     */
+    virtual bool get(Kind kind, int id, QByteArray &outBlob) = 0;
+
+    /**
+     * @brief contains true if there is a non empty blob of kind for id
+     */
+    virtual bool contains(Kind kind, int id)
+    {
+        QByteArray blob;
+        return get(kind, id, blob) && !blob.isEmpty();
+    }
+
+    /**
+     * @brief remove the blob of one image, if there is one
+     */
+    virtual bool remove(Kind kind, int id) = 0;
+
+    /**
+     * @brief forEach calls callback for all stored blobs of kind until it returns false
+     */
+    virtual bool forEach(Kind kind, std::function<bool (int id, const QByteArray &blob)> callback) = 0;
+
+    /**
+     * @brief forEachInRange like forEach, restricted to firstId <= id <= lastId. Blobs are delivered in
+     * ascending id order.
+     */
+    virtual bool forEachInRange(Kind kind, int firstId, int lastId,
+                                std::function<bool (int id, const QByteArray &blob)> callback) = 0;
+
+    /**
+     * @brief flush make all written blobs durable and visible to readers
+     */
+    virtual bool flush() = 0;
+};
+
+#endif // PPBAFLOC_FEATURESTORE_H
@@ -0,0 +1,360 @@
+#include "ShardedFeatureStore.h"
+
+#include <QDebug>
+#include <QDir>
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+
+namespace
+{
+const char *kindNames[FeatureStore::numKinds] = {"sift", "keypoint", "fbow", "hash"};
+
+// one record of a "<kind>.idx" file, host byte order
+struct IndexRecord
+{
+    int32_t id;
+    uint32_t shard;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+static_assert(sizeof(IndexRecord) == 24, "IndexRecord must not be padded");
+}
+
+ShardedFeatureStore::ShardedFeatureStore(qint64 maxShardSize)
+    : mMaxShardSize(maxShardSize)
+{
+
+}
+
+ShardedFeatureStore::~ShardedFeatureStore()
+{
+    close();
+}
+
+bool ShardedFeatureStore::open(const QString &dir)
+{
+    close();
+
+    if (!QDir().mkpath(dir))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore could not create" << dir;
+        return false;
+    }
+    mDir = dir;
+
+    for (int k = 0; k < numKinds; ++k)
+    {
+        mColumns[k] = std::unique_ptr<Column>(new Column);
+        mColumns[k]->name = kindNames[k];
+        if (!openColumn(*mColumns[k]))
+        {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ShardedFeatureStore::close()
+{
+    for (auto &c : mColumns)
+    {
+        if (!c)
+            continue;
+
+        c->writeFile.close();
+        c->indexFile.close();
+        for (auto &s : c->shards)
+        {
+            if (s.map)
+                s.file->unmap(s.map);
+            s.file->close();
+        }
+        c = nullptr;
+    }
+}
+
+QString ShardedFeatureStore::shardPath(const Column &c, uint32_t shard) const
+{
+    return QDir(mDir).filePath(QString("%1.%2.bin").arg(c.name).arg(shard, 4, 10, QChar('0')));
+}
+
+bool ShardedFeatureStore::openColumn(Column &c)
+{
+    for (uint32_t s = 0; QFile::exists(shardPath(c, s)); ++s)
+    {
+        Shard shard;
+        shard.file = std::unique_ptr<QFile>(new QFile(shardPath(c, s)));
+        if (!shard.file->open(QIODevice::ReadOnly))
+        {
+            qDebug() << "ERROR: ShardedFeatureStore could not open" << shard.file->fileName();
+            return false;
+        }
+        c.shards.push_back(std::move(shard));
+    }
+
+    // load the index; records of blobs that never made it to disk completely are dropped
+    c.indexFile.setFileName(QDir(mDir).filePath(c.name + ".idx"));
+    if (c.indexFile.exists())
+    {
+        if (!c.indexFile.open(QIODevice::ReadOnly))
+        {
+            qDebug() << "ERROR: ShardedFeatureStore could not read" << c.indexFile.fileName();
+            return false;
+        }
+        QByteArray data = c.indexFile.readAll();
+        c.indexFile.close();
+
+        const size_t numRecords = data.size() / sizeof(IndexRecord);
+        const IndexRecord *records = reinterpret_cast<const IndexRecord *>(data.constData());
+        c.index.reserve(numRecords);
+        for (size_t i = 0; i < numRecords; ++i)
+        {
+            const IndexRecord &r = records[i];
+            if (r.size == 0)
+            {
+                c.index.erase(r.id); // removed, see remove()
+            }
+            else if (r.shard < c.shards.size()
+                    && r.offset + r.size <= static_cast<uint64_t>(c.shards[r.shard].file->size()))
+            {
+                c.index[r.id] = {r.shard, r.offset, r.size};
+            }
+        }
+
+        // cut off a partially written record so new records stay aligned
+        if (static_cast<size_t>(data.size()) != numRecords * sizeof(IndexRecord))
+            c.indexFile.resize(numRecords * sizeof(IndexRecord));
+    }
+
+    if (!c.indexFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore could not open" << c.indexFile.fileName();
+        return false;
+    }
+
+    if (c.shards.empty())
+        return startShard(c);
+
+    c.writeFile.setFileName(shardPath(c, c.shards.size() - 1));
+    if (!c.writeFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore could not open" << c.writeFile.fileName();
+        return false;
+    }
+    c.writeOffset = c.writeFile.size();
+    return true;
+}
+
+bool ShardedFeatureStore::startShard(Column &c)
+{
+    c.writeFile.close();
+
+    const uint32_t shard = c.shards.size();
+    c.writeFile.setFileName(shardPath(c, shard));
+    if (!c.writeFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore could not create" << c.writeFile.fileName();
+        return false;
+    }
+    c.writeOffset = 0;
+
+    Shard s;
+    s.file = std::unique_ptr<QFile>(new QFile(c.writeFile.fileName()));
+    if (!s.file->open(QIODevice::ReadOnly))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore could not open" << s.file->fileName();
+        return false;
+    }
+    c.shards.push_back(std::move(s));
+    return true;
+}
+
+bool ShardedFeatureStore::mapShard(Column &c, uint32_t shard)
+{
+    // caller holds the exclusive lock of c
+    if (shard + 1 == c.shards.size())
+        c.writeFile.flush();
+
+    Shard &s = c.shards[shard];
+    if (s.map)
+    {
+        s.file->unmap(s.map);
+        s.map = nullptr;
+        s.mapped = 0;
+    }
+
+    const qint64 size = s.file->size();
+    if (size == 0)
+        return true;
+
+    s.map = s.file->map(0, size);
+    if (!s.map)
+    {
+        qDebug() << "ERROR: ShardedFeatureStore could not map" << s.file->fileName();
+        return false;
+    }
+    s.mapped = size;
+    return true;
+}
+
+bool ShardedFeatureStore::put(Kind kind, int id, const QByteArray &blob)
+{
+    Column &c = *mColumns[static_cast<int>(kind)];
+    std::unique_lock<std::shared_timed_mutex> lock(c.mutex);
+
+    if (c.writeOffset > 0 && c.writeOffset + blob.size() > mMaxShardSize)
+    {
+        if (!startShard(c))
+            return false;
+    }
+
+    IndexRecord r;
+    r.id = id;
+    r.shard = c.shards.size() - 1;
+    r.offset = c.writeOffset;
+    r.size = blob.size();
+    r.reserved = 0;
+
+    if (c.writeFile.write(blob) != blob.size()
+            || c.indexFile.write(reinterpret_cast<const char *>(&r), sizeof(r)) != sizeof(r))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore write failed" << c.writeFile.fileName();
+        return false;
+    }
+
+    c.writeOffset += blob.size();
+    c.index[id] = {r.shard, r.offset, r.size};
+    return true;
+}
+
+bool ShardedFeatureStore::get(Kind kind, int id, QByteArray &outBlob)
+{
+    Column &c = *mColumns[static_cast<int>(kind)];
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(c.mutex);
+        auto it = c.index.find(id);
+        if (it == c.index.end() || it->second.size == 0)
+        {
+            outBlob.clear();
+            return true;
+        }
+
+        const Location &loc = it->second;
+        const Shard &s = c.shards[loc.shard];
+        if (s.map && loc.offset + loc.size <= static_cast<uint64_t>(s.mapped))
+        {
+            outBlob = QByteArray(reinterpret_cast<const char *>(s.map + loc.offset), loc.size);
+            return true;
+        }
+    }
+
+    // written after the shard was mapped: flush and map it again
+    std::unique_lock<std::shared_timed_mutex> lock(c.mutex);
+    auto it = c.index.find(id);
+    if (it == c.index.end())
+    {
+        outBlob.clear();
+        return true;
+    }
+
+    const Location loc = it->second;
+    Shard &s = c.shards[loc.shard];
+    if (loc.offset + loc.size > static_cast<uint64_t>(s.mapped) && !mapShard(c, loc.shard))
+        return false;
+
+    outBlob = QByteArray(reinterpret_cast<const char *>(s.map + loc.offset), loc.size);
+    return true;
+}
+
+bool ShardedFeatureStore::contains(Kind kind, int id)
+{
+    Column &c = *mColumns[static_cast<int>(kind)];
+    std::shared_lock<std::shared_timed_mutex> lock(c.mutex);
+    auto it = c.index.find(id);
+    return it != c.index.end() && it->second.size > 0;
+}
+
+bool ShardedFeatureStore::remove(Kind kind, int id)
+{
+    Column &c = *mColumns[static_cast<int>(kind)];
+    std::unique_lock<std::shared_timed_mutex> lock(c.mutex);
+    if (c.index.find(id) == c.index.end())
+        return true;
+
+    IndexRecord r;
+    r.id = id;
+    r.shard = 0;
+    r.offset = 0;
+    r.size = 0;
+    r.reserved = 0;
+    if (c.indexFile.write(reinterpret_cast<const char *>(&r), sizeof(r)) != sizeof(r))
+    {
+        qDebug() << "ERROR: ShardedFeatureStore write failed" << c.indexFile.fileName();
+        return false;
+    }
+    c.index.erase(id);
+    return true;
+}
+
+bool ShardedFeatureStore::forEach(Kind kind, std::function<bool (int, const QByteArray &)> callback)
+{
+    return forEachInRange(kind, std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), callback);
+}
+
+bool ShardedFeatureStore::forEachInRange(Kind kind, int firstId, int lastId,
+                                         std::function<bool (int, const QByteArray &)> callback)
+{
+    Column &c = *mColumns[static_cast<int>(kind)];
+
+    std::vector<int> ids;
+    {
+        // map everything written so far once, so the reads below never have to. The last shard
+        // may still have buffered writes, its logical size is writeOffset.
+        std::unique_lock<std::shared_timed_mutex> lock(c.mutex);
+        for (uint32_t s = 0; s < c.shards.size(); ++s)
+        {
+            const qint64 size = s + 1 == c.shards.size() ? c.writeOffset : c.shards[s].file->size();
+            if (c.shards[s].mapped != size)
+            {
+                if (!mapShard(c, s))
+                    return false;
+            }
+        }
+
+        for (const auto &e : c.index)
+        {
+            if (e.first >= firstId && e.first <= lastId && e.second.size > 0)
+                ids.push_back(e.first);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+
+    QByteArray blob;
+    for (int id : ids)
+    {
+        if (!get(kind, id, blob))
+            return false;
+        if (!callback(id, blob))
+            break;
+    }
+    return true;
+}
+
+bool ShardedFeatureStore::flush()
+{
+    bool ok = true;
+    for (auto &c : mColumns)
+    {
+        if (!c)
+            continue;
+
+        std::unique_lock<std::shared_timed_mutex> lock(c->mutex);
+        ok = c->writeFile.flush() && ok;
+        ok = c->indexFile.flush() && ok;
+    }
+    return ok;
+}
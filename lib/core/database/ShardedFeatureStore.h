@@ -0,0 +1,96 @@
+#ifndef PPBAFLOC_SHARDEDFEATURESTORE_H
+#define PPBAFLOC_SHARDEDFEATURESTORE_H
+
+#include <QFile>
+#include <QString>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "FeatureStore.h"
+#include "ppbafloc-core_export.h"
+
+/**
+ * @brief The ShardedFeatureStore class keeps the feature blobs in append only binary files next
+ * to the database instead of SQLite BLOBs.
+ *
+ * Every kind has its own set of shard files "<kind>.NNNN.bin" holding the raw blobs back to back,
+ * and an index file "<kind>.idx" with one record {id, shard, offset, size} per written blob.
+ * The index is loaded into memory on open (later records replace earlier ones for the same id)
+ * and the shards are memory mapped, so any number of threads can read concurrently; writes are
+ * serialized.
+ *
+ * The store is never compacted: blobs replaced by a later put() or dropped by remove() keep their
+ * space in the shards and their records in the index file. Re-importing a gallery therefore grows
+ * the store; delete the directory and import again to reclaim the space.
+ */
+class PPBAFLOC_CORE_EXPORT ShardedFeatureStore : public FeatureStore
+{
+public:
+    /**
+     * @param maxShardSize a new shard file is started once the current one exceeds this many bytes
+     */
+    explicit ShardedFeatureStore(qint64 maxShardSize = qint64(1) << 30);
+    ~ShardedFeatureStore() override;
+    ShardedFeatureStore(const ShardedFeatureStore &) = delete;
+    ShardedFeatureStore &operator=(const ShardedFeatureStore &) = delete;
+
+    /**
+     * @brief open the store in directory dir, created if it does not exist
+     */
+    bool open(const QString &dir);
+    void close();
+
+    bool put(Kind kind, int id, const QByteArray &blob) override;
+    bool get(Kind kind, int id, QByteArray &outBlob) override;
+    bool contains(Kind kind, int id) override;
+    /**
+     * @brief remove appends an empty record for id, the blob itself stays in its shard
+     */
+    bool remove(Kind kind, int id) override;
+    bool forEach(Kind kind, std::function<bool (int id, const QByteArray &blob)> callback) override;
+    bool forEachInRange(Kind kind, int firstId, int lastId,
+                        std::function<bool (int id, const QByteArray &blob)> callback) override;
+    bool flush() override;
+
+private:
+    struct Location
+    {
+        uint32_t shard;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    struct Shard
+    {
+        std::unique_ptr<QFile> file; // opened read only for mapping
+        uchar *map = nullptr;
+        qint64 mapped = 0;
+    };
+
+    struct Column
+    {
+        QString name;
+        std::unordered_map<int, Location> index;
+        std::vector<Shard> shards;
+        QFile indexFile;   // append
+        QFile writeFile;   // last shard, append
+        qint64 writeOffset = 0;
+        std::shared_timed_mutex mutex;
+    };
+
+    QString shardPath(const Column &c, uint32_t shard) const;
+    bool openColumn(Column &c);
+    bool startShard(Column &c);
+    bool mapShard(Column &c, uint32_t shard);
+
+    QString mDir;
+    qint64 mMaxShardSize;
+    std::array<std::unique_ptr<Column>, numKinds> mColumns;
+};
+
+#endif // PPBAFLOC_SHARDEDFEATURESTORE_H
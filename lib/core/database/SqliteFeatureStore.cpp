@@ -0,0 +1,173 @@
+#include "SqliteFeatureStore.h"
+
+#include <QSqlError>
+#include <QDebug>
+#include <QVariantList>
+
+namespace
+{
+// table and blob column of every FeatureStore::Kind
+const char *tableNames[FeatureStore::numKinds] = {"siftTable", "keypointTable", "fbowTable", "hashTable"};
+const char *columnNames[FeatureStore::numKinds] = {"sift", "keypoint", "fbow", "hash_vector"};
+}
+
+SqliteFeatureStore::SqliteFeatureStore(const QSqlDatabase &db)
+    : db(db)
+{
+
+}
+
+bool SqliteFeatureStore::prepare()
+{
+    for (int k = 0; k < numKinds; ++k)
+    {
+        const QString table = tableNames[k];
+        const QString column = columnNames[k];
+
+        Statements &s = mStatements[k];
+        s.get = QSqlQuery(db);
+        s.put = QSqlQuery(db);
+        s.contains = QSqlQuery(db);
+        s.remove = QSqlQuery(db);
+        if (!s.get.prepare("SELECT " + column + " FROM " + table + " WHERE id = :id;")
+                || !s.put.prepare("INSERT OR REPLACE INTO " + table + " (id, " + column + ") VALUES (:id, :blob);")
+                || !s.contains.prepare("SELECT length(" + column + ") FROM " + table + " WHERE id = :id;")
+                || !s.remove.prepare("DELETE FROM " + table + " WHERE id = :id;"))
+        {
+            qDebug() << "ERROR: SqliteFeatureStore prepare" << table << db.lastError().text();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SqliteFeatureStore::put(Kind kind, int id, const QByteArray &blob)
+{
+    QSqlQuery &query = mStatements[static_cast<int>(kind)].put;
+    query.bindValue(":id", id);
+    query.bindValue(":blob", blob);
+    if (!query.exec())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore put" << tableNames[static_cast<int>(kind)] << query.lastError().text();
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+bool SqliteFeatureStore::putBatch(Kind kind, const std::vector<int> &ids, const std::vector<QByteArray> &blobs, size_t size)
+{
+    QVariantList vlIds, vlBlobs;
+    for (size_t i = 0; i < size; ++i)
+    {
+        vlIds << ids[i];
+        vlBlobs << blobs[i];
+    }
+
+    QSqlQuery &query = mStatements[static_cast<int>(kind)].put;
+    query.bindValue(":id", vlIds);
+    query.bindValue(":blob", vlBlobs);
+    if (!query.execBatch())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore putBatch" << tableNames[static_cast<int>(kind)] << query.lastError().text();
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+bool SqliteFeatureStore::get(Kind kind, int id, QByteArray &outBlob)
+{
+    QSqlQuery &query = mStatements[static_cast<int>(kind)].get;
+    query.bindValue(":id", id);
+    if (!query.exec())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore get" << tableNames[static_cast<int>(kind)] << query.lastError().text();
+        return false;
+    }
+
+    if (query.next())
+        outBlob = query.value(0).toByteArray();
+    else
+        outBlob.clear();
+    query.finish();
+    return true;
+}
+
+bool SqliteFeatureStore::contains(Kind kind, int id)
+{
+    // only the length, the blob itself is not read
+    QSqlQuery &query = mStatements[static_cast<int>(kind)].contains;
+    query.bindValue(":id", id);
+    if (!query.exec())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore contains" << tableNames[static_cast<int>(kind)] << query.lastError().text();
+        return false;
+    }
+
+    const bool found = query.next() && query.value(0).toLongLong() > 0;
+    query.finish();
+    return found;
+}
+
+bool SqliteFeatureStore::remove(Kind kind, int id)
+{
+    QSqlQuery &query = mStatements[static_cast<int>(kind)].remove;
+    query.bindValue(":id", id);
+    if (!query.exec())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore remove" << tableNames[static_cast<int>(kind)] << query.lastError().text();
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+bool SqliteFeatureStore::forEach(Kind kind, std::function<bool (int, const QByteArray &)> callback)
+{
+    const int k = static_cast<int>(kind);
+    QSqlQuery query(db);
+    query.prepare(QString("SELECT id, ") + columnNames[k] + " FROM " + tableNames[k] + ";");
+    if (!query.exec())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore forEach" << tableNames[k] << query.lastError().text();
+        return false;
+    }
+
+    return deliver(query, callback);
+}
+
+bool SqliteFeatureStore::forEachInRange(Kind kind, int firstId, int lastId,
+                                        std::function<bool (int, const QByteArray &)> callback)
+{
+    // id is the rowid, so this is a range scan of the table b-tree
+    const int k = static_cast<int>(kind);
+    QSqlQuery query(db);
+    query.prepare(QString("SELECT id, ") + columnNames[k] + " FROM " + tableNames[k]
+                  + " WHERE id BETWEEN :first AND :last ORDER BY id;");
+    query.bindValue(":first", firstId);
+    query.bindValue(":last", lastId);
+    if (!query.exec())
+    {
+        qDebug() << "ERROR: SqliteFeatureStore forEachInRange" << tableNames[k] << query.lastError().text();
+        return false;
+    }
+
+    return deliver(query, callback);
+}
+
+bool SqliteFeatureStore::deliver(QSqlQuery &query, const std::function<bool (int, const QByteArray &)> &callback)
+{
+    int id;
+    QByteArray blob;
+    while (query.next())
+    {
+        id = query.value(0).toInt();
+        blob = query.value(1).toByteArray();
+        if (!callback(id, blob))
+        {
+            break;
+        }
+    }
+    return true;
+}
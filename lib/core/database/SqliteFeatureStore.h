@@ -0,0 +1,54 @@
+#ifndef PPBAFLOC_SQLITEFEATURESTORE_H
+#define PPBAFLOC_SQLITEFEATURESTORE_H
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+#include <array>
+
+#include "FeatureStore.h"
+#include "ppbafloc-core_export.h"
+
+/**
+ * @brief The SqliteFeatureStore class keeps the feature blobs in the siftTable, keypointTable,
+ * fbowTable and hashTable of the database connection (the original layout).
+ */
+class PPBAFLOC_CORE_EXPORT SqliteFeatureStore : public FeatureStore
+{
+public:
+    /**
+     * @param db open connection, the tables have to exist
+     */
+    explicit SqliteFeatureStore(const QSqlDatabase &db);
+
+    /**
+     * @brief prepare the statements of all kinds
+     */
+    bool prepare();
+
+    bool put(Kind kind, int id, const QByteArray &blob) override;
+    bool putBatch(Kind kind, const std::vector<int> &ids, const std::vector<QByteArray> &blobs, size_t size) override;
+    bool get(Kind kind, int id, QByteArray &outBlob) override;
+    bool contains(Kind kind, int id) override;
+    bool remove(Kind kind, int id) override;
+    bool forEach(Kind kind, std::function<bool (int id, const QByteArray &blob)> callback) override;
+    bool forEachInRange(Kind kind, int firstId, int lastId,
+                        std::function<bool (int id, const QByteArray &blob)> callback) override;
+    bool flush() override {return true;}
+
+private:
+    static bool deliver(QSqlQuery &query, const std::function<bool (int, const QByteArray &)> &callback);
+
+    struct Statements
+    {
+        QSqlQuery get;
+        QSqlQuery put;
+        QSqlQuery contains;
+        QSqlQuery remove;
+    };
+
+    QSqlDatabase db;
+    std::array<Statements, numKinds> mStatements;
+};
+
+#endif // PPBAFLOC_SQLITEFEATURESTORE_H
@@ -1,18 +1,227 @@
 ﻿#include "database.h"
+#include "SqliteFeatureStore.h"
+#include "ShardedFeatureStore.h"
 
 #include <QSqlError>
 #include <QDataStream>
 #include <QDebug>
+#include <QStringList>
+#include <QtEndian>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <unordered_map>
+
+namespace
+{
+// The blobs are written with QDataStream (big endian). Instead of streaming them into temporary
+// QByteArrays again, the decoders below read the header in place and copy the payload once.
+
+// qint32 type, qint32 rows, qint32 cols, quint32 byte count, raw matrix data
+cv::Mat matFromBlob(const QByteArray& data)
+{
+    const int headerSize = 4 * sizeof(qint32);
+    if (data.size() < headerSize)
+        return cv::Mat();
+
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    const int type = qFromBigEndian<qint32>(p);
+    const int rows = qFromBigEndian<qint32>(p + 4);
+    const int cols = qFromBigEndian<qint32>(p + 8);
+    quint32 bytes = qFromBigEndian<quint32>(p + 12);
+    if (bytes == 0xFFFFFFFF) // null QByteArray
+        bytes = 0;
+
+    if (rows <= 0 || cols <= 0)
+        return cv::Mat();
+
+    cv::Mat mat(rows, cols, type);
+    if (bytes != mat.total() * mat.elemSize() || static_cast<quint32>(data.size() - headerSize) < bytes)
+    {
+        qDebug() << "ERROR: corrupt matrix blob";
+        return cv::Mat();
+    }
+
+    std::memcpy(mat.data, p + headerSize, bytes);
+    return mat;
+}
+
+// keypoint blob, version 2: 4 byte magic, quint32 count (little endian), count x Point2f as raw
+// little endian floats. The first magic byte has the high bit set, so read as the big endian count of
+// the legacy format it would be negative and both formats can be told apart.
+const char keyPointMagic[4] = {'\xFF', 'K', 'P', '2'};
+const int keyPointHeaderSize = sizeof(keyPointMagic) + sizeof(quint32);
+
+QByteArray pointsToBlob(const std::vector<cv::Point2f>& points)
+{
+    const quint32 count = static_cast<quint32>(points.size());
+    QByteArray data(keyPointHeaderSize + count * sizeof(cv::Point2f), Qt::Uninitialized);
+    char *p = data.data();
+    std::memcpy(p, keyPointMagic, sizeof(keyPointMagic));
+    qToLittleEndian<quint32>(count, reinterpret_cast<uchar *>(p + sizeof(keyPointMagic)));
+    p += keyPointHeaderSize;
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    if (count > 0)
+        std::memcpy(p, points.data(), count * sizeof(cv::Point2f));
+#else
+    for (const auto &pt : points)
+    {
+        quint32 bits[2];
+        std::memcpy(bits, &pt, sizeof(bits));
+        qToLittleEndian<quint32>(bits[0], reinterpret_cast<uchar *>(p));
+        qToLittleEndian<quint32>(bits[1], reinterpret_cast<uchar *>(p + 4));
+        p += sizeof(cv::Point2f);
+    }
+#endif
+    return data;
+}
+
+// legacy keypoint blob: qint32 count, then count x (x, y) stored as big endian doubles (QDataStream
+// default precision)
+std::vector<cv::Point2f> pointsFromLegacyBlob(const QByteArray& data)
+{
+    if (data.size() < static_cast<int>(sizeof(qint32)))
+        return std::vector<cv::Point2f>();
+
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    const qint32 size = qFromBigEndian<qint32>(p);
+    if (size <= 0 || (data.size() - sizeof(qint32)) / (2 * sizeof(double)) < static_cast<size_t>(size))
+        return std::vector<cv::Point2f>();
+
+    p += sizeof(qint32);
+    std::vector<cv::Point2f> points(size);
+    for (auto &pt : points)
+    {
+        quint64 bits[2] = {qFromBigEndian<quint64>(p), qFromBigEndian<quint64>(p + 8)};
+        double xy[2];
+        std::memcpy(xy, bits, sizeof(xy));
+        pt.x = static_cast<float>(xy[0]);
+        pt.y = static_cast<float>(xy[1]);
+        p += 2 * sizeof(double);
+    }
+    return points;
+}
+
+std::vector<cv::Point2f> pointsFromBlob(const QByteArray& data)
+{
+    if (data.size() < keyPointHeaderSize || std::memcmp(data.constData(), keyPointMagic, sizeof(keyPointMagic)) != 0)
+        return pointsFromLegacyBlob(data);
+
+    const char *p = data.constData() + sizeof(keyPointMagic);
+    const quint32 count = qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(p));
+    p += sizeof(quint32);
+    if (static_cast<size_t>(data.size() - keyPointHeaderSize) / sizeof(cv::Point2f) < count)
+    {
+        qDebug() << "ERROR: corrupt keypoint blob";
+        return std::vector<cv::Point2f>();
+    }
+
+    std::vector<cv::Point2f> points(count);
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    if (count > 0)
+        std::memcpy(points.data(), p, count * sizeof(cv::Point2f));
+#else
+    for (auto &pt : points)
+    {
+        quint32 bits[2] = {qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(p)),
+                           qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(p + 4))};
+        std::memcpy(&pt, bits, sizeof(bits));
+        p += sizeof(cv::Point2f);
+    }
+#endif
+    return points;
+}
+
+// one QByteArray as written by QDataStream: quint32 length, bytes
+// returns nullptr if the blob is too short
+const char *nextBytes(const char *&p, const char *end, quint32 &length)
+{
+    if (end - p < static_cast<std::ptrdiff_t>(sizeof(quint32)))
+        return nullptr;
+    length = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(p));
+    p += sizeof(quint32);
+    if (length == 0xFFFFFFFF) // null QByteArray
+        length = 0;
+    if (static_cast<size_t>(end - p) < length)
+        return nullptr;
+    const char *bytes = p;
+    p += length;
+    return bytes;
+}
+}
 
 Database::Database()
 {
 
 }
 
-Database::Database(bool Compress)
+Database::Database(bool Compress, SiftStorage siftStorage, FeatureBackend featureBackend)
 {
     if(Compress)
         this->doCompress = true;
+    mSiftStorage = siftStorage;
+    mFeatureBackend = featureBackend;
+}
+
+Database::~Database()
+{
+    closeReadConnections();
+    if (mFeatureStore)
+        mFeatureStore->flush();
+}
+
+bool Database::commit()
+{
+    bool ok = true;
+    if (mFeatureStore)
+        ok = mFeatureStore->flush();
+    return db.commit() && ok;
+}
+
+bool Database::siftStorageFromString(const QString &name, SiftStorage &outStorage)
+{
+    const QString n = name.toLower();
+    if (n == "float32")
+        outStorage = SiftStorage::Float32;
+    else if (n == "uint8")
+        outStorage = SiftStorage::UInt8;
+    else if (n == "float16")
+        outStorage = SiftStorage::Float16;
+    else
+        return false;
+    return true;
+}
+
+QString Database::siftStorageToString(SiftStorage storage)
+{
+    switch (storage)
+    {
+    case SiftStorage::UInt8:
+        return "uint8";
+    case SiftStorage::Float16:
+        return "float16";
+    default:
+        return "float32";
+    }
+}
+
+bool Database::featureBackendFromString(const QString &name, FeatureBackend &outBackend)
+{
+    const QString n = name.toLower();
+    if (n == "sqlite")
+        outBackend = FeatureBackend::Sqlite;
+    else if (n == "sharded")
+        outBackend = FeatureBackend::ShardedFiles;
+    else
+        return false;
+    return true;
+}
+
+QString Database::featureBackendToString(FeatureBackend backend)
+{
+    return backend == FeatureBackend::ShardedFiles ? "sharded" : "sqlite";
 }
 
 bool Database::createConnection(QString file)
@@ -34,11 +243,11 @@ bool Database::createConnection(QString file)
     query.exec("PRAGMA page_size = 16384");
     query.exec("PRAGMA cache_size = 131072");
     query.exec("PRAGMA temp_store = MEMORY");
-    query.exec("PRAGMA locking_mode = EXCLUSIVE");
     query.exec("PRAGMA synchronous = OFF");
 
-    query.exec("PRAGMA journal_mode = OFF");
-    //query.exec("PRAGMA journal_mode = MEMORY");
+    // WAL: readers on other connections (see readConnection) are not blocked by the writer
+    query.exec("PRAGMA locking_mode = NORMAL");
+    query.exec("PRAGMA journal_mode = WAL");
 
 
     // ===========create a table of images===========
@@ -50,6 +259,8 @@ bool Database::createConnection(QString file)
                   "landmark             INTEGER,"
                   "intrinsics           BLOB,"
                   "extrinsics           BLOB,"
+                  "file_size            INTEGER,"
+                  "file_mtime           INTEGER,"
                   "CONSTRAINT name_unique UNIQUE(path) ON CONFLICT REPLACE"
                   ");");
     if (!query.exec()) {
@@ -57,6 +268,23 @@ bool Database::createConnection(QString file)
         return false;
     }
 
+    // databases created before incremental imports: size and modification time of the image file
+    // (NULL for the existing rows)
+    QStringList columns;
+    if (query.exec("PRAGMA table_info(mytable);")) {
+        while (query.next())
+            columns << query.value(1).toString();
+    }
+    for (const QString column : {"file_size", "file_mtime"})
+    {
+        if (!columns.contains(column)
+                && !query.exec("ALTER TABLE mytable ADD COLUMN " + column + " INTEGER;"))
+        {
+            qDebug() << "ERROR: ALTER TABLE FAILED mytable: " << query.lastError().text();
+            return false;
+        }
+    }
+
     // create 2. table with sift
     query.prepare("CREATE TABLE IF NOT EXISTS siftTable("
                   "id                   INTEGER PRIMARY KEY,"
@@ -96,21 +324,375 @@ bool Database::createConnection(QString file)
         qDebug() << "ERROR: CREATE TABLE FAILED fbow table: " << query.lastError().text();
         return false;
     }
+
+    // create 6. table with settings of the database file
+    query.prepare("CREATE TABLE IF NOT EXISTS metaTable("
+                  "key                  TEXT PRIMARY KEY,"
+                  "value                TEXT);");
+    if(!query.exec())
+    {
+        qDebug() << "ERROR: CREATE TABLE FAILED meta table: " << query.lastError().text();
+        return false;
+    }
+    query.finish();
+
+    // the sift storage type is fixed when the database is created
+    QString siftStorage = getMetaValue("sift_storage");
+    if (siftStorage.isEmpty())
+    {
+        setMetaValue("sift_storage", siftStorageToString(mSiftStorage));
+    }
+    else
+    {
+        SiftStorage stored;
+        if (siftStorageFromString(siftStorage, stored) && stored != mSiftStorage)
+        {
+            qDebug() << "Database: using sift storage" << siftStorage << "of existing database";
+            mSiftStorage = stored;
+        }
+    }
+
+    // so is the feature backend
+    QString featureBackend = getMetaValue("feature_backend");
+    if (featureBackend.isEmpty())
+    {
+        setMetaValue("feature_backend", featureBackendToString(mFeatureBackend));
+    }
+    else
+    {
+        FeatureBackend stored;
+        if (featureBackendFromString(featureBackend, stored) && stored != mFeatureBackend)
+        {
+            qDebug() << "Database: using feature backend" << featureBackend << "of existing database";
+            mFeatureBackend = stored;
+        }
+    }
+
+    if (mFeatureBackend == FeatureBackend::ShardedFiles)
+    {
+        auto store = std::unique_ptr<ShardedFeatureStore>(new ShardedFeatureStore());
+        if (!store->open(file + ".features"))
+            return false;
+        mFeatureStore = std::move(store);
+    }
+    else
+    {
+        auto store = std::unique_ptr<SqliteFeatureStore>(new SqliteFeatureStore(db));
+        if (!store->prepare())
+            return false;
+        mFeatureStore = std::move(store);
+    }
+
+
+    closeReadConnections();
+    mWriter.db = db;
+    mWriterThread = std::this_thread::get_id();
+    if (!mWriter.statements.prepare(db))
+    {
+        qDebug() << "ERROR: preparing statements failed";
+        return false;
+    }
+
+    return true;
+}
+
+// ==================== connections ====================
+namespace
+{
+// unique per thread; a std::thread::id may be reused once its thread exited
+uint64_t threadSerial()
+{
+    static std::atomic<uint64_t> next(1);
+    thread_local const uint64_t serial = next++;
+    return serial;
+}
+}
+
+/**
+ * @brief The Database::ThreadConnections struct: read connections opened by one thread, closed on that
+ * thread when it exits, so threads that never call releaseThreadConnection do not leak them
+ */
+struct Database::ThreadConnections
+{
+    std::vector<std::weak_ptr<Readers>> readers;
+
+    void add(const std::shared_ptr<Readers> &r)
+    {
+        readers.erase(std::remove_if(readers.begin(), readers.end(),
+                                     [&r](const std::weak_ptr<Readers> &w) {
+                                         return w.expired() || w.lock() == r;
+                                     }),
+                      readers.end());
+        readers.push_back(r);
+    }
+
+    ~ThreadConnections()
+    {
+        for (auto &w : readers)
+        {
+            // the Database may be gone already, its destructor closed the connection then
+            if (std::shared_ptr<Readers> r = w.lock())
+                releaseReader(*r);
+        }
+    }
+};
+
+Database::Connection &Database::readConnection()
+{
+    if (std::this_thread::get_id() == mWriterThread)
+        return mWriter;
+
+    std::lock_guard<std::mutex> lock(mReaders->mutex);
+    std::unique_ptr<Connection> &reader = mReaders->connections[std::this_thread::get_id()];
+    if (reader)
+    {
+        if (reader->threadSerial != threadSerial())
+        {
+            // QSqlDatabase must only be used by the thread that opened it
+            qDebug() << "ERROR: read connection" << reader->db.connectionName()
+                     << "was opened by another thread with the same id";
+            std::abort();
+        }
+        return *reader;
+    }
+
+    static std::atomic<int> counter(0);
+    const QString name = QString("database_reader_%1").arg(counter++);
+
+    auto c = std::unique_ptr<Connection>(new Connection);
+    c->threadSerial = threadSerial();
+    c->db = QSqlDatabase::addDatabase("QSQLITE", name);
+    c->db.setDatabaseName(getFilePath());
+    c->db.setConnectOptions("QSQLITE_OPEN_READONLY");
+    if (!c->db.open() || !c->statements.prepare(c->db))
+    {
+        qDebug() << "ERROR: open read connection" << c->db.lastError().text();
+        std::abort();
+    }
+
+    QSqlQuery query(c->db);
+    query.exec("PRAGMA cache_size = 16384");
+    query.exec("PRAGMA temp_store = MEMORY");
+    query.finish();
+
+    if (mFeatureBackend == FeatureBackend::Sqlite)
+    {
+        c->features = std::unique_ptr<SqliteFeatureStore>(new SqliteFeatureStore(c->db));
+        if (!c->features->prepare())
+            std::abort();
+    }
+
+    thread_local ThreadConnections threadConnections;
+    threadConnections.add(mReaders);
+
+    reader = std::move(c);
+    return *reader;
+}
+
+FeatureStore &Database::readFeatureStore()
+{
+    // the sharded store is thread safe itself
+    if (mFeatureBackend == FeatureBackend::ShardedFiles)
+        return *mFeatureStore;
+
+    Connection &c = readConnection();
+    if (&c == &mWriter)
+        return *mFeatureStore;
+    return *c.features;
+}
+
+void Database::closeConnection(std::unique_ptr<Connection> c)
+{
+    if (!c)
+        return;
+
+    // all queries have to be gone before the connection is removed
+    const QString name = c->db.connectionName();
+    c->features = nullptr;
+    c->statements = Statements();
+    c->db.close();
+    c.reset();
+    QSqlDatabase::removeDatabase(name);
+}
+
+void Database::releaseReader(Readers &readers)
+{
+    std::unique_ptr<Connection> c;
+    {
+        std::lock_guard<std::mutex> lock(readers.mutex);
+        auto it = readers.connections.find(std::this_thread::get_id());
+        if (it == readers.connections.end())
+            return;
+        c = std::move(it->second);
+        readers.connections.erase(it);
+    }
+    closeConnection(std::move(c));
+}
+
+void Database::releaseThreadConnection()
+{
+    releaseReader(*mReaders);
+}
+
+void Database::closeReadConnections()
+{
+    std::lock_guard<std::mutex> lock(mReaders->mutex);
+    for (auto &r : mReaders->connections)
+        closeConnection(std::move(r.second));
+    mReaders->connections.clear();
+}
+
+bool Database::Statements::prepare(const QSqlDatabase &db)
+{
+    const std::vector<std::pair<QSqlQuery *, QString>> statements = {
+        {&getPath, "SELECT path FROM mytable WHERE id = :id;"},
+        {&getLandmarkID, "SELECT landmark FROM mytable WHERE id = :id;"},
+        {&getIntrinsics, "SELECT intrinsics FROM mytable WHERE id = :id;"},
+        {&getExtrinsics, "SELECT extrinsics FROM mytable WHERE id = :id;"},
+        {&addPathExtrinsicsIntrinsics, "UPDATE mytable SET path=:path, intrinsics=:intrinsics, extrinsics=:camera_pose WHERE id=:id;"},
+        {&getFileInfo, "SELECT id, file_size, file_mtime FROM mytable WHERE path = :path;"},
+        {&setFileInfo, "UPDATE mytable SET file_size=:size, file_mtime=:mtime WHERE id=:id;"}
+    };
+
+    for (const auto &s : statements)
+    {
+        *s.first = QSqlQuery(db);
+        if (!s.first->prepare(s.second))
+        {
+            qDebug() << "ERROR: prepare" << s.second << s.first->lastError().text();
+            return false;
+        }
+    }
+
+    setID.clear();
+    for (const std::string tableName : {"mytable"})
+    {
+        std::string dbCommand = "INSERT INTO "+tableName+"(id) "
+                                "SELECT :id "
+                                "WHERE NOT EXISTS"
+                                "(SELECT * FROM "+tableName+" WHERE id=:id);";
+        QSqlQuery query(db);
+        if (!query.prepare(QString::fromStdString(dbCommand)))
+        {
+            qDebug() << "ERROR: prepare setID" << query.lastError().text();
+            return false;
+        }
+        setID[tableName] = query;
+    }
+    return true;
+}
+
+// ==================== meta data ====================
+QString Database::getMetaValue(const QString &key)
+{
+    QSqlQuery query(db);
+    query.prepare("SELECT value FROM metaTable WHERE key = :key;");
+    query.bindValue(":key", key);
+    if(!query.exec() || !query.next()) {
+        return QString();
+    }
+    QString value = query.value(0).toString();
+    query.finish();
+    return value;
+}
+
+bool Database::setMetaValue(const QString &key, const QString &value)
+{
+    QSqlQuery query(db);
+    query.prepare("INSERT OR REPLACE INTO metaTable (key, value) VALUES (:key, :value);");
+    query.bindValue(":key", key);
+    query.bindValue(":value", value);
+    if(!query.exec()) {
+        qDebug() << "ERROR: setMetaValue" << query.lastError().text();
+        return false;
+    }
     query.finish();
+    return true;
+}
 
+// ==================== incremental import ====================
+int Database::getNextID()
+{
+    QSqlQuery query(readConnection().db);
+    if (!query.exec("SELECT MAX(id) FROM mytable;") || !query.next()) {
+        qDebug() << "ERROR: getNextID" << query.lastError().text();
+        return 0;
+    }
+    // NULL for an empty table
+    int next = query.value(0).isNull() ? 0 : query.value(0).toInt() + 1;
+    query.finish();
+    return next;
+}
 
-    mQSaveFbow = QSqlQuery(db);
-    mQSaveFbow.prepare("UPDATE fbowTable SET fbow=:fbow WHERE id=:id;");
+bool Database::getFileInfo(const std::string &path, int &outId, qint64 &outSize, qint64 &outMTime)
+{
+    QSqlQuery &query = readConnection().statements.getFileInfo;
+    query.bindValue(":path", QString::fromStdString(path));
+    if (!query.exec()) {
+        qDebug() << "ERROR: getFileInfo" << query.lastError().text();
+        return false;
+    }
+    if (!query.next()) {
+        query.finish();
+        return false;
+    }
+    outId = query.value(0).toInt();
+    outSize = query.value(1).isNull() ? -1 : query.value(1).toLongLong();
+    outMTime = query.value(2).isNull() ? -1 : query.value(2).toLongLong();
+    query.finish();
+    return true;
+}
 
+bool Database::setFileInfo(int id, qint64 size, qint64 mtime)
+{
+    QSqlQuery &query = mWriter.statements.setFileInfo;
+    query.bindValue(":id", id);
+    query.bindValue(":size", size);
+    query.bindValue(":mtime", mtime);
+    if (!query.exec()) {
+        qDebug() << "ERROR: setFileInfo" << query.lastError().text();
+        return false;
+    }
+    query.finish();
     return true;
 }
 
+QString Database::getImportCheckpoint()
+{
+    return getMetaValue("import_checkpoint");
+}
+
+bool Database::setImportCheckpoint(const QString &checkpoint)
+{
+    return setMetaValue("import_checkpoint", checkpoint);
+}
+
+QString Database::getFBowVocabulary()
+{
+    return getMetaValue("fbow_vocabulary");
+}
+
+bool Database::setFBowVocabulary(const QString &vocabularyKey)
+{
+    return setMetaValue("fbow_vocabulary", vocabularyKey);
+}
+
+bool Database::hasFbow(int id)
+{
+    return readFeatureStore().contains(FeatureStore::Kind::Fbow, id);
+}
+
+bool Database::hasHashVector(int id)
+{
+    return readFeatureStore().contains(FeatureStore::Kind::Hash, id);
+}
+
 // ==================== get all ids ====================
 std::vector<int> Database::getIDList()
 {
     std::vector<int> idList;
 
-    QSqlQuery query(db);
+    QSqlQuery query(readConnection().db);
     query.prepare("SELECT id FROM mytable;");
     if(!query.exec()) {
         qDebug() << "ERROR: getIDList" << query.lastError().text();
@@ -127,7 +709,7 @@ std::vector<int> Database::getIDList()
 
 size_t Database::getNumImages()
 {
-    QSqlQuery query(db);
+    QSqlQuery query(readConnection().db);
     query.prepare("SELECT COUNT(id) FROM mytable;");
     if(!query.exec()) {
         qDebug() << "ERROR: getImageNumber" << query.lastError().text();
@@ -140,7 +722,7 @@ size_t Database::getNumImages()
 
 bool Database::getPathList(std::vector<std::pair<int, std::string>> &outPaths)
 {
-    QSqlQuery query(db);
+    QSqlQuery query(readConnection().db);
     query.prepare("SELECT id, path FROM mytable;");
     if(!query.exec()) {
         qDebug() << "ERROR: getIDList" << query.lastError().text();
@@ -157,13 +739,14 @@ bool Database::getPathList(std::vector<std::pair<int, std::string>> &outPaths)
 // ==================== set id ====================
 bool Database::setID(int id, std::string tableName)
 {
-    std::string dbCommand = "INSERT INTO "+tableName+"(id) "
-                            "SELECT :id "
-                            "WHERE NOT EXISTS"
-                            "(SELECT * FROM "+tableName+" WHERE id=:id);";
+    auto it = mWriter.statements.setID.find(tableName);
+    if (it == mWriter.statements.setID.end())
+    {
+        qDebug() << "ERROR: setID unknown table" << QString::fromStdString(tableName);
+        return false;
+    }
 
-    QSqlQuery query(db);
-    query.prepare(QString::fromStdString(dbCommand));
+    QSqlQuery &query = it->second;
     query.bindValue(":id", id);
     if(!query.exec()) {
         qDebug() << "ERROR: setID" << query.lastError().text();
@@ -177,8 +760,7 @@ bool Database::setID(int id, std::string tableName)
 // ==================== get info from images ====================
 std::string Database::getPath(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT path FROM mytable WHERE id = :id;");
+    QSqlQuery &query = readConnection().statements.getPath;
     query.bindValue(":id", id);
     if(!query.exec()) {
         qDebug() << "ERROR: getPath" << query.lastError().text();
@@ -193,69 +775,35 @@ std::string Database::getPath(int id)
 
 cv::Mat Database::getSift(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT sift FROM siftTable WHERE id = :id;");
-    query.bindValue(":id", id);
-    if(!query.exec()) {
-        qDebug() << "ERROR: getSift" << query.lastError().text();
+    QByteArray data;
+    if (!readFeatureStore().get(FeatureStore::Kind::Sift, id, data)) {
+        qDebug() << "ERROR: getSift";
         std::abort();
-    } else {
-        query.next();
-        QByteArray data = query.value(0).toByteArray();
-
-        if(doCompress == true)
-            data = qUncompress(data);
+    }
 
-        QDataStream stream(&data, QIODevice::ReadOnly);
+    if(doCompress == true)
+        data = qUncompress(data);
 
-        int matType, rows, cols;
-        stream >> matType >> rows >> cols;
-        QByteArray siftByte;
-        stream >> siftByte;
-        auto sift = cv::Mat(rows, cols, matType, (void*)siftByte.data()).clone();
-        query.finish();
-        return sift;
-    }
+    // blobs carry their type, so descriptors of every SiftStorage are read the same way
+    cv::Mat sift = matFromBlob(data);
+    if (!sift.empty() && sift.depth() != CV_32F)
+        sift.convertTo(sift, CV_32F);
+    return sift;
 }
 
 std::vector<cv::Point2f> Database::getKeyPoint(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT keypoint FROM keypointTable WHERE id = :id;");
-    query.bindValue(":id", id);
-    if(!query.exec()) {
-        qDebug() << "ERROR: getKeypoint" << query.lastError().text();
+    QByteArray data;
+    if (!readFeatureStore().get(FeatureStore::Kind::KeyPoint, id, data)) {
+        qDebug() << "ERROR: getKeypoint";
         std::abort();
     }
-    else
-    {
-        query.next();
-        QByteArray data = query.value(0).toByteArray();
-
-        // create QDataStream to decode QByteArray data
-        QDataStream stream(&data, QIODevice::ReadOnly);
-
-        // get size from stream
-        int size;
-        stream >> size;
-
-        // create std::vector according to size
-        std::vector<cv::Point2f> keypoint(size);
-
-        // loop to get all parameters
-        for (int i=0; i<size; i++) {
-            stream >> keypoint[i].x;
-            stream >> keypoint[i].y;
-        }
-        query.finish();
-        return keypoint;
-    }
+    return pointsFromBlob(data);
 }
 
 int Database::getLandmarkID(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT landmark FROM mytable WHERE id = :id;");
+    QSqlQuery &query = readConnection().statements.getLandmarkID;
     query.bindValue(":id", id);
     if(!query.exec()) {
         qDebug() << "ERROR: getLandmarkID" << query.lastError().text();
@@ -272,73 +820,35 @@ int Database::getLandmarkID(int id)
 // ---------- fbow ----------
 QByteArray Database::getFbow(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT fbow FROM fbowTable WHERE id = :id;");
-    query.bindValue(":id", id);
-    if(!query.exec()) {
-        qDebug() << "ERROR: getFbow" << query.lastError().text();
+    QByteArray data;
+    if (!readFeatureStore().get(FeatureStore::Kind::Fbow, id, data)) {
+        qDebug() << "ERROR: getFbow";
         std::abort();
-    } else {
-        query.next();
-        QByteArray data = query.value(0).toByteArray();
-        query.finish();
-        return data;
     }
+    return data;
 }
 
 bool Database::getFBowAll(std::function<bool (int, const QByteArray &)> callback)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT id, fbow FROM fbowTable");
-    if (!query.exec())
-    {
-        qDebug() << "ERROR: getFBowPathAll" << query.lastError().text();
-        return false;
-    }
-
-    int id;
-    QByteArray fbow;
-    while (query.next())
-    {
-        id = query.value(0).toInt();
-        fbow = query.value(1).toByteArray();
-        if (!callback(id, fbow))
-        {
-            break;
-        }
-    }
-    return true;
+    return readFeatureStore().forEach(FeatureStore::Kind::Fbow, callback);
 }
 
 bool Database::getFBowPathAll(std::function<bool (const QString&, const QByteArray &)> callback)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT path, fbow FROM fbowTable INNER JOIN mytable ON fbowTable.id = mytable.id;");
-    if (!query.exec())
-    {
-        qDebug() << "ERROR: getFBowPathAll" << query.lastError().text();
+    std::unordered_map<int, QString> paths;
+    if (!getPathMap(paths))
         return false;
-    }
 
-    QString path;
-    QByteArray fbow;
-    while (query.next())
-    {
-        path = query.value(0).toString();
-        fbow = query.value(1).toByteArray();
-        if (!callback(path, fbow))
-        {
-            break;
-        }
-    }
-    return true;
+    return readFeatureStore().forEach(FeatureStore::Kind::Fbow, [&](int id, const QByteArray &fbow) {
+        auto it = paths.find(id);
+        return it == paths.end() || callback(it->second, fbow);
+    });
 }
 
 // ---------- camera pose ======
 std::vector<double> Database::getCameraPose(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT extrinsics FROM mytable WHERE id = :id;");
+    QSqlQuery &query = readConnection().statements.getExtrinsics;
     query.bindValue(":id", id);
     if(!query.exec()) {
         std::cerr << "ERROR: getExtrinsics" << query.lastError().text().toStdString() << std::endl;
@@ -362,73 +872,131 @@ std::vector<double> Database::getCameraPose(int id)
 
 cv::Mat Database::getHashVector(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT hash_vector FROM hashTable WHERE id = :id;");
-    query.bindValue(":id", id);
-    if(!query.exec())
+    QByteArray data;
+    if (!readFeatureStore().get(FeatureStore::Kind::Hash, id, data))
     {
-        qDebug() << "ERROR: getHashVector" << query.lastError().text();
+        qDebug() << "ERROR: getHashVector";
         std::abort();
-    } else
+    }
+    return matFromBlob(data);
+}
+
+bool Database::getHashAll(std::function<bool (int, QByteArray &)> callback)
+{
+    return readFeatureStore().forEach(FeatureStore::Kind::Hash, [&](int id, const QByteArray &hash) {
+        QByteArray h = hash;
+        return callback(id, h);
+    });
+}
+
+bool Database::getFBowAllParallel(int numThreads, std::function<bool (int, int, const QByteArray &)> callback)
+{
+    return forEachParallel(FeatureStore::Kind::Fbow, numThreads, callback);
+}
+
+bool Database::getHashAllParallel(int numThreads, std::function<bool (int, int, const QByteArray &)> callback)
+{
+    return forEachParallel(FeatureStore::Kind::Hash, numThreads, callback);
+}
+
+bool Database::forEachParallel(FeatureStore::Kind kind, int numThreads,
+                               std::function<bool (int, int, const QByteArray &)> callback)
+{
+    int first, last;
+    if (!getIDRange(first, last))
+        return false;
+    if (first > last)
+        return true; // empty
+
+    // split [first, last] into numThreads ranges of equal id span
+    const qint64 span = qint64(last) - first + 1;
+    numThreads = static_cast<int>(std::max<qint64>(1, std::min<qint64>(numThreads, span)));
+    const qint64 step = (span + numThreads - 1) / numThreads;
+
+    std::atomic<bool> stop(false);
+    std::atomic<bool> ok(true);
+    auto scanPart = [&](int part) {
+        const int lo = static_cast<int>(first + part * step);
+        const int hi = static_cast<int>(std::min<qint64>(last, first + (part + 1) * step - 1));
+        const bool partOk = readFeatureStore().forEachInRange(kind, lo, hi, [&](int id, const QByteArray &blob) {
+            if (stop)
+                return false;
+            if (!callback(part, id, blob))
+                stop = true;
+            return !stop;
+        });
+        if (!partOk)
+            ok = false;
+    };
+
+    if (numThreads == 1)
     {
-        query.next();
-        QByteArray data = query.value(0).toByteArray();
-        QDataStream stream(&data, QIODevice::ReadOnly);
+        scanPart(0);
+        return ok;
+    }
 
-        int matType, rows, cols;
-        stream >> matType >> rows >> cols;
-        QByteArray hashByte;
-        stream >> hashByte;
-        query.finish();
-        return cv::Mat(rows, cols, matType, (void*)hashByte.data()).clone();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+    {
+        threads.push_back(std::thread([&, t]() {
+            scanPart(t);
+            releaseThreadConnection();
+        }));
     }
+    for (auto &t : threads)
+        t.join();
 
+    return ok;
 }
 
-bool Database::getHashAll(std::function<bool (int, QByteArray &)> callback)
+bool Database::getIDRange(int &outFirst, int &outLast)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT id, hash_vector FROM hashTable");
-    if (!query.exec())
-    {
-        qDebug() << "ERROR: getHashAll" << query.lastError().text();
+    QSqlQuery query(readConnection().db);
+    query.prepare("SELECT MIN(id), MAX(id) FROM mytable;");
+    if (!query.exec() || !query.next()) {
+        qDebug() << "ERROR: getIDRange" << query.lastError().text();
         return false;
     }
 
-    int id;
-    QByteArray hash;
-    while (query.next())
+    if (query.value(0).isNull())
     {
-        id = query.value(0).toInt();
-        hash = query.value(1).toByteArray();
-        if (!callback(id, hash))
-        {
-            break;
-        }
+        // no images
+        outFirst = 0;
+        outLast = -1;
+        return true;
     }
+    outFirst = query.value(0).toInt();
+    outLast = query.value(1).toInt();
     return true;
 }
 
 bool Database::getHashPathAll(std::function<bool (const QString &, QByteArray &)> callback)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT path, hash_vector FROM hashTable INNER JOIN mytable ON hashTable.id = mytable.id;");
-    if (!query.exec())
-    {
-        qDebug() << "ERROR: getHashAll" << query.lastError().text();
+    std::unordered_map<int, QString> paths;
+    if (!getPathMap(paths))
+        return false;
+
+    return readFeatureStore().forEach(FeatureStore::Kind::Hash, [&](int id, const QByteArray &hash) {
+        auto it = paths.find(id);
+        if (it == paths.end())
+            return true;
+        QByteArray h = hash;
+        return callback(it->second, h);
+    });
+}
+
+bool Database::getPathMap(std::unordered_map<int, QString> &outPaths)
+{
+    QSqlQuery query(readConnection().db);
+    query.prepare("SELECT id, path FROM mytable;");
+    if(!query.exec()) {
+        qDebug() << "ERROR: getPathMap" << query.lastError().text();
         return false;
     }
 
-    QString path;
-    QByteArray hash;
-    while (query.next())
+    while(query.next())
     {
-        path = query.value(0).toString();
-        hash = query.value(1).toByteArray();
-        if (!callback(path, hash))
-        {
-            break;
-        }
+        outPaths[query.value(0).toInt()] = query.value(1).toString();
     }
     return true;
 }
@@ -437,41 +1005,16 @@ bool Database::getHashPathAll(std::function<bool (const QString &, QByteArray &)
 // ---------- camera intrinsics parameters ----------
 Intrinsics Database::getCameraIntrinsics(int id)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT intrinsics FROM mytable WHERE id = :id;");
+    QSqlQuery &query = readConnection().statements.getIntrinsics;
     query.bindValue(":id", id);
     if(!query.exec()) {
         qDebug() << "ERROR: getCameraIntrinsics" << query.lastError().text();
         std::abort();
     } else {
         query.next();
-        QByteArray data = query.value(0).toByteArray();
-        QDataStream stream(&data, QIODevice::ReadOnly);
-
-        // craete variance
-        QByteArray temp;
-
-        // get imageSize from stream
-        stream >> temp;
-        cv::Size imageSize = *((cv::Size *)temp.data());
-        // get focalLength from stream
-        stream >> temp;
-        cv::Point2d focalLength = *((cv::Point2d *)temp.data());
-        // get principalPoint from stream
-        stream >> temp;
-        cv::Point2d principalPoint = *((cv::Point2d *)temp.data());
-        // get distorionCoefficients from stream
-        stream >> temp;
-
-        // the data get from Intrinsics is a std::vector<double>
-        // however to create an Intrinsics, the distrorionCoefficients should be a 8x1 Matrix
-        // so it need to be transform first
-        cv::Mat distorionCoefficientsMatrix = cv::Mat(8, 1, CV_64F, temp.data());
-
-        // create Intrinsics and return
+        Intrinsics intrinsics = intrinsicsFromByteArray(query.value(0).toByteArray());
         query.finish();
-        return Intrinsics(imageSize, focalLength, principalPoint, distorionCoefficientsMatrix);
-
+        return intrinsics;
     }
 }
 
@@ -490,6 +1033,71 @@ Extrinsics Database::getCameraExtrinsics(int id)
 }
 
 
+// ==================== get info for many images ====================
+bool Database::getImages(const std::vector<int> &ids, std::vector<std::shared_ptr<Image>> &outImages)
+{
+    // stay below SQLITE_MAX_VARIABLE_NUMBER (999 in older sqlite versions)
+    const size_t chunkSize = 500;
+
+    outImages.assign(ids.size(), nullptr);
+
+    std::unordered_map<int, std::vector<size_t>> positions;
+    positions.reserve(ids.size());
+    std::vector<int> uniqueIds;
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        auto &p = positions[ids[i]];
+        if (p.empty())
+            uniqueIds.push_back(ids[i]);
+        p.push_back(i);
+    }
+
+    QSqlQuery query(readConnection().db);
+    size_t preparedSize = 0;
+    for (size_t begin = 0; begin < uniqueIds.size(); begin += chunkSize)
+    {
+        size_t end = std::min(begin + chunkSize, uniqueIds.size());
+
+        // all full chunks share one prepared statement
+        if (end - begin != preparedSize)
+        {
+            preparedSize = end - begin;
+            QString placeholders = "?";
+            for (size_t i = 1; i < preparedSize; ++i)
+                placeholders += ",?";
+            query.prepare("SELECT id, path, intrinsics, extrinsics FROM mytable WHERE id IN (" + placeholders + ");");
+        }
+
+        for (size_t i = begin; i < end; ++i)
+            query.addBindValue(uniqueIds[i]);
+
+        if(!query.exec()) {
+            qDebug() << "ERROR: getImages" << query.lastError().text();
+            return false;
+        }
+
+        while(query.next())
+        {
+            auto img = std::make_shared<Image>();
+            img->id = query.value(0).toInt();
+            img->path = query.value(1).toString().toStdString();
+
+            QByteArray intrinsics = query.value(2).toByteArray();
+            if (!intrinsics.isEmpty())
+                img->intrinsics = intrinsicsFromByteArray(intrinsics);
+            QByteArray extrinsics = query.value(3).toByteArray();
+            if (!extrinsics.isEmpty())
+                img->extrinsics = extrinsicsFromByteArray(extrinsics);
+
+            // duplicate ids share one image
+            for (size_t pos : positions[img->id])
+                outImages[pos] = img;
+        }
+        query.finish();
+    }
+    return true;
+}
+
 // ==================== insert info into DB ====================
 // ---------- image path ----------
 bool Database::addPath(int id, std::string path)
@@ -516,18 +1124,22 @@ bool Database::addPath(int id, std::string path)
 // ---------- sift matrix ----------
 bool Database::addSift(int id, const cv::Mat &sift)
 {
-    // set id if not exists
-    Database::setID(id, "siftTable");
+    // SIFT values are integers in [0, 255] stored as float by OpenCV
+    cv::Mat stored = sift;
+    if (mSiftStorage == SiftStorage::UInt8 && sift.depth() != CV_8U)
+        sift.convertTo(stored, CV_8U);
+    else if (mSiftStorage == SiftStorage::Float16 && sift.depth() != CV_16F)
+        sift.convertTo(stored, CV_16F);
 
     //
     QByteArray data;  // = QByteArray((const char *)&sift, sizeof(sift));
     QDataStream stream(&data, QIODevice::WriteOnly);
 
-    stream << sift.type();
-    stream << sift.rows;
-    stream << sift.cols;
-    const size_t data_size = sift.cols * sift.rows * sift.elemSize();
-    QByteArray siftByte = QByteArray::fromRawData( (const char*)sift.ptr(), data_size );
+    stream << stored.type();
+    stream << stored.rows;
+    stream << stored.cols;
+    const size_t data_size = stored.cols * stored.rows * stored.elemSize();
+    QByteArray siftByte = QByteArray::fromRawData( (const char*)stored.ptr(), data_size );
 
     stream << siftByte;
 
@@ -535,55 +1147,13 @@ bool Database::addSift(int id, const cv::Mat &sift)
     if(doCompress == true)
         data = qCompress(data);
 
-    QSqlQuery query(db);
-    query.prepare("UPDATE siftTable SET sift=:sift WHERE id=:id;");
-    query.bindValue(":id", id);
-    query.bindValue(":sift", data);
-
-    if(!query.exec())
-    {
-        qDebug() << "ERROR: addSift" << query.lastError().text();
-        return false;
-    } else
-    {
-        query.finish();
-        return true;
-    }
+    return mFeatureStore->put(FeatureStore::Kind::Sift, id, data);
 }
 
 // ---------- keypoint ----------
 bool Database::addKeyPoint(int id, const std::vector<cv::Point2f> &keypoint)
 {
-    // set id if not exists
-    Database::setID(id, "keypointTable");
-
-    // get size of std::vector
-    int size = keypoint.size();
-
-    // create a QDataStream to storage all parameters from vector
-    QByteArray data;
-    QDataStream stream(&data, QIODevice::WriteOnly);
-
-    // save size
-    stream << size;
-
-    // loop the full size to storage keypoints
-    for (int i=0; i<size; i++) {
-        stream << keypoint[i].x;
-        stream << keypoint[i].y;
-    }
-
-    QSqlQuery query(db);
-    query.prepare("UPDATE keypointTable SET keypoint=:keypoint WHERE id=:id;");
-    query.bindValue(":id", id);
-    query.bindValue(":keypoint", data);
-    if(!query.exec()) {
-        qDebug() << "ERROR: addKeypoint" << query.lastError().text();
-        return false;
-    } else {
-        query.finish();
-        return true;
-    }
+    return mFeatureStore->put(FeatureStore::Kind::KeyPoint, id, pointsToBlob(keypoint));
 }
 
 bool Database::addKeyPointAndSift(int id, const std::vector<cv::Point2f> &keypoint, const cv::Mat &sift)
@@ -614,22 +1184,14 @@ bool Database::addLandmarkID(int id, int landmarkID)
 // ---------- fbow ----------
 bool Database::addFbow(int id, const QByteArray& fbowVector)
 {
-    // set id if not exists
-    Database::setID(id, "fbowTable");
-
-    QSqlQuery query(db);
-    query.prepare("UPDATE fbowTable SET fbow=:fbow WHERE id=:id;");
+    ++mFBowGeneration;
+    return mFeatureStore->put(FeatureStore::Kind::Fbow, id, fbowVector);
+}
 
-    query.bindValue(":id", id);
-    query.bindValue(":fbow", fbowVector);
-    if(!query.exec()) {
-        qDebug() << "ERROR: add addFbow" << query.lastError().text();
-        query.finish();
-        return false;
-    } else {
-        query.finish();
-        return true;
-    }
+bool Database::removeFbow(int id)
+{
+    ++mFBowGeneration;
+    return mFeatureStore->remove(FeatureStore::Kind::Fbow, id);
 }
 
 bool Database::updateFBoWBatch(const std::vector<int> &ids, std::vector<QByteArray> &bows, int size)
@@ -644,31 +1206,22 @@ bool Database::updateFBoWBatch(const std::vector<int> &ids, std::vector<QByteArr
         throw std::runtime_error("updateFBoWBatch: Invalid argument sizes");
     }
 
-    QVariantList vlIds, vlFbow;
-    for (size_t i = 0; i < static_cast<size_t>(size); ++i)
-    {
-        vlIds << ids[i];
-        vlFbow << bows[i];
-    }
-
+    ++mFBowGeneration;
     db.transaction();
-    mQSaveFbow.bindValue(":id", vlIds);
-    mQSaveFbow.bindValue(":fbow", vlFbow);
-    if (!mQSaveFbow.execBatch())
+    if (!mFeatureStore->putBatch(FeatureStore::Kind::Fbow, ids, bows, size))
     {
         db.rollback();
-        std::cerr << "ERROR query failed in updateFBoWBatch: " << mQSaveFbow.lastError().text().toStdString() << std::endl;
+        std::cerr << "ERROR query failed in updateFBoWBatch" << std::endl;
         return false;
     }
-    db.commit();
-    return true;
+    return commit();
 }
 
 // ---------- pose ----------
 bool Database::addCameraPose(int id, const std::vector<double> cameraPose)
 {
     // set id if not exists
-    Database::setID(id, "myTable");
+    Database::setID(id, "mytable");
 
     // save 6 camerapose -> QByteArray
     QByteArray data;
@@ -697,9 +1250,6 @@ bool Database::addCameraPose(int id, const std::vector<double> cameraPose)
 // ---------- hash vector ----------
 bool Database::addHashVector(int id, const cv::Mat &hashVector)
 {
-    // set id if no exits
-    Database::setID(id, "hashTable");
-
     QByteArray data;
     QDataStream stream(&data, QIODevice::WriteOnly);
 
@@ -711,19 +1261,12 @@ bool Database::addHashVector(int id, const cv::Mat &hashVector)
     QByteArray hashByte = QByteArray::fromRawData((const char*)hashVector.ptr(), data_size);
     stream << hashByte;
 
-    // SQL
-    QSqlQuery query(db);
-    query.prepare("UPDATE hashTable SET hash_vector=:hash_vector WHERE id=:id;");
-    query.bindValue(":id", id);
-    query.bindValue(":hash_vector", data);
+    return mFeatureStore->put(FeatureStore::Kind::Hash, id, data);
+}
 
-    if(!query.exec()) {
-        qDebug() << "ERROR: addHashVector" << query.lastError().text();
-        return false;
-    } else {
-        query.finish();
-        return true;
-    }
+bool Database::removeHashVector(int id)
+{
+    return mFeatureStore->remove(FeatureStore::Kind::Hash, id);
 }
 
 // ---------- camera intrinsics parameters ----------
@@ -796,8 +1339,7 @@ bool Database::addPathExtrinsicsIntrinsics(int id, const std::string& path, cons
   intrinsicsToByteArray(cameraIntrinsics, dataIntrinsics);
   extrinsicsToByteArray(cameraExtrinsics, dataExtrinsics);
 
-  QSqlQuery query(db);
-  query.prepare("UPDATE mytable SET path=:path, intrinsics=:intrinsics, extrinsics=:camera_pose WHERE id=:id;");
+  QSqlQuery &query = mWriter.statements.addPathExtrinsicsIntrinsics;
   query.bindValue(":id", id);
   query.bindValue(":path", qpath);
   query.bindValue(":intrinsics", dataIntrinsics);
@@ -884,3 +1426,56 @@ void Database::extrinsicsToByteArray(const Extrinsics& cameraExtrinsics, QByteAr
     streamExtrinsics << (double)translation[1];
     streamExtrinsics << (double)translation[2];
 }
+
+Intrinsics Database::intrinsicsFromByteArray(const QByteArray &data)
+{
+    if (data.isEmpty())
+        return Intrinsics();
+
+    // four QByteArrays: imageSize, focalLength, principalPoint, distorionCoefficients
+    const char *p = data.constData();
+    const char *end = p + data.size();
+    quint32 lengths[4];
+    const char *imageSize = nextBytes(p, end, lengths[0]);
+    const char *focalLength = nextBytes(p, end, lengths[1]);
+    const char *principalPoint = nextBytes(p, end, lengths[2]);
+    const char *distorion = nextBytes(p, end, lengths[3]);
+    if (!imageSize || !focalLength || !principalPoint || !distorion
+            || lengths[0] != sizeof(cv::Size) || lengths[1] != sizeof(cv::Point2d)
+            || lengths[2] != sizeof(cv::Point2d) || lengths[3] % sizeof(double) != 0)
+    {
+        qDebug() << "ERROR: corrupt intrinsics blob";
+        return Intrinsics();
+    }
+
+    cv::Size size;
+    cv::Point2d focal, principal;
+    std::memcpy(&size, imageSize, sizeof(size));
+    std::memcpy(&focal, focalLength, sizeof(focal));
+    std::memcpy(&principal, principalPoint, sizeof(principal));
+
+    // the data get from Intrinsics is a std::vector<double>
+    // however to create an Intrinsics, the distrorionCoefficients should be a Nx1 Matrix
+    // (empty for default constructed Intrinsics)
+    cv::Mat distorionCoefficientsMatrix;
+    if (lengths[3] > 0)
+    {
+        distorionCoefficientsMatrix.create(lengths[3] / sizeof(double), 1, CV_64F);
+        std::memcpy(distorionCoefficientsMatrix.data, distorion, lengths[3]);
+    }
+
+    return Intrinsics(size, focal, principal, distorionCoefficientsMatrix);
+}
+
+Extrinsics Database::extrinsicsFromByteArray(const QByteArray &data)
+{
+    QDataStream stream(data);
+
+    double pose[6];
+    for (double &p : pose)
+        stream >> p;
+
+    cv::Vec3d rotation = cv::Vec3d(pose[0], pose[1], pose[2]);
+    cv::Vec3d translation = cv::Vec3d(pose[3], pose[4], pose[5]);
+    return Extrinsics(rotation, translation, Extrinsics::TransformationDirection::Ref2Local);
+}
@@ -8,9 +8,19 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
 
 #include "../core/types/intrinsics.h"
 #include "../core/types/extrinsics.h"
+#include "../core/types/image.h"
+#include "FeatureStore.h"
+#include "SqliteFeatureStore.h"
 
 #include "ppbafloc-core_export.h"
 
@@ -21,6 +31,30 @@
 class PPBAFLOC_CORE_EXPORT Database
 {
 public:
+    /**
+     * @brief The SiftStorage enum: element type of the SIFT descriptors in siftTable.
+     * SIFT values are integers in [0, 255], so UInt8 is lossless and a quarter of the size of Float32.
+     * getSift always returns CV_32F, whatever the blob was stored as.
+     */
+    enum class SiftStorage
+    {
+        Float32,
+        UInt8,
+        Float16
+    };
+
+    /**
+     * @brief The FeatureBackend enum: where the feature payloads (sift, keypoints, fbow, hash) are stored.
+     * Sqlite: BLOB columns of the database file.
+     * ShardedFiles: append only shard files in "<database file>.features", see ShardedFeatureStore.
+     * The metadata (path, landmark, intrinsics, extrinsics) is always kept in SQLite.
+     */
+    enum class FeatureBackend
+    {
+        Sqlite,
+        ShardedFiles
+    };
+
     /**
      * @brief Database: create a database instance with default settings
      */
@@ -29,14 +63,63 @@ public:
     /**
      * @brief Database: supply a compression method so save storage usage
      * but may increase runtime
+     * @param siftStorage type new SIFT descriptors are stored with. Only used for new databases,
+     * an existing database keeps the type saved in its metaTable
+     * @param featureBackend storage of the feature payloads. Only used for new databases as well
      */
-    Database(bool);
+    Database(bool, SiftStorage siftStorage = SiftStorage::Float32,
+             FeatureBackend featureBackend = FeatureBackend::Sqlite);
+    ~Database();
+
+    /**
+     * @brief getSiftStorage type addSift stores descriptors with
+     */
+    SiftStorage getSiftStorage() const {return mSiftStorage;}
+
+    /**
+     * @brief siftStorageFromString parse "float32", "uint8" or "float16"
+     * @return false if name is none of them
+     */
+    static bool siftStorageFromString(const QString& name, SiftStorage& outStorage);
+    static QString siftStorageToString(SiftStorage storage);
+
+    /**
+     * @brief getFeatureBackend backend the feature payloads are stored with
+     */
+    FeatureBackend getFeatureBackend() const {return mFeatureBackend;}
+
+    /**
+     * @brief getFBowGeneration changes whenever FBoW vectors are written (addFbow, updateFBoWBatch),
+     * so in memory copies of the fbowTable can tell when they are stale
+     */
+    uint64_t getFBowGeneration() const {return mFBowGeneration;}
+
+    /**
+     * @brief featureBackendFromString parse "sqlite" or "sharded"
+     * @return false if name is none of them
+     */
+    static bool featureBackendFromString(const QString& name, FeatureBackend& outBackend);
+    static QString featureBackendToString(FeatureBackend backend);
 
     /**
      * @brief createConnection: create connection with sqlite3 server
      */
     bool createConnection(QString file);
 
+    /**
+     * @brief releaseThreadConnection: close the read connection of the calling thread.
+     * The get* functions may be called from any number of threads at the same time; every thread
+     * but the one that called createConnection gets its own read only connection (WAL mode), which is
+     * kept until this is called from that thread, the thread exits or the Database is destroyed.
+     * All add*, update* and transaction functions use the single writer connection.
+     */
+    void releaseThreadConnection();
+
+    /**
+     * @brief getFilePath: path of the sqlite3 file of the current connection
+     */
+    QString getFilePath() const {return db.databaseName();}
+
     // get all ids
     /**
      * @brief getIDList: get a list of id of all existent data
@@ -54,6 +137,47 @@ public:
      */
     bool getPathList(std::vector<std::pair<int, std::string>>& outPaths);
 
+    // ==================== incremental import ====================
+    /**
+     * @brief getNextID: first unused id (largest id + 1), new images are appended from here on
+     */
+    int getNextID();
+
+    /**
+     * @brief getFileInfo: look up an image by path (indexed)
+     * @param outSize, outMTime: file size and modification time (ms since epoch) recorded at import,
+     *                           -1 for images imported before this was recorded
+     * @return false if the path is not in the database
+     */
+    bool getFileInfo(const std::string& path, int& outId, qint64& outSize, qint64& outMTime);
+
+    /**
+     * @brief setFileInfo: record size and modification time of the image file with the given id,
+     *                     see getFileInfo
+     */
+    bool setFileInfo(int id, qint64 size, qint64 mtime);
+
+    /**
+     * @brief getImportCheckpoint / setImportCheckpoint: progress of a running import (metaTable),
+     *                     empty if the last import finished
+     */
+    QString getImportCheckpoint();
+    bool setImportCheckpoint(const QString& checkpoint);
+
+    /**
+     * @brief getFBowVocabulary / setFBowVocabulary: key (path|mtime|size) of the vocabulary all FBoW vectors
+     *                     in the fbowTable were calculated with (metaTable), empty if unknown or mixed
+     */
+    QString getFBowVocabulary();
+    bool setFBowVocabulary(const QString& vocabularyKey);
+
+    /**
+     * @brief hasFbow / hasHashVector: true if the image with the given id has a FBoW vector / hash vector,
+     *                     without reading it
+     */
+    bool hasFbow(int id);
+    bool hasHashVector(int id);
+
     // ==================== get data with id ====================
     /**
      * @brief getPath get path with the given id
@@ -65,7 +189,8 @@ public:
      */
     cv::Mat getSift(int id);                           // 2. sift -> 128 float -> cv::Mat
     /**
-     * @brief getKeyPoint get list of SIFT keypoints with the given id
+     * @brief getKeyPoint get list of SIFT keypoints with the given id.
+     * Reads the compact format written by addKeyPoint as well as the legacy QDataStream format.
      */
     std::vector<cv::Point2f> getKeyPoint(int id);                  // 3. features:keypoint -> cv::KeyPoint
     int getLandmarkID(int id);                         // 4. landmark -> integer
@@ -87,6 +212,16 @@ public:
      */
     Extrinsics getCameraExtrinsics(int id);
 
+    // ==================== get data for many ids ====================
+    /**
+     * @brief getImages get path, intrinsics and extrinsics of many images at once.
+     * Ids are looked up in chunks with one "WHERE id IN (...)" query each instead of one query per id and value.
+     * @param ids database ids, may contain duplicates
+     * @param outImages one image per entry of ids (same order) with id, path, intrinsics and extrinsics set,
+     * nullptr if the id does not exist
+     */
+    bool getImages(const std::vector<int>& ids, std::vector<std::shared_ptr<Image>>& outImages);
+
     // ==================== get data for all ids ====================
     /**
      * @brief getFBowAll get all fbow ByteArray in the database with the given id
@@ -98,6 +233,20 @@ public:
      */
     bool getHashAll(std::function<bool (int, QByteArray &)> callback);
 
+    /**
+     * @brief getFBowAllParallel like getFBowAll, but the id range is split into numThreads parts which are
+     * read and handed to callback concurrently, each on its own thread and read connection.
+     * Every part is delivered in ascending id order. The scan stops once a callback returns false.
+     * @param callback called with the index of the part [0, numThreads) it belongs to; has to be thread safe
+     * across parts
+     */
+    bool getFBowAllParallel(int numThreads, std::function<bool (int part, int id, const QByteArray& fbow)> callback);
+
+    /**
+     * @brief getHashAllParallel like getFBowAllParallel for the hash vectors
+     */
+    bool getHashAllParallel(int numThreads, std::function<bool (int part, int id, const QByteArray& hash)> callback);
+
     /**
      * @brief getFBowPathAll get all fbow and path in the database with the given id
      */
@@ -120,7 +269,8 @@ public:
     bool addSift(int id, const cv::Mat &sift);
 
     /**
-     * @brief addKeyPoint add list of SIFT keypoints into the database with the given id
+     * @brief addKeyPoint add list of SIFT keypoints into the database with the given id.
+     * Stored as small header followed by the raw little endian Point2f array.
      */
     bool addKeyPoint(int id, const std::vector<cv::Point2f> &keypoint);
 
@@ -139,6 +289,13 @@ public:
      */
     bool addHashVector(int id, const cv::Mat &hashVector);
 
+    /**
+     * @brief removeFbow / removeHashVector remove the FBoW vector / hash vector of the given id, e.g. when the
+     * image changed and they are not calculated again
+     */
+    bool removeFbow(int id);
+    bool removeHashVector(int id);
+
     /**
      * @brief addCameraIntrinsics add intrinsics parameters into the database with the given id
      */
@@ -183,29 +340,97 @@ public:
     bool transaction() {return db.transaction();}
 
     /**
-     * @brief commit current transaction
+     * @brief commit current transaction and flush the feature store
      */
-    bool commit() {return db.commit();}
+    bool commit();
 
     /**
-     * @brief rollback cancel current transaction
+     * @brief rollback cancel current transaction. Blobs already written to a ShardedFiles
+     * feature store are not rolled back.
      */
     bool rollback() {return db.rollback();}
 
 private:
     QSqlDatabase db;
     bool doCompress = false;
+    SiftStorage mSiftStorage = SiftStorage::Float32;
+    FeatureBackend mFeatureBackend = FeatureBackend::Sqlite;
+    std::unique_ptr<FeatureStore> mFeatureStore;
+    std::atomic<uint64_t> mFBowGeneration{0};
+
+    /**
+     * @brief getMetaValue / setMetaValue: key value settings of the database file (metaTable)
+     */
+    QString getMetaValue(const QString& key);
+    bool setMetaValue(const QString& key, const QString& value);
 
     bool setID(int id, std::string tableName);
 
-    QSqlQuery mQSaveFbow;
+    /**
+     * @brief The Statements struct: queries executed once per image, prepared once per connection
+     * in createConnection instead of on every call
+     */
+    struct Statements
+    {
+        QSqlQuery getPath;
+        QSqlQuery getLandmarkID;
+        QSqlQuery getIntrinsics;
+        QSqlQuery getExtrinsics;
+        QSqlQuery addPathExtrinsicsIntrinsics;
+        QSqlQuery getFileInfo;
+        QSqlQuery setFileInfo;
+        std::map<std::string, QSqlQuery> setID; // per table name
+
+        bool prepare(const QSqlDatabase& db);
+    };
+
+    /**
+     * @brief The Connection struct: one sqlite connection with its prepared statements
+     */
+    struct Connection
+    {
+        QSqlDatabase db;
+        Statements statements;
+        std::unique_ptr<SqliteFeatureStore> features; // FeatureBackend::Sqlite read connections only
+        uint64_t threadSerial = 0; // thread that opened it, see readConnection
+    };
+
+    /**
+     * @brief The Readers struct: read connections per thread. Shared with the threads using them,
+     * so a thread that exits can close its connection if the Database still exists (ThreadConnections).
+     */
+    struct Readers
+    {
+        std::mutex mutex;
+        std::map<std::thread::id, std::unique_ptr<Connection>> connections;
+    };
+    struct ThreadConnections;
+
+    Connection mWriter; // shares db
+    std::thread::id mWriterThread;
+    std::shared_ptr<Readers> mReaders = std::make_shared<Readers>();
+
+    /**
+     * @brief readConnection: connection of the calling thread for reading, created on first use
+     */
+    Connection& readConnection();
+    FeatureStore& readFeatureStore();
+    static void closeConnection(std::unique_ptr<Connection> c);
+    static void releaseReader(Readers& readers);
+    void closeReadConnections();
 
     bool addCameraPose(int id, std::vector<double> cameraPose);
+    bool getPathMap(std::unordered_map<int, QString>& outPaths);
+    bool getIDRange(int& outFirst, int& outLast);
+    bool forEachParallel(FeatureStore::Kind kind, int numThreads,
+                         std::function<bool (int part, int id, const QByteArray& blob)> callback);
     std::vector<double> getCameraPose(int id);
 
 
     void intrinsicsToByteArray(const Intrinsics& intr, QByteArray& outArray);
     void extrinsicsToByteArray(const Extrinsics& extr, QByteArray& outArray);
+    static Intrinsics intrinsicsFromByteArray(const QByteArray& data);
+    static Extrinsics extrinsicsFromByteArray(const QByteArray& data);
 };
 
 #endif // DATABASE_H
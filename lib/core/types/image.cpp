@@ -8,6 +8,7 @@ void Image::forgetImages()
 
 void Image::forgetAll() {
   this->forgetFbow();
+  this->forgetHashVector();
   this->forgetImages();
   this->forgetSiftDescriptors();
   this->forgetSiftKeypoints();
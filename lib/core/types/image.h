@@ -70,6 +70,7 @@ struct PPBAFLOC_CORE_EXPORT Image
     std::vector<cv::KeyPoint> siftKeypoints; //!TEMP! keypoints of image. !USE FORGET WHEN YOU DON'T NEED THEM ANYMORE!
     cv::Mat siftDescriptors; //!TEMP! descriptors of image. !USE FORGET WHEN YOU DON'T NEED THEM ANYMORE!
     std::shared_ptr<BoW> bow = nullptr; //!TEMP! fbow-map of image. !USE FORGET WHEN YOU DON'T NEED THEM ANYMORE!
+    cv::Mat hashVector; //!TEMP! CNN embedding of image. !USE FORGET WHEN YOU DON'T NEED THEM ANYMORE!
     cv::Mat grayscaleImage; //!TEMP! the image in grayscale. !USE FORGET WHEN YOU DON'T NEED THEM ANYMORE!
     cv::Mat colorImage; //!TEMP! the image in rgb. !USE FORGET WHEN YOU DON'T NEED THEM ANYMORE!
     std::shared_ptr<CSVRow> csvrow = nullptr; //For Queryimages while evaluating
@@ -83,6 +84,7 @@ struct PPBAFLOC_CORE_EXPORT Image
     void forgetSiftKeypoints() {siftKeypoints.clear();}
     void forgetSiftDescriptors() { siftDescriptors = cv::Mat();}
     void forgetFbow() {bow = nullptr;}
+    void forgetHashVector() { hashVector = cv::Mat(); }
     void forgetAll();
 
     //2D-3D Correspondences for evaluation
@@ -0,0 +1,135 @@
+#ifndef PPBAFLOC_BOUNDEDQUEUE_H
+#define PPBAFLOC_BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Threadsafe blocking FIFO queue for multiple producers and consumers.
+ *
+ * push() blocks while the queue holds capacity elements, pop() blocks while it is empty.
+ * After close() no more elements are accepted; consumers drain the remaining elements
+ * and then get false from pop().
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    /**
+     * @param capacity maximum number of queued elements, 0 for no limit
+     */
+    explicit BoundedQueue(size_t capacity = 0)
+        : mCapacity(capacity)
+    {
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /**
+     * @brief push: add an element to the back, waits while the queue is full
+     * @return false if the queue was closed, the element is dropped then
+     */
+    bool push(T element)
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        mNotFull.wait(l, [this]() { return mClosed || !full(); });
+        if (mClosed)
+        {
+            return false;
+        }
+        mQ.push_back(std::move(element));
+        l.unlock();
+        mNotEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief pop: remove the element from the front, waits while the queue is empty
+     * @return false if the queue is closed and empty
+     */
+    bool pop(T& element)
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        mNotEmpty.wait(l, [this]() { return mClosed || !mQ.empty(); });
+        if (mQ.empty())
+        {
+            return false;
+        }
+        element = std::move(mQ.front());
+        mQ.pop_front();
+        l.unlock();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief popBatch: waits for at least one element and appends up to maxElements
+     *                  of the queued elements to out
+     * @return number of appended elements, 0 if the queue is closed and empty
+     */
+    size_t popBatch(std::vector<T>& out, size_t maxElements)
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        mNotEmpty.wait(l, [this]() { return mClosed || !mQ.empty(); });
+        size_t n = 0;
+        while (n < maxElements && !mQ.empty())
+        {
+            out.push_back(std::move(mQ.front()));
+            mQ.pop_front();
+            ++n;
+        }
+        l.unlock();
+        if (n > 0)
+        {
+            mNotFull.notify_all();
+        }
+        return n;
+    }
+
+    /**
+     * @brief close: no more elements are coming. Wakes up all waiting producers and consumers.
+     */
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> l(mLock);
+            mClosed = true;
+        }
+        mNotEmpty.notify_all();
+        mNotFull.notify_all();
+    }
+
+    /**
+     * @return true if the queue is empty and close() was called
+     */
+    bool isFinished() const
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        return mClosed && mQ.empty();
+    }
+
+    /**
+     * @return current number of elements in the queue
+     */
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        return mQ.size();
+    }
+
+private:
+    bool full() const { return mCapacity > 0 && mQ.size() >= mCapacity; }
+
+    const size_t mCapacity;
+    bool mClosed = false;
+    std::deque<T> mQ;
+    mutable std::mutex mLock;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+};
+
+#endif // PPBAFLOC_BOUNDEDQUEUE_H
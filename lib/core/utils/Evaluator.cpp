@@ -11,13 +11,9 @@
 #include "../types/image.h"
 #include "../import/colmapimporter.h"
 #include "iohelpers.h"
+#include "LandmarkCsv.h"
 
 namespace {
-    bool sortByIndex(const std::tuple<int, std::string, std::string> &a,
-                     const std::tuple<int, std::string, std::string> &b) {
-        return std::get<0>(a) < std::get<0>(b);
-    }
-
     QString getFullPathByIdentifier(const QString &evalDir, const QString identifier) {
         QString subDirs = "";
         subDirs.append(identifier[0]);
@@ -73,14 +69,6 @@ namespace {
         }
         return imagePaths;
     }
-
-    std::vector<bool> createPredResults(const std::vector<std::tuple<int, std::string, std::string>> &pathLabelList, const std::string &gtLabel) {
-        std::vector<bool> resultList;
-        for (const auto &pathLabelPair: pathLabelList) {
-            resultList.push_back(std::get<2>(pathLabelPair) == gtLabel);
-        }
-        return resultList;
-    }
 }
 
 
@@ -130,26 +118,19 @@ double Evaluator::calculateAPMutlipleQueries(const std::vector<double> &aps) {
 }
 
 void Evaluator::getGoodQueryImages(const std::string &csvPath, const std::string &evalImagesDir, int minNumberImages, int numQueryImages) {
-    QFile file(QString::fromStdString(csvPath));
-    QStringList lineList;
-    QString line;
-    int counter = 0;
-    std::vector<QString> imgNames;
-
-    if (!file.open(QIODevice::ReadOnly)) {
+    auto csv = LandmarkCsv::get(QString::fromStdString(csvPath));
+    if (!csv) {
         std::cout << "Error opening csv train file1" << std::endl;
         return;
     }
+
+    int counter = 0;
     std::cout << "Printing possible query images from train clean csv" << std::endl;
-    while (!file.atEnd()) {
-        line = file.readLine();
-        if (line.length() == 1 || line.isEmpty()) {
-            continue;
-        }
-        if (line.split(',')[1].split(' ').size() >= minNumberImages) {
-            int numberImages = line.split(',')[1].split(' ').size() - 1;
-            int chosenIndex = rand() % numberImages;
-            QString fullPath = getFullPathByIdentifier(QString::fromStdString(evalImagesDir), line.split(',')[1].split(' ')[chosenIndex]);
+    for (int l = 0; l < csv->numLandmarks(); ++l) {
+        const QStringList &images = csv->images(l);
+        if (images.size() >= minNumberImages && !images.isEmpty()) {
+            int chosenIndex = rand() % images.size();
+            QString fullPath = getFullPathByIdentifier(QString::fromStdString(evalImagesDir), images[chosenIndex]);
 
             if (IOHelpers::existsFile(fullPath)) {
                 std::cout << fullPath.toStdString() << std::endl;
@@ -176,51 +157,36 @@ double Evaluator::evaluateRetrieval(const std::string &csvPath, const std::vecto
 
     QString queryName = getOnlyImageName(queryImg->path);
 
-    QFile file(QString::fromStdString(csvPath));
-    QStringList lineList;
-    QString gtLabel;
-    std::vector<QString> labelList;
-    QString line;
-
     std::vector<std::shared_ptr<Image>> filteredList = filterQueryImgFromList(imageList, queryImg);
-    std::vector<std::tuple<int, std::string, std::string>> pathLabelList;
 
     if (numRetrieved < 0) numRetrieved = filteredList.size();
+    const size_t numEvaluated = std::min(filteredList.size(), static_cast<size_t>(numRetrieved));
 
-    std::vector<std::pair<int, QString>> imgNames;
-    int index = 0;
-    for (const auto &img: filteredList) {
-        if (imgNames.size() < numRetrieved) {
-            imgNames.push_back({index, getOnlyImageName(img->path)});
-            index++;
-        }
-    }
-
-    if (!file.open(QIODevice::ReadOnly)) {
+    // parsed once per process, every query only does hash lookups
+    auto csv = LandmarkCsv::get(QString::fromStdString(csvPath));
+    if (!csv) {
         std::cout << "Error opening csv train file2" << std::endl;
         return {};
     }
 
     int numberPossiblePosSamples = 0;
-    while (!file.atEnd()) {
-        line = file.readLine();
-        if (line.length() == 1 || line.isEmpty()) {
-            continue;
-        }
-        if (line.contains(queryName, Qt::CaseSensitive))  {
-            gtLabel = line.split(',')[0];
-            numberPossiblePosSamples = line.split(',')[1].split(' ').size();
-            std::cout << "GT Label found: " << gtLabel.toStdString() << std::endl;
+    int gtLandmark = csv->landmarkIndex(queryName);
+    if (gtLandmark >= 0) {
+        numberPossiblePosSamples = csv->images(gtLandmark).size();
+        std::cout << "GT Label found: " << csv->landmark(gtLandmark).toStdString() << std::endl;
+    }
+
+    // retrieved images which are not part of the csv are not evaluated
+    std::vector<bool> predResults;
+    for (size_t i = 0; i < numEvaluated; i++) {
+        const int landmark = csv->landmarkIndex(getOnlyImageName(filteredList[i]->path));
+        if (landmark >= 0) {
+            predResults.push_back(gtLandmark >= 0 && landmark == gtLandmark);
         }
-        createLabelListOneLine(line, imgNames, pathLabelList);
     }
-
-    sort(pathLabelList.begin(), pathLabelList.end(), sortByIndex);
-    numberPossiblePosSamples = std::min(numberPossiblePosSamples, int(imgNames.size()));
+    numberPossiblePosSamples = std::min(numberPossiblePosSamples, int(numEvaluated));
 
     queryImg->csvrow->maxRightResults = numberPossiblePosSamples;
-    auto predResults = createPredResults(pathLabelList, gtLabel.toStdString());
-
     queryImg->csvrow->retrievelImages = getBoolPathList(filteredList, predResults);
 
     auto prCurve = calculatePRCurve(predResults, numberPossiblePosSamples);
@@ -249,12 +215,6 @@ std::vector<bool> Evaluator::evaluateRetrievalLandmarks(
 {
     QString queryName = getOnlyImageName(queryImg->path);
 
-    QFile file(QString::fromStdString(csvPath));
-    QStringList lineList;
-    QString gtLabel;
-    std::vector<QString> labelList;
-    QString line;
-
     std::vector<std::shared_ptr<Image>> filteredList = filterQueryImgFromList(imageList, queryImg);
     imageList = filteredList;
     if (filteredList.size() < 100) {
@@ -262,43 +222,25 @@ std::vector<bool> Evaluator::evaluateRetrievalLandmarks(
                 << "WARNING: Not enough retrieved Images for Evaluation. "
                 << "Results are not representative and shouldn't be used.";
     }
-    std::vector<std::tuple<int, std::string, std::string>> pathLabelList;
-
-    std::vector<std::pair<int, QString>> imgNames;
-    int index = 0;
-    for (const auto &img: filteredList) {
-        if (imgNames.size() < filteredList.size()) {
-            imgNames.push_back({index, getOnlyImageName(img->path)});
-            index++;
-        }
-    }
 
-    if (!file.open(QIODevice::ReadOnly)) {
+    // parsed once per process, every query only does hash lookups
+    auto csv = LandmarkCsv::get(QString::fromStdString(csvPath));
+    if (!csv) {
         std::cout << "Error opening csv train file3" << std::endl;
         return {};
     }
 
     int possivleRetCount = 0;
-    QStringList list;
-    while (!file.atEnd()) {
-        line = file.readLine();
-        if (line.length() == 1 || line.isEmpty()) {
-            continue;
-        }
-        if (line.contains(queryName, Qt::CaseSensitive))  {
-            list = line.split(',');
-            gtLabel = list.takeAt(0);
-            list = list[0].split(' ');
-            possivleRetCount = list.size();
-            std::cout << "GT Label found: " << gtLabel.toStdString() << std::endl;
-            break;
-        }
-        createLabelListOneLine(line, imgNames, pathLabelList);
+    int gtLandmark = csv->landmarkIndex(queryName);
+    if (gtLandmark >= 0) {
+        possivleRetCount = csv->images(gtLandmark).size();
+        std::cout << "GT Label found: " << csv->landmark(gtLandmark).toStdString() << std::endl;
     }
+
     std::vector<bool> isGoodRefFrame;
     for (auto &img : filteredList) {
         QString refName = getOnlyImageName(img->path);
-        if (list.contains(refName)) {
+        if (gtLandmark >= 0 && csv->landmarkIndex(refName) == gtLandmark) {
             isGoodRefFrame.push_back(true);
         } else {
             isGoodRefFrame.push_back(false);
@@ -541,16 +483,3 @@ double Evaluator::evaluateCorrectDirectory(const std::vector<std::shared_ptr<Ima
     return correctCounter / imageList.size();
 }
 
-bool Evaluator::createLabelListOneLine(QString &searchString, std::vector<std::pair<int, QString>> &stringList, std::vector<std::tuple<int, std::string, std::string>> &pathLabelList)  {
-    int counter = 0;
-    bool contained = false;
-    for (const auto &str: stringList) {
-        if (searchString.contains(str.second, Qt::CaseSensitive)) {
-            counter++;
-            contained = true;
-            pathLabelList.push_back({str.first, str.second.toStdString(), searchString.split(',')[0].toStdString()});
-        }
-    }
-    return contained;
-}
-
@@ -60,14 +60,6 @@ public:
             const std::vector<double> &aps);
 
 private:
-    /**
-     * @brief creates a list of labels from one line of the csv file
-     * @param searchString string to be searched in
-     * @param stringList  strings to be checked whether they are contained in searchString
-     * @param pathLabelList list of labels contained in searchString
-     * @return true if searchString contained any of stringList, else false
-     */
-    bool createLabelListOneLine(QString &searchString, std::vector<std::pair<int, QString>> &stringList, std::vector<std::tuple<int, std::string, std::string>> &pathLabelList);
     /**
      * @brief evaluateRetrievalMultipleModels Deprecated, not used anywhere
      */
@@ -0,0 +1,144 @@
+#include "LandmarkCsv.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QTextStream>
+
+#include <iostream>
+#include <map>
+#include <mutex>
+
+namespace {
+    const quint32 cacheMagic = 0x4C4D4353; // "LMCS"
+    const quint32 cacheVersion = 1;
+}
+
+std::shared_ptr<const LandmarkCsv> LandmarkCsv::get(const QString &csvPath, bool useBinaryCache) {
+    struct Entry {
+        qint64 mtime;
+        qint64 size;
+        std::shared_ptr<const LandmarkCsv> csv;
+    };
+    static std::mutex mutex;
+    static std::map<QString, Entry> loaded;
+
+    QFileInfo info(csvPath);
+    if (!info.exists()) {
+        std::cout << "Error opening csv train file " << csvPath.toStdString() << std::endl;
+        return nullptr;
+    }
+    const QString key = info.absoluteFilePath();
+    const qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+    const qint64 size = info.size();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = loaded.find(key);
+    if (it != loaded.end() && it->second.mtime == mtime && it->second.size == size) {
+        return it->second.csv;
+    }
+
+    auto csv = std::make_shared<LandmarkCsv>();
+    const QString cachePath = csvPath + ".bin";
+    if (!useBinaryCache || !csv->readCache(cachePath, mtime, size)) {
+        if (!csv->parse(csvPath)) {
+            std::cout << "Error opening csv train file " << csvPath.toStdString() << std::endl;
+            return nullptr;
+        }
+        if (useBinaryCache && !csv->writeCache(cachePath, mtime, size)) {
+            std::cout << "Could not write " << cachePath.toStdString() << std::endl;
+        }
+    }
+    csv->buildImageMap();
+
+    loaded[key] = {mtime, size, csv};
+    return csv;
+}
+
+QString LandmarkCsv::imageId(const QString &path) {
+    return QFileInfo(path).fileName().split(".", QString::SkipEmptyParts).value(0);
+}
+
+bool LandmarkCsv::parse(const QString &csvPath) {
+    QFile file(csvPath);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return false;
+    }
+
+    QTextStream in(&file);
+    QString line;
+    while (in.readLineInto(&line)) {
+        const int comma = line.indexOf(',');
+        if (comma < 0) {
+            continue;
+        }
+        const QString landmark = line.left(comma).trimmed();
+        if (landmark == "landmark_id") {
+            continue; // header
+        }
+        mLandmarks.push_back(landmark);
+        mImages.push_back(line.mid(comma + 1).split(' ', QString::SkipEmptyParts));
+    }
+    return true;
+}
+
+bool LandmarkCsv::readCache(const QString &cachePath, qint64 csvMTime, qint64 csvSize) {
+    QFile file(cachePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    quint32 magic, version, count;
+    qint64 mtime, size;
+    stream >> magic >> version >> mtime >> size >> count;
+    if (stream.status() != QDataStream::Ok || magic != cacheMagic || version != cacheVersion
+            || mtime != csvMTime || size != csvSize) {
+        return false; // stale, parse the csv again
+    }
+
+    mLandmarks.resize(count);
+    mImages.resize(count);
+    for (quint32 i = 0; i < count; ++i) {
+        stream >> mLandmarks[i] >> mImages[i];
+    }
+    if (stream.status() != QDataStream::Ok) {
+        mLandmarks.clear();
+        mImages.clear();
+        return false;
+    }
+    return true;
+}
+
+bool LandmarkCsv::writeCache(const QString &cachePath, qint64 csvMTime, qint64 csvSize) const {
+    QSaveFile file(cachePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream << cacheMagic << cacheVersion << csvMTime << csvSize << static_cast<quint32>(mLandmarks.size());
+    for (size_t i = 0; i < mLandmarks.size(); ++i) {
+        stream << mLandmarks[i] << mImages[i];
+    }
+    return stream.status() == QDataStream::Ok && file.commit();
+}
+
+void LandmarkCsv::buildImageMap() {
+    int numImages = 0;
+    for (const auto &images : mImages) {
+        numImages += images.size();
+    }
+
+    mImageToLandmark.clear();
+    mImageToLandmark.reserve(numImages);
+    for (int l = 0; l < numLandmarks(); ++l) {
+        for (const auto &img : mImages[l]) {
+            // first landmark wins, like the line by line search did
+            if (!mImageToLandmark.contains(img))
+                mImageToLandmark.insert(img, l);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef PPBAFLOC_LANDMARKCSV_H
+#define PPBAFLOC_LANDMARKCSV_H
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+#include <memory>
+#include <vector>
+
+#include "ppbafloc-core_export.h"
+
+/**
+ * @brief The LandmarkCsv class: Google Landmarks v2 train_clean.csv ("landmark_id,img_id img_id ...")
+ * parsed once into a hash map image id -> landmark.
+ * The parsed form is kept in "<csv>.bin" next to the csv, so later runs do not parse the csv again.
+ */
+class PPBAFLOC_CORE_EXPORT LandmarkCsv {
+public:
+    /**
+     * @brief get the parsed csv at csvPath. Every file is only loaded once per process, further calls
+     * return the same object as long as the csv does not change.
+     * @param useBinaryCache read and write "<csvPath>.bin"
+     * @return nullptr if the csv can not be read
+     */
+    static std::shared_ptr<const LandmarkCsv> get(const QString &csvPath, bool useBinaryCache = true);
+
+    /**
+     * @param imageId file name of the image without directory and extension
+     * @return true if the image is part of the csv
+     */
+    bool contains(const QString &imageId) const {return mImageToLandmark.contains(imageId);}
+
+    /**
+     * @return index of the landmark of imageId, -1 if it is not part of the csv
+     */
+    int landmarkIndex(const QString &imageId) const {return mImageToLandmark.value(imageId, -1);}
+
+    /**
+     * @brief number of landmarks (lines) in the csv; landmarks are indexed in file order
+     */
+    int numLandmarks() const {return static_cast<int>(mLandmarks.size());}
+    const QString &landmark(int index) const {return mLandmarks[index];}
+    const QStringList &images(int index) const {return mImages[index];}
+
+    /**
+     * @brief imageId file name of path without directory and extension, as used in the csv
+     */
+    static QString imageId(const QString &path);
+
+private:
+    bool parse(const QString &csvPath);
+    bool readCache(const QString &cachePath, qint64 csvMTime, qint64 csvSize);
+    bool writeCache(const QString &cachePath, qint64 csvMTime, qint64 csvSize) const;
+    void buildImageMap();
+
+    std::vector<QString> mLandmarks;
+    std::vector<QStringList> mImages;
+    QHash<QString, int> mImageToLandmark;
+};
+
+#endif // PPBAFLOC_LANDMARKCSV_H
@@ -2,7 +2,10 @@
 #include "SiftHelpers.h"
 #include "iohelpers.h"
 #include <QDirIterator>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
 #if CV_MINOR_VERSION >= 5 && CV_MAJOR_VERSION == 4
 #include <opencv2/features2d.hpp>
 #define Sift cv::SIFT
@@ -13,62 +16,130 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/opencv.hpp>
 
-void SiftHelpers::extractSiftFeaturesImgList(const std::vector<std::string> &imageNames, std::vector<cv::Mat> &descriptors,
-                                      int maxImages) {
+namespace {
+    /**
+     * @brief detector: one SIFT instance per thread, created again only if maxKeypoints changes.
+     */
+    Sift &detector(int maxKeypoints) {
+        thread_local cv::Ptr<Sift> sift;
+        thread_local int siftMaxKeypoints = -1;
+        if (sift.empty() || siftMaxKeypoints != maxKeypoints) {
+            sift = Sift::create(std::max(0, maxKeypoints));
+            siftMaxKeypoints = maxKeypoints;
+        }
+        return *sift;
+    }
+}
 
-    cv::Mat featOneImg;
-    std::vector<cv::KeyPoint> keypoints;
-    for (const auto &img: imageNames) {
-        extractSiftFeatures(img, featOneImg, keypoints);
-        descriptors.push_back(featOneImg);
+void SiftHelpers::extractSiftFeaturesImgList(const std::vector<std::string> &imageNames, std::vector<cv::Mat> &descriptors,
+                                      int maxImages, int numThreads) {
+    std::vector<std::string> names = imageNames;
+    if (maxImages > 0 && names.size() > static_cast<size_t>(maxImages)) {
+        names.resize(maxImages);
     }
+
+    std::vector<cv::Mat> imgDescriptors;
+    extractSiftFeaturesBatch(names, imgDescriptors, nullptr, numThreads);
+    descriptors.insert(descriptors.end(), imgDescriptors.begin(), imgDescriptors.end());
 }
 
-int SiftHelpers::extractSiftFeatures(const std::string &imagename, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints) {
+int SiftHelpers::extractSiftFeatures(const std::string &imagename, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints,
+                                     const Options &options) {
     if(!IOHelpers::existsFile(QString::fromStdString(imagename))) {
         std::cout << "Image file " << imagename << " does not exist." << std::endl;
         return -1;
     }
     cv::Mat input = cv::imread(imagename, cv::IMREAD_GRAYSCALE);
-    std::shared_ptr<Sift> sift_detector = Sift::create();
-    keypoints.clear();
-    sift_detector->detect(input, keypoints);
-    sift_detector->compute(input, keypoints, descriptor);
-
-    input = cv::Mat();
-    return 0;
+    if (input.empty()) {
+        std::cout << "Image file " << imagename << " can not be read." << std::endl;
+        keypoints.clear();
+        descriptor = cv::Mat();
+        return -1;
+    }
+    return extractSiftFeatures(input, descriptor, keypoints, options);
 }
 
-int SiftHelpers::extractSiftFeatures(const cv::Mat &img, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints)
+int SiftHelpers::extractSiftFeatures(const cv::Mat &img, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints,
+                                     const Options &options)
 {
-    std::shared_ptr<Sift> sift_detector = Sift::create();
-
     keypoints.clear();
-    sift_detector->detect(img, keypoints);
-    sift_detector->compute(img, keypoints, descriptor);
+    const double scale = options.downscale;
+    if (scale > 0. && scale < 1.) {
+        cv::Mat small;
+        cv::resize(img, small, cv::Size(), scale, scale, cv::INTER_AREA);
+        detector(options.maxKeypoints).detectAndCompute(small, cv::noArray(), keypoints, descriptor);
+        scaleKeypoints(keypoints, scale);
+    } else {
+        // one pyramid for detection and description
+        detector(options.maxKeypoints).detectAndCompute(img, cv::noArray(), keypoints, descriptor);
+    }
     return 0;
 }
 
-void SiftHelpers::extractSiftFeaturesDir(const std::string &dirname, std::vector<cv::Mat> &features, int maxImages) {
+void SiftHelpers::scaleKeypoints(std::vector<cv::KeyPoint> &keypoints, double scale) {
+    if (scale <= 0. || scale == 1.) {
+        return;
+    }
+    // pixel centers: pixel i of the resized image covers [i, i + 1) / scale in the original
+    for (auto &kp : keypoints) {
+        kp.pt.x = static_cast<float>((kp.pt.x + 0.5) / scale - 0.5);
+        kp.pt.y = static_cast<float>((kp.pt.y + 0.5) / scale - 0.5);
+        kp.size = static_cast<float>(kp.size / scale);
+    }
+}
+
+void SiftHelpers::extractSiftFeaturesBatch(const std::vector<std::string> &imageNames, std::vector<cv::Mat> &descriptors,
+                                           std::vector<std::vector<cv::KeyPoint>> *keypoints, int numThreads,
+                                           const Options &options) {
+    descriptors.assign(imageNames.size(), cv::Mat());
+    if (keypoints != nullptr) {
+        keypoints->assign(imageNames.size(), std::vector<cv::KeyPoint>());
+    }
+    if (numThreads <= 0) {
+        numThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    numThreads = std::min(numThreads, static_cast<int>(imageNames.size()));
+
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        std::vector<cv::KeyPoint> kps;
+        for (size_t i = next++; i < imageNames.size(); i = next++) {
+            extractSiftFeatures(imageNames[i], descriptors[i], keypoints != nullptr ? (*keypoints)[i] : kps, options);
+        }
+    };
+
+    if (numThreads <= 1) {
+        work();
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back(work);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+void SiftHelpers::extractSiftFeaturesDir(const std::string &dirname, std::vector<cv::Mat> &features, int maxImages,
+                                         int numThreads) {
     //making sure only images are processed
     QStringList filter;
     filter << "*.jpg" << "*.png" << "*.jpeg";
     QDirIterator it(QString::fromStdString(dirname), filter, QDir::Files, QDirIterator::Subdirectories);
     features.clear();
-    cv::Mat featOneImg;
-    std::vector<cv::KeyPoint> keypoints;
 
-    int i = 0;
+    std::vector<std::string> paths;
     while(it.hasNext()) {
-        std::string path = it.next().toStdString();
-
-        extractSiftFeatures(path, featOneImg, keypoints);
-        features.push_back(featOneImg);
-
-        std::cout << i++ << ":" << featOneImg.rows << ":" << path << std::endl;
-        if (i >= maxImages && maxImages > 0)
+        paths.push_back(it.next().toStdString());
+        if (static_cast<int>(paths.size()) >= maxImages && maxImages > 0)
             break;
     }
+
+    extractSiftFeaturesBatch(paths, features, nullptr, numThreads);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::cout << i << ":" << features[i].rows << ":" << paths[i] << std::endl;
+    }
 }
 
 void SiftHelpers::siftMatching(const cv::Mat &descriptor1, const cv::Mat &descriptor2, std::vector<cv::DMatch> &goodMatches) {
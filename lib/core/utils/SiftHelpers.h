@@ -2,6 +2,7 @@
 
 #include "ppbafloc-core_export.h"
 #include <string>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <QString>
 
@@ -10,11 +11,41 @@
  */
 class PPBAFLOC_CORE_EXPORT SiftHelpers {
     public:
+    /**
+     * @brief The Options struct: optional limits for SIFT extraction, the defaults extract like before.
+     */
+    struct Options {
+        Options() : maxKeypoints(0), downscale(1.0) {}
+        /// keep only the best maxKeypoints keypoints, 0 keeps all
+        int maxKeypoints;
+        /// images are resized by this factor (0 < downscale <= 1) before the extraction;
+        /// keypoints are returned in coordinates of the original image
+        double downscale;
+    };
+
     //For exctracting Sift Features & Descriptors
-    static int extractSiftFeatures(const std::string &imagename, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints);
-    static int extractSiftFeatures(const cv::Mat& img, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints);
-    static void extractSiftFeaturesDir( const std::string &dirname, std::vector<cv::Mat> &features, int maxImages);
-    static void extractSiftFeaturesImgList(const std::vector<std::string> &imageNames, std::vector<cv::Mat> &descriptors, int maxImages);
+    static int extractSiftFeatures(const std::string &imagename, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints,
+                                   const Options &options = Options());
+    static int extractSiftFeatures(const cv::Mat& img, cv::Mat &descriptor, std::vector<cv::KeyPoint> &keypoints,
+                                   const Options &options = Options());
+    /**
+     * @brief extractSiftFeaturesBatch: extracts the SIFT features of all images on numThreads threads.
+     * Every thread reuses its own detector. Images that can not be read get empty results.
+     * @param keypoints may be nullptr if only the descriptors are needed
+     * @param numThreads <= 0: one thread per core
+     */
+    static void extractSiftFeaturesBatch(const std::vector<std::string> &imageNames, std::vector<cv::Mat> &descriptors,
+                                         std::vector<std::vector<cv::KeyPoint>> *keypoints, int numThreads,
+                                         const Options &options = Options());
+    /**
+     * @brief scaleKeypoints: maps keypoints detected on an image resized by scale (resized / original size)
+     * back to the original image, taking the half pixel offset between the pixel grids into account
+     */
+    static void scaleKeypoints(std::vector<cv::KeyPoint> &keypoints, double scale);
+    static void extractSiftFeaturesDir( const std::string &dirname, std::vector<cv::Mat> &features, int maxImages,
+                                        int numThreads = 1);
+    static void extractSiftFeaturesImgList(const std::vector<std::string> &imageNames, std::vector<cv::Mat> &descriptors, int maxImages,
+                                           int numThreads = 1);
     //Depricated, not used
     static void siftMatching(const cv::Mat &descriptor1, const cv::Mat &descriptor2, std::vector<cv::DMatch> &goodMatches);
 };
@@ -0,0 +1,67 @@
+#include "DescriptorReservoir.h"
+
+#include <stdexcept>
+
+DescriptorReservoir::DescriptorReservoir(size_t capacity, uint64_t seed)
+    : mCapacity(capacity), mRng(seed) {}
+
+void DescriptorReservoir::add(const cv::Mat &descriptors) {
+  if (descriptors.empty()) {
+    return;
+  }
+
+  if (mCapacity == 0) {
+    // keep everything: one copy per image, the reservoir never reallocates
+    cv::Mat copy = descriptors.clone();
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mAll.empty() && (descriptors.cols != mAll.front().cols ||
+                          descriptors.type() != mAll.front().type())) {
+      throw std::invalid_argument(
+          "DescriptorReservoir: descriptors of different size or type");
+    }
+    mAll.push_back(copy);
+    mSeen += descriptors.rows;
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (mSample.empty()) {
+    mSample.create(static_cast<int>(mCapacity), descriptors.cols,
+                   descriptors.type());
+  } else if (descriptors.cols != mSample.cols ||
+             descriptors.type() != mSample.type()) {
+    throw std::invalid_argument(
+        "DescriptorReservoir: descriptors of different size or type");
+  }
+
+  for (int r = 0; r < descriptors.rows; ++r) {
+    ++mSeen;
+    if (mRows < mCapacity) {
+      descriptors.row(r).copyTo(mSample.row(static_cast<int>(mRows++)));
+      continue;
+    }
+
+    // keep the new row with probability capacity / seen
+    std::uniform_int_distribution<uint64_t> dist(0, mSeen - 1);
+    const uint64_t j = dist(mRng);
+    if (j < mCapacity) {
+      descriptors.row(r).copyTo(mSample.row(static_cast<int>(j)));
+    }
+  }
+}
+
+std::vector<cv::Mat> DescriptorReservoir::sample() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (mCapacity == 0) {
+    return mAll;
+  }
+  if (mRows == 0) {
+    return std::vector<cv::Mat>();
+  }
+  return {mSample.rowRange(0, static_cast<int>(mRows))};
+}
+
+uint64_t DescriptorReservoir::seen() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mSeen;
+}
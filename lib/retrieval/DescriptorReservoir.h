@@ -0,0 +1,58 @@
+#ifndef PPBAFLOC_DESCRIPTORRESERVOIR_H
+#define PPBAFLOC_DESCRIPTORRESERVOIR_H
+
+#include <cstdint>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <random>
+#include <vector>
+
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The DescriptorReservoir class: uniform random sample of at most
+ * capacity descriptor rows out of a stream of descriptor matrices of unknown
+ * total size (reservoir sampling, algorithm R). Memory stays bounded by
+ * capacity rows no matter how many images are added. With capacity 0 every
+ * matrix is kept as it was added, without ever copying the rows a second
+ * time.
+ *
+ * add() may be called from several threads.
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT DescriptorReservoir {
+ public:
+  /**
+   * @param capacity maximum number of kept rows, 0 keeps all rows
+   * @param seed the sample is reproducible for the same order of add() calls
+   */
+  explicit DescriptorReservoir(size_t capacity, uint64_t seed = 42);
+
+  /**
+   * @brief add offers all rows of descriptors (one descriptor per row). All
+   * matrices must have the same number of columns and type.
+   */
+  void add(const cv::Mat &descriptors);
+
+  /**
+   * @return the sampled rows, one matrix with the reservoir or the added
+   * matrices when nothing is subsampled. The matrices share their data with
+   * the reservoir and stay valid until the next add().
+   */
+  std::vector<cv::Mat> sample() const;
+
+  /**
+   * @return number of rows offered so far
+   */
+  uint64_t seen() const;
+
+ private:
+  size_t mCapacity;
+  cv::Mat mSample;    // capacity rows, only with capacity > 0
+  size_t mRows = 0;   // valid rows of mSample
+  std::vector<cv::Mat> mAll;  // every added matrix, only with capacity 0
+  uint64_t mSeen = 0;
+  std::mt19937_64 mRng;
+  mutable std::mutex mMutex;
+};
+
+#endif  // PPBAFLOC_DESCRIPTORRESERVOIR_H
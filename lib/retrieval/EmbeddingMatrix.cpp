@@ -0,0 +1,232 @@
+#include "EmbeddingMatrix.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+
+namespace {
+const char kMagic[8] = {'P', 'P', 'B', 'A', 'E', 'M', 'B', '1'};
+const uint32_t kVersion = 1;
+const qint64 kHeaderSize = 64;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint64_t rows;
+  uint64_t idOffset;
+  char reserved[kHeaderSize - 32];
+};
+static_assert(sizeof(Header) == kHeaderSize, "Unexpected header size");
+}  // namespace
+
+EmbeddingMatrix::~EmbeddingMatrix() { close(); }
+
+bool EmbeddingMatrix::open(const QString& file) {
+  close();
+
+  mFile.setFileName(file);
+  if (!mFile.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+
+  const qint64 size = mFile.size();
+  if (size < kHeaderSize) {
+    close();
+    return false;
+  }
+
+  mMapped = mFile.map(0, size);
+  if (mMapped == nullptr) {
+    std::cout << "EmbeddingMatrix: mmap failed for " << file.toStdString()
+              << std::endl;
+    close();
+    return false;
+  }
+
+  Header h;
+  std::memcpy(&h, mMapped, sizeof(h));
+  if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 ||
+      h.version != kVersion || h.dim == 0 ||
+      h.idOffset != kHeaderSize + h.rows * h.dim * sizeof(float) ||
+      static_cast<uint64_t>(size) < h.idOffset + h.rows * sizeof(int32_t)) {
+    std::cout << "EmbeddingMatrix: invalid file " << file.toStdString()
+              << std::endl;
+    close();
+    return false;
+  }
+
+  mRows = h.rows;
+  mDim = static_cast<int>(h.dim);
+  mData = reinterpret_cast<const float*>(mMapped + kHeaderSize);
+  mIds = reinterpret_cast<const int32_t*>(mMapped + h.idOffset);
+  return true;
+}
+
+uint64_t EmbeddingMatrix::fingerprint() const {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  auto add = [&hash](uint64_t value) {
+    for (int b = 0; b < 8; ++b) {
+      hash ^= (value >> (8 * b)) & 0xFF;
+      hash *= 1099511628211ULL;
+    }
+  };
+  add(mRows);
+  add(static_cast<uint64_t>(mDim));
+  for (size_t i = 0; i < mRows; ++i) {
+    add(static_cast<uint32_t>(mIds[i]));
+  }
+  return hash;
+}
+
+void EmbeddingMatrix::close() {
+  if (mMapped != nullptr) {
+    mFile.unmap(mMapped);
+  }
+  mFile.close();
+  mMapped = nullptr;
+  mData = nullptr;
+  mIds = nullptr;
+  mRows = 0;
+  mDim = 0;
+}
+
+cv::Mat EmbeddingMatrix::mat() const {
+  if (mData == nullptr) {
+    return cv::Mat();
+  }
+  return cv::Mat(static_cast<int>(mRows), mDim, CV_32F,
+                 const_cast<float*>(mData));
+}
+
+bool EmbeddingMatrixWriter::open(const QString& file, int dim) {
+  mPath = file;
+  mDim = dim;
+  mIds.clear();
+
+  mFile.setFileName(file + ".tmp");
+  if (!mFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    std::cout << "EmbeddingMatrixWriter: could not open "
+              << mFile.fileName().toStdString() << std::endl;
+    return false;
+  }
+
+  // placeholder, the real header is written in finish()
+  Header h;
+  std::memset(&h, 0, sizeof(h));
+  return mFile.write(reinterpret_cast<const char*>(&h), sizeof(h)) ==
+         kHeaderSize;
+}
+
+bool EmbeddingMatrixWriter::append(int id, const cv::Mat& embedding) {
+  if (!mFile.isOpen() || embedding.type() != CV_32F ||
+      embedding.total() != static_cast<size_t>(mDim)) {
+    return false;
+  }
+
+  const cv::Mat row = embedding.isContinuous() ? embedding : embedding.clone();
+  const qint64 bytes = mDim * sizeof(float);
+  if (mFile.write(reinterpret_cast<const char*>(row.ptr<float>()), bytes) !=
+      bytes) {
+    return false;
+  }
+  mIds.push_back(id);
+  return true;
+}
+
+bool EmbeddingMatrixWriter::finish() {
+  if (!mFile.isOpen()) {
+    return false;
+  }
+
+  if (!std::is_sorted(mIds.begin(), mIds.end()) && !sortRows()) {
+    std::cout << "EmbeddingMatrixWriter: sorting " << mPath.toStdString()
+              << " failed" << std::endl;
+    mFile.close();
+    QFile::remove(mFile.fileName());
+    return false;
+  }
+
+  Header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, kMagic, sizeof(kMagic));
+  h.version = kVersion;
+  h.dim = static_cast<uint32_t>(mDim);
+  h.rows = mIds.size();
+  h.idOffset = kHeaderSize + h.rows * h.dim * sizeof(float);
+
+  const qint64 idBytes = mIds.size() * sizeof(int32_t);
+  bool ok = mFile.write(reinterpret_cast<const char*>(mIds.data()), idBytes) ==
+            idBytes;
+  ok = ok && mFile.seek(0) &&
+       mFile.write(reinterpret_cast<const char*>(&h), sizeof(h)) ==
+           kHeaderSize;
+  mFile.close();
+
+  if (!ok) {
+    std::cout << "EmbeddingMatrixWriter: writing " << mPath.toStdString()
+              << " failed" << std::endl;
+    QFile::remove(mFile.fileName());
+    return false;
+  }
+
+  QFile::remove(mPath);
+  return QFile::rename(mFile.fileName(), mPath);
+}
+
+bool EmbeddingMatrixWriter::sortRows() {
+  std::vector<size_t> order(mIds.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [this](size_t a, size_t b) { return mIds[a] < mIds[b]; });
+
+  // copy the rows in id order from the mapped file into a second one
+  if (!mFile.flush()) {
+    return false;
+  }
+  const qint64 rowBytes = mDim * sizeof(float);
+  QFile in(mFile.fileName());
+  if (!in.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  uchar* data = in.map(kHeaderSize, mIds.size() * rowBytes);
+  if (data == nullptr) {
+    return false;
+  }
+
+  QFile out(mPath + ".sorted.tmp");
+  bool ok = out.open(QIODevice::WriteOnly | QIODevice::Truncate);
+  Header h;
+  std::memset(&h, 0, sizeof(h));
+  ok = ok && out.write(reinterpret_cast<const char*>(&h), sizeof(h)) ==
+                 kHeaderSize;
+  std::vector<int32_t> ids(mIds.size());
+  for (size_t i = 0; ok && i < order.size(); ++i) {
+    ok = out.write(reinterpret_cast<const char*>(data + order[i] * rowBytes),
+                   rowBytes) == rowBytes;
+    ids[i] = mIds[order[i]];
+  }
+  in.unmap(data);
+  in.close();
+  out.close();
+  if (!ok) {
+    QFile::remove(out.fileName());
+    return false;
+  }
+
+  // continue with the sorted file, finish() appends the ids and the header
+  const QString file = mFile.fileName();
+  mFile.close();
+  QFile::remove(file);
+  if (!QFile::rename(out.fileName(), file)) {
+    return false;
+  }
+  mFile.setFileName(file);
+  if (!mFile.open(QIODevice::ReadWrite) || !mFile.seek(mFile.size())) {
+    return false;
+  }
+  mIds.swap(ids);
+  return true;
+}
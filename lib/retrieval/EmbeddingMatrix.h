@@ -0,0 +1,104 @@
+#ifndef PPBAFLOC_EMBEDDINGMATRIX_H
+#define PPBAFLOC_EMBEDDINGMATRIX_H
+
+#include <QFile>
+#include <QString>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The EmbeddingMatrix class: read only, memory mapped view of a file
+ * holding N CNN embeddings as one contiguous N x dim float32 matrix plus the
+ * database id of every row.
+ *
+ * File layout (host byte order):
+ *   [0, 64)           header, see EmbeddingMatrixWriter
+ *   [64, 64 + N*dim*4) row major float32 matrix (64 byte aligned)
+ *   [..., ... + N*4)  int32 database ids, one per row
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT EmbeddingMatrix {
+ public:
+  EmbeddingMatrix() = default;
+  ~EmbeddingMatrix();
+  EmbeddingMatrix(const EmbeddingMatrix &) = delete;
+  EmbeddingMatrix &operator=(const EmbeddingMatrix &) = delete;
+
+  /**
+   * @brief open maps the embedding file into memory
+   * @return false if the file does not exist or is not a valid embedding file
+   */
+  bool open(const QString &file);
+  void close();
+  bool isOpen() const { return mData != nullptr; }
+
+  size_t rows() const { return mRows; }
+  int dim() const { return mDim; }
+
+  /**
+   * @return pointer to the first element of the rows() x dim() matrix
+   */
+  const float *data() const { return mData; }
+  const float *row(size_t i) const { return mData + i * mDim; }
+  int id(size_t i) const { return mIds[i]; }
+  const int32_t *ids() const { return mIds; }
+
+  /**
+   * @return the whole matrix as cv::Mat header without copying any data
+   */
+  cv::Mat mat() const;
+
+  /**
+   * @brief fingerprint of the row layout (rows, dim and the id of every row),
+   * so files derived from the row numbers (IvfPqIndex) can tell whether they
+   * still belong to this matrix
+   */
+  uint64_t fingerprint() const;
+
+ private:
+  QFile mFile;
+  uchar *mMapped = nullptr;
+  const float *mData = nullptr;
+  const int32_t *mIds = nullptr;
+  size_t mRows = 0;
+  int mDim = 0;
+};
+
+/**
+ * @brief The EmbeddingMatrixWriter class: writes embeddings row by row into a
+ * file readable by EmbeddingMatrix. Data goes into "<file>.tmp" first which
+ * replaces file in finish(), so readers never see a half written matrix.
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT EmbeddingMatrixWriter {
+ public:
+  /**
+   * @param dim length of every embedding, e.g. 512 for torchreid models
+   */
+  bool open(const QString &file, int dim);
+  /**
+   * @brief append one embedding (1 x dim, CV_32F)
+   */
+  bool append(int id, const cv::Mat &embedding);
+  /**
+   * @brief finish sorts the rows by id if they were not appended in that
+   * order, writes the id column and header and moves the file to its final
+   * location. So the file is the same whatever order the rows were computed
+   * in.
+   */
+  bool finish();
+
+  bool isOpen() const { return mFile.isOpen(); }
+  size_t rows() const { return mIds.size(); }
+
+ private:
+  bool sortRows();
+
+  QString mPath;
+  QFile mFile;
+  int mDim = 0;
+  std::vector<int32_t> mIds;
+};
+
+#endif  // PPBAFLOC_EMBEDDINGMATRIX_H
@@ -0,0 +1,134 @@
+#include "EmbeddingScorer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+// 512 rows of 512 floats = 1 MB per tile, stays in L2/L3 while all queries
+// are multiplied with it
+const int kTileRows = 512;
+
+// relative error bound of |q|^2 + |g|^2 - 2 q.g in float, generous for the
+// embedding sizes used here
+const double kApproxTolerance = 1e-4;
+
+double exactDistance2(const float *q, const float *g, int dim) {
+  double sum = 0.;
+  for (int k = 0; k < dim; ++k) {
+    const double diff = static_cast<double>(q[k]) - g[k];
+    sum += diff * diff;
+  }
+  return sum;
+}
+}  // namespace
+
+EmbeddingScorer::EmbeddingScorer(const std::vector<cv::Mat> &queries,
+                                 size_t k, int numThreads)
+    : mThreads(std::max(1, numThreads)), mTopK(queries.size(), Collector(k)) {
+  if (queries.empty()) {
+    return;
+  }
+
+  const int dim = static_cast<int>(queries[0].total());
+  mQueries.create(static_cast<int>(queries.size()), dim, CV_32F);
+  mQueryNorms.resize(queries.size());
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (queries[i].type() != CV_32F ||
+        queries[i].total() != static_cast<size_t>(dim)) {
+      throw std::runtime_error(
+          "EmbeddingScorer: query embeddings differ in size or type");
+    }
+    queries[i].reshape(1, 1).copyTo(mQueries.row(static_cast<int>(i)));
+    mQueryNorms[i] = static_cast<float>(
+        cv::norm(mQueries.row(static_cast<int>(i)), cv::NORM_L2SQR));
+  }
+}
+
+void EmbeddingScorer::score(const cv::Mat &gallery, const int *ids) {
+  if (gallery.empty() || mQueries.empty()) {
+    return;
+  }
+  if (gallery.type() != CV_32F || gallery.cols != mQueries.cols) {
+    throw std::runtime_error(
+        "EmbeddingScorer: gallery does not match query dimension");
+  }
+
+  const int numTiles = (gallery.rows + kTileRows - 1) / kTileRows;
+  const int workers = std::min(mThreads, numTiles);
+
+  auto run = [&](int worker, std::vector<Collector> &topK) {
+    cv::Mat dots;
+    for (int t = worker; t < numTiles; t += workers) {
+      const int begin = t * kTileRows;
+      const int end = std::min(begin + kTileRows, gallery.rows);
+      scoreTile(gallery.rowRange(begin, end), ids + begin, topK, dots);
+    }
+  };
+
+  if (workers <= 1) {
+    run(0, mTopK);
+    return;
+  }
+
+  std::vector<std::vector<Collector>> local(
+      workers, std::vector<Collector>(mTopK.size(), Collector(mTopK[0].k())));
+  std::vector<std::thread> threads;
+  for (int w = 0; w < workers; ++w) {
+    threads.push_back(std::thread(run, w, std::ref(local[w])));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  for (const auto &l : local) {
+    for (size_t q = 0; q < mTopK.size(); ++q) {
+      mTopK[q].merge(l[q]);
+    }
+  }
+}
+
+void EmbeddingScorer::scoreTile(const cv::Mat &tile, const int *ids,
+                                std::vector<Collector> &topK,
+                                cv::Mat &dots) const {
+  cv::gemm(mQueries, tile, 1.0, cv::noArray(), 0.0, dots, cv::GEMM_2_T);
+
+  std::vector<float> tileNorms(tile.rows);
+  for (int j = 0; j < tile.rows; ++j) {
+    const float *g = tile.ptr<float>(j);
+    float n = 0.f;
+    for (int k = 0; k < tile.cols; ++k) {
+      n += g[k] * g[k];
+    }
+    tileNorms[j] = n;
+  }
+
+  for (int q = 0; q < dots.rows; ++q) {
+    const float *d = dots.ptr<float>(q);
+    const float *qv = mQueries.ptr<float>(q);
+    const float qn = mQueryNorms[q];
+    Collector &c = topK[q];
+    for (int j = 0; j < dots.cols; ++j) {
+      // the expanded form cancels badly for near duplicates, it only
+      // preselects candidates (with a margin for its float rounding error)
+      const float approx = qn + tileNorms[j] - 2.f * d[j];
+      const double margin = kApproxTolerance * (qn + tileNorms[j]);
+      if (c.accepts(approx - margin)) {
+        c.push(ids[j], exactDistance2(qv, tile.ptr<float>(j), tile.cols));
+      }
+    }
+  }
+}
+
+std::vector<std::vector<std::pair<int, double>>> EmbeddingScorer::results()
+    const {
+  std::vector<std::vector<std::pair<int, double>>> out(mTopK.size());
+  for (size_t q = 0; q < mTopK.size(); ++q) {
+    out[q] = mTopK[q].sorted();
+    for (auto &e : out[q]) {
+      e.second = std::sqrt(e.second);
+    }
+  }
+  return out;
+}
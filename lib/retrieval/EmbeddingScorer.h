@@ -0,0 +1,63 @@
+#ifndef PPBAFLOC_EMBEDDINGSCORER_H
+#define PPBAFLOC_EMBEDDINGSCORER_H
+
+#include <functional>
+#include <opencv2/core.hpp>
+#include <utility>
+#include <vector>
+
+#include "TopKCollector.h"
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The EmbeddingScorer class: finds the k nearest gallery embeddings
+ * (L2 distance) for a batch of query embeddings.
+ *
+ * All queries are stacked into one Q x dim matrix and the gallery is
+ * processed in tiles of rows. For each tile the Q x tile dot products are
+ * computed with one GEMM and turned into approximate distances via
+ * |q - g|^2 = |q|^2 + |g|^2 - 2 q.g, tiles are spread over numThreads
+ * threads. That form loses precision to cancellation for close pairs, so it
+ * only preselects: every row that may enter the top-k is rescored with the
+ * direct difference in double. Only a bounded top-k heap per query is kept,
+ * never the full score vectors.
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT EmbeddingScorer {
+ public:
+  /**
+   * @param queries query embeddings (1 x dim, CV_32F each)
+   * @param k number of nearest gallery rows kept per query
+   * @param numThreads number of threads used in score()
+   */
+  EmbeddingScorer(const std::vector<cv::Mat> &queries, size_t k,
+                  int numThreads = 1);
+
+  /**
+   * @brief score ranks gallery rows against all queries. Can be called
+   * multiple times, e.g. once per batch of gallery images.
+   * @param gallery n x dim CV_32F matrix, one embedding per row. May be a
+   * header over memory mapped data, it is never copied.
+   * @param ids identifier of every gallery row (n elements)
+   */
+  void score(const cv::Mat &gallery, const int *ids);
+
+  /**
+   * @return for each query the k nearest <id, L2 distance> pairs, nearest
+   * first
+   */
+  std::vector<std::vector<std::pair<int, double>>> results() const;
+
+ private:
+  // keeps squared distances, sqrt is only taken in results()
+  using Collector = TopKCollector<int, std::less<double>>;
+
+  void scoreTile(const cv::Mat &tile, const int *ids,
+                 std::vector<Collector> &topK, cv::Mat &dots) const;
+
+  cv::Mat mQueries;                  // Q x dim
+  std::vector<float> mQueryNorms;    // squared L2 norm per query
+  int mThreads;
+  std::vector<Collector> mTopK;      // one per query
+};
+
+#endif  // PPBAFLOC_EMBEDDINGSCORER_H
@@ -1,11 +1,15 @@
 #include "Fbow.h"
 
-#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
 
 QByteArray FBoW::toByteArray() const {
   std::ostringstream oss(std::ios::binary);
   fbow.toStream(oss);
-  qDebug() << fbow.size();
   QByteArray bstr = QByteArray::fromStdString(oss.str());
   return bstr;
 }
@@ -14,7 +18,70 @@ void FBoW::fromByteArray(QByteArray data) {
   std::istringstream iss(std::ios::binary);
   iss.str(data.toStdString());
   fbow.fromStream(iss);
-  qDebug() << fbow.size();
+}
+
+bool decodeFBoW(const QByteArray& data, std::vector<uint32_t>& outWords,
+                std::vector<float>& outWeights) {
+  // fbow::fBow::toStream: uint32 count, then count (uint32 word, float weight)
+  // pairs in ascending word order, host byte order
+  outWords.clear();
+  outWeights.clear();
+  uint32_t count;
+  if (static_cast<size_t>(data.size()) < sizeof(count)) {
+    return false;
+  }
+  std::memcpy(&count, data.constData(), sizeof(count));
+
+  const size_t entrySize = sizeof(uint32_t) + sizeof(float);
+  if (static_cast<size_t>(data.size()) != sizeof(count) + count * entrySize) {
+    return false;
+  }
+
+  outWords.resize(count);
+  outWeights.resize(count);
+  const char* p = data.constData() + sizeof(count);
+  for (uint32_t i = 0; i < count; ++i, p += entrySize) {
+    std::memcpy(&outWords[i], p, sizeof(uint32_t));
+    std::memcpy(&outWeights[i], p + sizeof(uint32_t), sizeof(float));
+  }
+  return true;
+}
+
+std::shared_ptr<fbow::Vocabulary> sharedVocabulary(const std::string& path) {
+  struct Entry {
+    qint64 mtime;
+    qint64 size;
+    std::shared_ptr<fbow::Vocabulary> voc;
+  };
+  static std::mutex mutex;
+  static std::map<QString, Entry> vocabularies;
+
+  QFileInfo info(QString::fromStdString(path));
+  if (!info.exists()) {
+    return nullptr;
+  }
+  const QString key = info.absoluteFilePath();
+  const qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+
+  // loading a large vocabulary takes seconds, concurrent callers wait for it
+  // instead of reading the file again
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = vocabularies.find(key);
+  if (it != vocabularies.end() && it->second.mtime == mtime &&
+      it->second.size == info.size()) {
+    return it->second.voc;
+  }
+
+  auto voc = std::make_shared<fbow::Vocabulary>();
+  try {
+    voc->readFromFile(path);
+  } catch (const std::exception& e) {
+    std::cout << "Could not read vocabulary " << path << ": " << e.what()
+              << std::endl;
+    return nullptr;
+  }
+  vocabularies[key] = {mtime, info.size(), voc};
+  return voc;
 }
 
 const fbow::fBow& getBoW(const Image* img) {
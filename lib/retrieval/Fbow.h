@@ -5,6 +5,12 @@
 #include <types/image.h>
 
 #include <QByteArray>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
 /**
  * @brief The FBoW struct: FBoW-Map
  * Implements the abstract BoW class that is saved in the Image struct
@@ -17,6 +23,34 @@ struct FBoW : BoW {
   fbow::fBow2 fbow2;
 };
 
+/**
+ * @brief scoreFromDotProduct maps the dot product of two L2 normalized FBoW
+ * vectors to the score returned by fbow::fBow::score (Nister, 2006)
+ */
+inline double scoreFromDotProduct(double dot) {
+  if (dot >= 1) {  // rounding errors
+    return 1.0;
+  }
+  return 1.0 - std::sqrt(1.0 - dot);
+}
+
+/**
+ * @brief decodeFBoW reads a blob written by FBoW::toByteArray (fbow::fBow::toStream)
+ * directly into word ids (ascending) and weights, without building a fbow::fBow
+ * @return false if data is not a valid FBoW blob
+ */
+bool decodeFBoW(const QByteArray& data, std::vector<uint32_t>& outWords,
+                std::vector<float>& outWeights);
+
+/**
+ * @brief sharedVocabulary process wide, loaded once copy of the vocabulary
+ * file at path. Later calls return the same object until the file changes
+ * (modification time or size). The vocabulary must not be modified, it is
+ * used by several threads and FbowRetrieval instances at the same time.
+ * @return nullptr if the file can not be read
+ */
+std::shared_ptr<fbow::Vocabulary> sharedVocabulary(const std::string& path);
+
 /**
  * @brief extract the FBoW map from an image
  */
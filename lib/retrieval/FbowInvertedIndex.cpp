@@ -0,0 +1,224 @@
+#include "FbowInvertedIndex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+#include "Fbow.h"
+
+bool FbowInvertedIndex::build(Database& db, int numThreads, size_t maxBytes) {
+  clear();
+  mParts.resize(std::max(1, numThreads));
+
+  std::atomic<size_t> bytes(0);
+  std::atomic<bool> overBudget(false);
+
+  // every part is only touched by the thread scanning its id range
+  auto callback = [&](int part, int id, const QByteArray& fbow) -> bool {
+    thread_local std::vector<uint32_t> words;
+    thread_local std::vector<float> weights;
+    if (!decodeFBoW(fbow, words, weights)) {
+      std::cout << "FbowInvertedIndex: invalid FBoW of id " << id << std::endl;
+      return true;
+    }
+
+    if (maxBytes > 0) {
+      bytes += words.size() * bytesPerPosting() + sizeof(int);
+      if (bytes > maxBytes) {
+        overBudget = true;
+        return false;
+      }
+    }
+
+    mParts[part].add(id, words, weights);
+    return true;
+  };
+
+  db.getFBowAllParallel(static_cast<int>(mParts.size()), callback);
+
+  if (overBudget) {
+    clear();
+    return false;
+  }
+
+  // fewer ranges than threads for tiny databases
+  mParts.erase(std::remove_if(mParts.begin(), mParts.end(),
+                              [](const Part& p) {
+                                return p.imageIds.empty() &&
+                                       p.pending.empty();
+                              }),
+               mParts.end());
+  finalize();
+  return true;
+}
+
+void FbowInvertedIndex::add(int id, const std::vector<uint32_t>& words,
+                            const std::vector<float>& weights) {
+  if (mParts.empty()) {
+    mParts.resize(1);
+  }
+  mParts.back().add(id, words, weights);
+}
+
+void FbowInvertedIndex::add(int id, const fbow::fBow& bow) {
+  std::vector<uint32_t> words;
+  std::vector<float> weights;
+  words.reserve(bow.size());
+  weights.reserve(bow.size());
+  for (const auto& word : bow) {
+    words.push_back(word.first);
+    weights.push_back(word.second);
+  }
+  add(id, words, weights);
+}
+
+void FbowInvertedIndex::finalize() {
+  for (auto& p : mParts) {
+    p.finalize();
+  }
+}
+
+void FbowInvertedIndex::Part::add(int id, const std::vector<uint32_t>& w,
+                                  const std::vector<float>& wt) {
+  const uint32_t image = static_cast<uint32_t>(imageIds.size());
+  imageIds.push_back(id);
+
+  for (size_t i = 0; i < w.size(); ++i) {
+    pending.push_back({w[i], image, wt[i]});
+  }
+}
+
+void FbowInvertedIndex::Part::finalize() {
+  if (pending.empty()) {
+    return;
+  }
+
+  // merge the existing flat postings back in, then regroup everything by word
+  for (size_t w = 0; w < words.size(); ++w) {
+    for (uint32_t i = offsets[w]; i < offsets[w + 1]; ++i) {
+      pending.push_back({words[w], images[i], weights[i]});
+    }
+  }
+  std::sort(pending.begin(), pending.end(),
+            [](const PendingPosting& a, const PendingPosting& b) {
+              return a.word < b.word || (a.word == b.word && a.image < b.image);
+            });
+
+  words.clear();
+  offsets.clear();
+  images.resize(pending.size());
+  weights.resize(pending.size());
+  for (size_t i = 0; i < pending.size(); ++i) {
+    if (words.empty() || words.back() != pending[i].word) {
+      words.push_back(pending[i].word);
+      offsets.push_back(static_cast<uint32_t>(i));
+    }
+    images[i] = pending[i].image;
+    weights[i] = pending[i].weight;
+  }
+  offsets.push_back(static_cast<uint32_t>(pending.size()));
+
+  std::vector<PendingPosting>().swap(pending);
+  words.shrink_to_fit();
+  offsets.shrink_to_fit();
+}
+
+void FbowInvertedIndex::clear() { mParts.clear(); }
+
+size_t FbowInvertedIndex::size() const {
+  size_t n = 0;
+  for (const auto& p : mParts) {
+    n += p.imageIds.size();
+  }
+  return n;
+}
+
+size_t FbowInvertedIndex::memoryUsage() const {
+  size_t bytes = 0;
+  for (const auto& p : mParts) {
+    bytes += p.words.capacity() * sizeof(uint32_t) +
+             p.offsets.capacity() * sizeof(uint32_t) +
+             p.images.capacity() * sizeof(uint32_t) +
+             p.weights.capacity() * sizeof(float) +
+             p.imageIds.capacity() * sizeof(int) +
+             p.pending.capacity() * sizeof(PendingPosting);
+  }
+  return bytes;
+}
+
+size_t FbowInvertedIndex::bytesPerPosting() {
+  // the pending postings are the peak while building
+  return sizeof(PendingPosting);
+}
+
+void FbowInvertedIndex::score(const fbow::fBow& query,
+                              TopKCollector<int>& collector) const {
+  for (size_t part = 0; part < mParts.size(); ++part) {
+    score(query, part, collector);
+  }
+}
+
+void FbowInvertedIndex::score(const fbow::fBow& query, size_t part,
+                              TopKCollector<int>& collector) const {
+  const Part& p = mParts[part];
+
+  // Per-thread scratch reused across queries and parts. Between calls every
+  // entry of dot and touched is zero again; only the candidates touched by
+  // the current query are reset at the end.
+  struct Scratch {
+    std::vector<double> dot;
+    std::vector<char> touched;
+    std::vector<uint32_t> candidates;
+  };
+  thread_local Scratch scratch;
+  if (scratch.dot.size() < p.imageIds.size()) {
+    scratch.dot.resize(p.imageIds.size(), 0.);
+    scratch.touched.resize(p.imageIds.size(), 0);
+  }
+  std::vector<double>& dot = scratch.dot;
+  std::vector<char>& touched = scratch.touched;
+  std::vector<uint32_t>& candidates = scratch.candidates;
+  candidates.clear();
+
+  // fbow::fBow is an ordered map, so every image receives its products in
+  // ascending word order, exactly like the merge in fbow::fBow::score.
+  // The query words are ascending as well, so the search can start at the
+  // previous match.
+  auto wordIt = p.words.begin();
+  for (const auto& word : query) {
+    wordIt = std::lower_bound(wordIt, p.words.end(), word.first);
+    if (wordIt == p.words.end()) {
+      break;
+    }
+    if (*wordIt != word.first) {
+      continue;
+    }
+
+    const size_t w = wordIt - p.words.begin();
+    const float qw = word.second;
+    for (uint32_t i = p.offsets[w]; i < p.offsets[w + 1]; ++i) {
+      const uint32_t image = p.images[i];
+      if (!touched[image]) {
+        touched[image] = 1;
+        candidates.push_back(image);
+      }
+      dot[image] += qw * p.weights[i];
+    }
+  }
+
+  for (uint32_t image : candidates) {
+    collector.push(p.imageIds[image], scoreFromDotProduct(dot[image]));
+  }
+
+  for (size_t i = 0; i < p.imageIds.size() && collector.size() < collector.k();
+       ++i) {
+    if (!touched[i]) {
+      collector.push(p.imageIds[i], 0.);
+    }
+  }
+
+  for (uint32_t image : candidates) {
+    dot[image] = 0.;
+    touched[image] = 0;
+  }
+}
@@ -0,0 +1,114 @@
+#ifndef PPBAFLOC_FBOWINVERTEDINDEX_H
+#define PPBAFLOC_FBOWINVERTEDINDEX_H
+
+#include <database/database.h>
+#include <fbow/fbow.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "TopKCollector.h"
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The FbowInvertedIndex class: maps every visual word to the list of
+ * gallery images (and their weights) containing it. Built once from the
+ * fbowTable and kept in memory, so scoring a query only touches the gallery
+ * images that share at least one word with it and repeated retrievals never
+ * read or parse the FBoW blobs again.
+ *
+ * The gallery is split into parts (one per thread of build()), each with its
+ * own postings, so parts can be built and scored independently. The postings
+ * of a part are stored flat: the sorted word ids, the offset of every word's
+ * postings and the image indices and weights of all postings in two arrays.
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT FbowInvertedIndex {
+ public:
+  /**
+   * @brief build (re)creates the index from all FBoW vectors stored in db
+   * @param numThreads the fbowTable is scanned and indexed in this many
+   * parts in parallel
+   * @param maxBytes memory budget of the index, 0 for no limit
+   * @return false if the index would need more than maxBytes; the index is
+   * empty then
+   */
+  bool build(Database &db, int numThreads = 1, size_t maxBytes = 0);
+  /**
+   * @brief add a single gallery image to the (last part of the) index.
+   * finalize() has to be called after the last add() before scoring.
+   * @param id database id of the image
+   * @param words word ids of the FBoW vector of the image, ascending
+   * @param weights weight of every word
+   */
+  void add(int id, const std::vector<uint32_t> &words,
+           const std::vector<float> &weights);
+  void add(int id, const fbow::fBow &bow);
+  /**
+   * @brief finalize moves all added images into the flat posting arrays
+   */
+  void finalize();
+  void clear();
+
+  /**
+   * @return number of indexed gallery images
+   */
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+  /**
+   * @return bytes used by the postings and ids
+   */
+  size_t memoryUsage() const;
+
+  /**
+   * @return number of independently scorable parts
+   */
+  size_t numParts() const { return mParts.size(); }
+
+  /**
+   * @brief score computes fbow::fBow::score(query, img) for every indexed
+   * image that shares a word with query.
+   * @param query FBoW vector of the query image
+   * @param collector receives the <db id, score> pairs. If fewer images share
+   * a word with the query, images with score 0 are pushed until it is full
+   */
+  void score(const fbow::fBow &query, TopKCollector<int> &collector) const;
+
+  /**
+   * @brief score like above, restricted to the images of one part. Collectors
+   * of different parts can be merged to the result of score().
+   */
+  void score(const fbow::fBow &query, size_t part,
+             TopKCollector<int> &collector) const;
+
+  /**
+   * @return bytes one posting takes while building and once finalized
+   */
+  static size_t bytesPerPosting();
+
+ private:
+  struct PendingPosting {
+    uint32_t word;
+    uint32_t image;
+    float weight;
+  };
+
+  struct Part {
+    std::vector<uint32_t> words;    // ascending
+    std::vector<uint32_t> offsets;  // postings of words[i]: [offsets[i], offsets[i + 1])
+    std::vector<uint32_t> images;   // index into imageIds
+    std::vector<float> weights;
+    std::vector<int> imageIds;
+
+    std::vector<PendingPosting> pending;  // added, not finalized yet
+
+    void add(int id, const std::vector<uint32_t> &words,
+             const std::vector<float> &weights);
+    void finalize();
+  };
+
+  std::vector<Part> mParts;
+};
+
+#endif  // PPBAFLOC_FBOWINVERTEDINDEX_H
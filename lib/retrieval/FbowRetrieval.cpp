@@ -2,6 +2,8 @@
 
 #include <core.h>
 #include <database/DBImporterMT.h>
+#include <utils/BoundedQueue.h>
+#include <utils/LandmarkCsv.h>
 #include <utils/SiftHelpers.h>
 #include <utils/iohelpers.h>
 
@@ -10,20 +12,32 @@
 #include <QtCore/QBuffer>
 #include <QtCore/QDataStream>
 #include <QtCore/QDirIterator>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <thread>
 
+#include "DescriptorReservoir.h"
 #include "Fbow.h"
+#include "FbowInvertedIndex.h"
+#include "GalleryBowCache.h"
+#include "PackedBoW.h"
+#include "TopKCollector.h"
 
 void calcScoreImage(std::vector<std::string> inputFiles,
-                    const std::string& vocabPath,
+                    fbow::Vocabulary& voc,
                     std::vector<fbow::fBow>& queryBows,
-                    std::vector<std::vector<std::pair<int, double>>>& scores,
-                    size_t scoreVecOffset);
-void calcScoreMultipleWithDB(
-    Database& db, std::vector<std::vector<std::pair<int, double>>>& scores,
-    const std::vector<fbow::fBow>& queryFbows);
+                    std::vector<TopKCollector<int>>& collectors,
+                    size_t fileIdxOffset, GalleryBowCache* cache);
+void calcScoreMultipleWithIndex(const FbowInvertedIndex& index,
+                                std::vector<TopKCollector<int>>& collectors,
+                                const std::vector<fbow::fBow>& queryFbows,
+                                unsigned int numThreads);
+void calcScoreMultipleWithDB(Database& db,
+                             std::vector<TopKCollector<int>>& collectors,
+                             const std::vector<fbow::fBow>& queryFbows,
+                             unsigned int numThreads);
 
 FbowRetrieval::FbowRetrieval(const std::string& vocabPath,
                              const std::string& trainingDirPath,
@@ -40,12 +54,54 @@ FbowRetrieval::FbowRetrieval(const std::string& vocabPath,
   mDB = db;
 }
 
-void runCalcBow(std::vector<std::shared_ptr<Image>>& images, int offset,
-                int size, fbow::Vocabulary& voc) {
-  size_t end = offset + size;
-  for (size_t i = offset; i < end; ++i) {
-    auto bow = voc.transform(images[i]->siftDescriptors);
-    setBoW(images[i].get(), bow);
+namespace {
+struct SiftItem {
+  int id = -1;
+  cv::Mat descriptors;
+};
+struct BowItem {
+  int id = -1;
+  QByteArray bow;
+};
+}  // namespace
+
+// Stage 1: reads the SIFT descriptors of all ids over the read connection of
+// this thread. Blocks while the workers are behind.
+void runLoadSift(const std::vector<int>& ids, BoundedQueue<SiftItem>& out,
+                 Database* db, std::atomic<long long>& busyMicroseconds) {
+  for (int id : ids) {
+    auto t0 = std::chrono::steady_clock::now();
+    SiftItem item;
+    item.id = id;
+    item.descriptors = db->getSift(id);
+    busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - t0)
+                            .count();
+    if (!out.push(std::move(item))) {
+      break;
+    }
+  }
+  db->releaseThreadConnection();
+  out.close();
+}
+
+// Stage 2, one per worker thread: transforms descriptors into serialized BoWs.
+void runCalcBow(BoundedQueue<SiftItem>& in, BoundedQueue<BowItem>& out,
+                fbow::Vocabulary& voc,
+                std::atomic<long long>& busyMicroseconds) {
+  SiftItem item;
+  FBoW bow;
+  while (in.pop(item)) {
+    auto t0 = std::chrono::steady_clock::now();
+    bow.fbow = voc.transform(item.descriptors);
+    BowItem result;
+    result.id = item.id;
+    result.bow = bow.toByteArray();
+    item.descriptors = cv::Mat();
+    busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - t0)
+                            .count();
+    out.push(std::move(result));
   }
 }
 
@@ -65,74 +121,82 @@ void FbowRetrieval::fillDBFbow(int nThreads) {
               << std::endl;
     this->createFbowVocabulary();
   }
-  fbow::Vocabulary voc;
-  voc.readFromFile(this->mVocabPath);
+  std::shared_ptr<fbow::Vocabulary> vocPtr = vocabulary();
+  fbow::Vocabulary& voc = *vocPtr;
 
-  std::vector<int> idList = mDB->getIDList();
+  // FBoW vectors are about to change, the index has to be rebuilt
+  mIndex = nullptr;
 
-  const size_t batchSize = 500;  // Limit Memory usage
+  std::vector<int> idList = mDB->getIDList();
+  // mixed vocabularies until all vectors are written
+  mDB->setFBowVocabulary(QString());
 
-  std::vector<std::shared_ptr<Image>> temp(batchSize);
-  for (size_t i = 0; i < temp.size(); ++i) {
-    temp[i] = std::make_shared<Image>();
-  }
+  // load -> transform (nThreads) -> write; the queues limit the memory usage
+  // and let loading and writing overlap with the transform
+  const size_t batchSize = 500;
+  BoundedQueue<SiftItem> siftQ(2 * batchSize);
+  BoundedQueue<BowItem> bowQ(2 * batchSize);
+  std::atomic<long long> loadMicroseconds(0), bowMicroseconds(0);
 
   auto t0 = std::chrono::high_resolution_clock::now();
 
-  size_t batches = std::ceil(idList.size() / static_cast<double>(batchSize));
-  for (size_t b = 0; b < batches; ++b) {
-    std::cout << "\rSaving FBoW Vectors. Batch " << b + 1 << "/" << batches
-              << std::flush;
-    std::cout << std::endl;
-
-    auto t01 = std::chrono::high_resolution_clock::now();
-
-    size_t bsize = batchSize;
-    size_t offset = b * batchSize;
-    if (b == batches - 1) {
-      bsize = idList.size() - offset;
-    }
-
-    for (size_t i = 0; i < bsize; ++i) {
-      temp[i]->siftDescriptors = mDB->getSift(idList[offset + i]);
-    }
-
-    auto t02 = std::chrono::high_resolution_clock::now();
-
-    std::vector<std::thread> threads;
-    for (size_t i = 0; i < static_cast<size_t>(nThreads); ++i) {
-      size_t threadBatch = bsize / nThreads;
-      size_t threadOffset = threadBatch * i;
-      if (i == static_cast<size_t>(nThreads) - 1) {
-        threadBatch = bsize - threadOffset;
-      }
-      threads.push_back(std::thread(runCalcBow, std::ref(temp), threadOffset,
-                                    threadBatch, std::ref(voc)));
-    }
-
-    for (auto& t : threads) {
+  std::thread loader(runLoadSift, std::cref(idList), std::ref(siftQ), mDB,
+                     std::ref(loadMicroseconds));
+  std::vector<std::thread> workers;
+  for (int i = 0; i < nThreads; ++i) {
+    workers.push_back(std::thread(runCalcBow, std::ref(siftQ), std::ref(bowQ),
+                                  std::ref(voc), std::ref(bowMicroseconds)));
+  }
+  // closes bowQ once all workers are done
+  std::thread closer([&workers, &bowQ]() {
+    for (auto& t : workers) {
       t.join();
     }
-
-    auto t03 = std::chrono::high_resolution_clock::now();
-
-    mDB->transaction();
-    for (size_t i = 0; i < bsize; ++i) {
-      mDB->addFbow(idList[offset + i], temp[i]->bow->toByteArray());
+    bowQ.close();
+  });
+
+  // stage 3 on this thread, the owner of the write connection
+  std::vector<BowItem> items;
+  std::vector<int> ids;
+  std::vector<QByteArray> bows;
+  size_t written = 0;
+  double writeSeconds = 0.;
+  auto write = [&]() {
+    auto tw = std::chrono::high_resolution_clock::now();
+    ids.clear();
+    bows.clear();
+    for (auto& item : items) {
+      ids.push_back(item.id);
+      bows.push_back(std::move(item.bow));
     }
-    mDB->commit();
-
-    auto t04 = std::chrono::high_resolution_clock::now();
-    std::cout << "load: " << std::chrono::duration<double>(t02 - t01).count()
-              << " bow: " << std::chrono::duration<double>(t03 - t02).count()
-              << " save: " << std::chrono::duration<double>(t04 - t03).count()
-              << std::endl;
+    mDB->updateFBoWBatch(ids, bows);  // one transaction per batch
+    written += items.size();
+    items.clear();
+    writeSeconds += std::chrono::duration<double>(
+                        std::chrono::high_resolution_clock::now() - tw)
+                        .count();
+    std::cout << "\rSaving FBoW Vectors: " << written << "/" << idList.size()
+              << std::flush;
+  };
+  while (bowQ.popBatch(items, batchSize - items.size()) > 0) {
+    if (items.size() >= batchSize) {
+      write();
+    }
+  }
+  if (!items.empty()) {
+    write();
   }
-  std::cout << std::endl;
+  loader.join();
+  closer.join();
+  mDB->setFBowVocabulary(vocabularyKey());
+  std::cout << "\rSaving FBoW Vectors: " << written << "/" << idList.size()
+            << std::endl;
 
   auto t1 = std::chrono::high_resolution_clock::now();
   std::cout << "Elapsed: " << std::chrono::duration<double>(t1 - t0).count()
-            << std::endl;
+            << " (busy: load " << loadMicroseconds / 1e6 << " s, bow "
+            << bowMicroseconds / 1e6 << " s on " << nThreads
+            << " threads, write " << writeSeconds << " s)" << std::endl;
 }
 
 void FbowRetrieval::setVocabPath(const std::string& vocabPath) {
@@ -145,6 +209,7 @@ void FbowRetrieval::setVocabPath(const std::string& vocabPath) {
     this->mVocabExists = true;
   }
   this->mVocabPath = vocabPath;
+  mVocabulary = nullptr;
 };
 
 void FbowRetrieval::setVocabCreationFilterFile(const std::string& filterFile) {
@@ -161,25 +226,118 @@ void FbowRetrieval::getFilteredImages(std::vector<std::string>& imageFiles,
                   QDir::Files, QDirIterator::Subdirectories);
 
   imageFiles.clear();
-  for (int i = 0; it.hasNext(); ++i) {
-    std::string img_path = it.next().toStdString();
-    if (this->isImageClean(img_path, filterFile)) {
-      imageFiles.push_back(img_path);
+  auto csv = LandmarkCsv::get(QString::fromStdString(filterFile));
+  if (csv == nullptr) {
+    return;
+  }
+  while (it.hasNext()) {
+    const QString imgPath = it.next();
+    if (csv->contains(LandmarkCsv::imageId(imgPath))) {
+      imageFiles.push_back(imgPath.toStdString());
     }
   }
+  std::cout << imageFiles.size() << " clean training images" << std::endl;
+}
+
+DBImporterMT::BowFunction FbowRetrieval::bowFunction() {
+  if (!mVocabExists) {
+    return nullptr;
+  }
+  // the vocabulary is shared read only by all SIFT threads of the importer
+  std::shared_ptr<fbow::Vocabulary> voc = vocabulary();
+  return [voc](const cv::Mat& descriptors) -> std::shared_ptr<BoW> {
+    auto bow = std::make_shared<FBoW>();
+    bow->fbow = voc->transform(descriptors);
+    return bow;
+  };
+}
+
+QString FbowRetrieval::vocabularyKey() const {
+  return GalleryBowCache::vocabularyKey(QString::fromStdString(mVocabPath));
 }
 
 void FbowRetrieval::createFbowVocabulary() {
-  std::vector<cv::Mat> features;
+  auto t0 = std::chrono::high_resolution_clock::now();
 
-  if (!mCleanCSV.empty()) {
-    std::vector<std::string> imgList;
+  // training images (or database ids) first, the descriptors are streamed
+  std::vector<std::string> imgList;
+  std::vector<int> idList;
+  if (mVocabParams.fromDatabase) {
+    if (mDB == nullptr) {
+      throw std::runtime_error(
+          "FbowRetrieval::createFbowVocabulary(): No Database given");
+    }
+    idList = mDB->getIDList();
+  } else if (!mCleanCSV.empty()) {
     getFilteredImages(imgList, mCleanCSV);
-    SiftHelpers::extractSiftFeaturesImgList(imgList, features, -1);
   } else {
-    SiftHelpers::extractSiftFeaturesDir(this->mTrainingDirPath, features, -1);
+    QStringList filter;
+    filter << "*.jpg"
+           << "*.png"
+           << "*.jpeg";
+    QDirIterator it(QString::fromStdString(this->mTrainingDirPath), filter,
+                    QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+      imgList.push_back(it.next().toStdString());
+    }
+  }
+  const size_t numInputs =
+      mVocabParams.fromDatabase ? idList.size() : imgList.size();
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  DescriptorReservoir reservoir(mVocabParams.maxDescriptors);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    cv::Mat desc;
+    std::vector<cv::KeyPoint> kps;
+    for (size_t i = next++; i < numInputs; i = next++) {
+      // never offer the previous image's descriptors again
+      desc.release();
+      if (mVocabParams.fromDatabase) {
+        desc = mDB->getSift(idList[i]);
+      } else if (SiftHelpers::extractSiftFeatures(imgList[i], desc, kps) <
+                 0) {
+        continue;
+      }
+      reservoir.add(desc);
+
+      if ((i + 1) % 1000 == 0) {
+        std::cout << "\rTraining descriptors: " << i + 1 << "/" << numInputs
+                  << std::flush;
+      }
+    }
+    if (mVocabParams.fromDatabase) {
+      mDB->releaseThreadConnection();
+    }
+  };
+
+  const int numThreads = std::max(1, mVocabParams.numThreads);
+  if (numThreads == 1) {
+    worker();
+  } else {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+      threads.push_back(std::thread(worker));
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
   }
 
+  std::vector<cv::Mat> features = reservoir.sample();
+  int numDescriptors = 0;
+  for (const auto& f : features) {
+    numDescriptors += f.rows;
+  }
+  std::cout << std::endl
+            << "Training descriptors: " << numDescriptors << " of "
+            << reservoir.seen() << " from " << numInputs
+            << (mVocabParams.fromDatabase ? " database images" : " images")
+            << std::endl;
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+
   fbow::Vocabulary voc;
   fbow::VocabularyCreator creator;
   // fbow::VocabularyCreator::Params params =
@@ -190,36 +348,47 @@ void FbowRetrieval::createFbowVocabulary() {
   params.verbose = true;
   creator.create(voc, features, "SIFT", params);
 
+  auto t3 = std::chrono::high_resolution_clock::now();
+
   std::cout << "Saving vocabulary ..." << std::endl;
   voc.saveToFile(this->mVocabPath);
   this->mVocabExists = true;
+  mVocabulary = nullptr;
+
+  auto t4 = std::chrono::high_resolution_clock::now();
+  std::cout << "Vocabulary timing - list: "
+            << std::chrono::duration<double>(t1 - t0).count()
+            << " s, descriptors: "
+            << std::chrono::duration<double>(t2 - t1).count()
+            << " s, k-means: " << std::chrono::duration<double>(t3 - t2).count()
+            << " s, save: " << std::chrono::duration<double>(t4 - t3).count()
+            << " s" << std::endl;
 };
 
-bool FbowRetrieval::isImageClean(const std::string img_path,
-                                 const std::string& cleanCSV) {
-  QFileInfo fi(QString::fromStdString(img_path));
-  QString imageName = fi.fileName();
-  imageName = imageName.split(".", QString::SkipEmptyParts).at(0);
-  std::cout << "isImageclean" << imageName.toStdString() << std::endl;
-  QFile file(QString::fromStdString(cleanCSV));
-  file.open(QIODevice::ReadOnly);
-  while (!file.atEnd()) {
-    QString line = file.readLine();
-    if (line.contains(imageName, Qt::CaseSensitive)) {
-      file.close();
-      std::cout << "File clean is " << imageName.toStdString() << std::endl;
-      return true;
+std::shared_ptr<fbow::Vocabulary> FbowRetrieval::vocabulary() {
+  if (mVocabulary == nullptr) {
+    mVocabulary = sharedVocabulary(mVocabPath);
+    if (mVocabulary == nullptr) {
+      throw std::runtime_error("FbowRetrieval: could not load vocabulary " +
+                               mVocabPath);
     }
   }
-  file.close();
-  return false;
+  return mVocabulary;
+}
+
+bool FbowRetrieval::isImageClean(const std::string img_path,
+                                 const std::string& cleanCSV) {
+  auto csv = LandmarkCsv::get(QString::fromStdString(cleanCSV));
+  return csv != nullptr &&
+         csv->contains(LandmarkCsv::imageId(QString::fromStdString(img_path)));
 }
 
 void FbowRetrieval::retrieveImagesDB(
     const std::vector<std::shared_ptr<Image>>& queries,
     std::vector<std::vector<std::shared_ptr<Image>>>& outRetrievedPerQuery,
-    int numRetrieved) {
-  retrieve(queries, {}, outRetrievedPerQuery, -1, numRetrieved, 1, true);
+    int numRetrieved, unsigned int numThreads) {
+  retrieve(queries, {}, outRetrievedPerQuery, -1, numRetrieved, numThreads,
+           true);
 }
 
 void FbowRetrieval::retrieveImagesGalleryDir(
@@ -239,6 +408,49 @@ void FbowRetrieval::retrieveImagesFromList(
            numRetrieved, numThreads, false);
 }
 
+void FbowRetrieval::benchmarkScoring(
+    const std::vector<std::shared_ptr<Image>>& queries, int maxGalleryImages) {
+  if (mDB == nullptr || !mVocabExists) {
+    std::cout << "FBoW score benchmark needs a database and a vocabulary"
+              << std::endl;
+    return;
+  }
+
+  std::shared_ptr<fbow::Vocabulary> voc = vocabulary();
+  std::vector<fbow::fBow> queryBows = calcQueryBows(queries, *voc, 0);
+
+  std::vector<fbow::fBow> gallery;
+  mDB->getFBowAll([&](int, const QByteArray& data) {
+    FBoW bow;
+    bow.fromByteArray(data);
+    gallery.push_back(bow.fbow);
+    return maxGalleryImages <= 0 ||
+           gallery.size() < static_cast<size_t>(maxGalleryImages);
+  });
+
+  benchmarkPackedScore(queryBows, gallery);
+}
+
+std::vector<fbow::fBow> FbowRetrieval::calcQueryBows(
+    const std::vector<std::shared_ptr<Image>>& queries,
+    fbow::Vocabulary& voc, int numThreads) const {
+  std::vector<std::string> paths;
+  paths.reserve(queries.size());
+  for (const auto& queryImage : queries) {
+    paths.push_back(queryImage->path);
+  }
+  std::vector<cv::Mat> descriptors;
+  SiftHelpers::extractSiftFeaturesBatch(paths, descriptors, nullptr,
+                                        numThreads, mQuerySiftOptions);
+
+  std::vector<fbow::fBow> queryBows;
+  queryBows.reserve(descriptors.size());
+  for (const auto& desc : descriptors) {
+    queryBows.push_back(voc.transform(desc));
+  }
+  return queryBows;
+}
+
 void FbowRetrieval::retrieve(
     const std::vector<std::shared_ptr<Image>>& queries,
     const std::vector<std::shared_ptr<Image>>& galleryImgs,
@@ -247,37 +459,56 @@ void FbowRetrieval::retrieve(
     bool useDB) {
   std::cout << "Retrieving for " << queries.size() << " queries" << std::endl;
 
-  fbow::fBow2 fBowInstance;
-  fbow::Vocabulary voc;
-
-  if (this->mVocabExists) {
-    voc.readFromFile(this->mVocabPath);
-  } else {
+  if (!this->mVocabExists) {
     this->createFbowVocabulary();
   }
+  // shared read only by all scoring threads
+  std::shared_ptr<fbow::Vocabulary> vocPtr = vocabulary();
+  fbow::Vocabulary& voc = *vocPtr;
 
   std::cout << "Calculating Query BoWs....." << std::flush;
   std::vector<fbow::fBow> queryBows;
 
   auto t00 = std::chrono::high_resolution_clock::now();
-  for (auto& queryImage : queries) {
-    cv::Mat desc;
-    std::vector<cv::KeyPoint> kps;
-    SiftHelpers::extractSiftFeatures(queryImage->path, desc, kps);
-
-    queryBows.push_back(voc.transform(desc));
-  }
+  queryBows = calcQueryBows(queries, voc, static_cast<int>(numThreads));
   auto t01 = std::chrono::high_resolution_clock::now();
   std::cout << std::chrono::duration<double>(t01 - t00).count() << "s"
             << std::endl;
 
   std::cout << "Calculating scores........." << std::flush;
-  std::vector<std::vector<std::pair<int, double>>> scores(queryBows.size());
+  // only the best numRetrieved + 1 images per query are kept while scanning;
+  // one extra in case the query itself is part of the gallery
+  std::vector<TopKCollector<int>> collectors(
+      queryBows.size(), TopKCollector<int>(numRetrieved + 1));
   std::vector<std::string> files;
 
   auto t10 = std::chrono::high_resolution_clock::now();
   if (useDB) {
-    calcScoreMultipleWithDB(*mDB, scores, queryBows);
+    // FBoW vectors written since the index was built make it stale
+    const uint64_t generation = mDB->getFBowGeneration();
+    if (mIndexGeneration != generation) {
+      mIndex = nullptr;
+      mIndexOverBudget = false;
+    }
+
+    if (mIndex == nullptr && mIndexBudget >= 0 && !mIndexOverBudget) {
+      std::cout << "building index..." << std::flush;
+      mIndex = std::make_shared<FbowInvertedIndex>();
+      mIndexGeneration = generation;
+      if (!mIndex->build(*mDB, numThreads,
+                         static_cast<size_t>(mIndexBudget))) {
+        std::cout << "exceeds the memory budget, scanning the database..."
+                  << std::flush;
+        mIndex = nullptr;
+        mIndexOverBudget = true;
+      }
+    }
+
+    if (mIndex != nullptr) {
+      calcScoreMultipleWithIndex(*mIndex, collectors, queryBows, numThreads);
+    } else {
+      calcScoreMultipleWithDB(*mDB, collectors, queryBows, numThreads);
+    }
   } else {
     if (galleryImgs.empty()) {
       QStringList filter;
@@ -311,13 +542,21 @@ void FbowRetrieval::retrieve(
       }
       queryImage->csvrow->gallerySize = n;
     }
-    for (auto& s : scores) {
-      s.resize(n);
+
+    std::unique_ptr<GalleryBowCache> cache;
+    if (!mGalleryBowCachePath.empty()) {
+      cache = std::unique_ptr<GalleryBowCache>(new GalleryBowCache);
+      if (!cache->load(QString::fromStdString(mGalleryBowCachePath),
+                       QString::fromStdString(mVocabPath))) {
+        cache = nullptr;
+      }
     }
 
     if (numThreads > 1) {
       size_t perThread = n / numThreads;
       std::vector<std::thread> threads;
+      std::vector<std::vector<TopKCollector<int>>> threadCollectors(
+          numThreads, collectors);
 
       size_t offset = 0;
       for (size_t t = 0; t < numThreads; ++t) {
@@ -331,17 +570,27 @@ void FbowRetrieval::retrieve(
 
         std::cout << input.size() << std::endl;
 
-        threads.push_back(std::thread(calcScoreImage, input,
-                                      std::ref(mVocabPath), std::ref(queryBows),
-                                      std::ref(scores), offset));
+        threads.push_back(std::thread(
+            calcScoreImage, input, std::ref(voc), std::ref(queryBows),
+            std::ref(threadCollectors[t]), offset, cache.get()));
         offset += perThread;
       }
 
       for (auto& t : threads) {
         t.join();
       }
+
+      for (const auto& perQuery : threadCollectors) {
+        for (size_t i = 0; i < collectors.size(); ++i) {
+          collectors[i].merge(perQuery[i]);
+        }
+      }
     } else {
-      calcScoreImage(files, mVocabPath, queryBows, scores, 0);
+      calcScoreImage(files, voc, queryBows, collectors, 0, cache.get());
+    }
+
+    if (cache != nullptr) {
+      cache->save();
     }
   }
   auto t11 = std::chrono::high_resolution_clock::now();
@@ -351,10 +600,10 @@ void FbowRetrieval::retrieve(
   std::cout << "Sorting scores............." << std::flush;
 
   auto t20 = std::chrono::high_resolution_clock::now();
-  for (auto& s : scores) {
-    sort(s.begin(), s.end(), sortTupleListBySecElemID);
-    if (s.size() > static_cast<size_t>(numRetrieved))
-      s.resize(numRetrieved + 1);
+  std::vector<std::vector<std::pair<int, double>>> scores;
+  scores.reserve(collectors.size());
+  for (const auto& c : collectors) {
+    scores.push_back(c.sorted());
   }
   auto t21 = std::chrono::high_resolution_clock::now();
   std::cout << std::chrono::duration<double>(t21 - t20).count() << "s"
@@ -364,12 +613,31 @@ void FbowRetrieval::retrieve(
   outRetrievedPerQuery.resize(queries.size());
 
   auto t30 = std::chrono::high_resolution_clock::now();
+  // resolve all retrieved db ids in one go
+  std::vector<std::shared_ptr<Image>> dbImages;
+  if (useDB) {
+    std::vector<int> ids;
+    for (const auto& s : scores) {
+      for (const auto& score : s) {
+        ids.push_back(score.first);
+      }
+    }
+    if (!mDB->getImages(ids, dbImages)) {
+      throw std::runtime_error("FbowRetrieval: could not load retrieved images");
+    }
+  }
+
+  size_t dbImageIdx = 0;
   for (size_t queryIdx = 0; queryIdx < queries.size(); ++queryIdx) {
     for (const auto& score : scores[queryIdx]) {
-      std::shared_ptr<Image> t = std::shared_ptr<Image>(new Image);
+      std::shared_ptr<Image> t;
       if (useDB) {
-        t->path = mDB->getPath(score.first);
+        t = dbImages[dbImageIdx++];
+        if (t == nullptr) {
+          continue;
+        }
       } else {
+        t = std::shared_ptr<Image>(new Image);
         t->path = files[score.first];
       }
       if (t->path == queries[queryIdx]->path) {
@@ -385,60 +653,117 @@ void FbowRetrieval::retrieve(
 }
 
 void calcScoreImage(std::vector<std::string> inputFiles,
-                    const std::string& vocabPath,
+                    fbow::Vocabulary& voc,
                     std::vector<fbow::fBow>& queryBows,
-                    std::vector<std::vector<std::pair<int, double>>>& scores,
-                    size_t scoreVecOffset) {
-  fbow::Vocabulary voc;
-  voc.readFromFile(vocabPath);
+                    std::vector<TopKCollector<int>>& collectors,
+                    size_t fileIdxOffset, GalleryBowCache* cache) {
+  std::vector<PackedBoW> packedQueries(queryBows.begin(), queryBows.end());
+  PackedBoW imgBow;
+  size_t cacheHits = 0;
 
   for (size_t fileIdx = 0; fileIdx < inputFiles.size(); ++fileIdx) {
     if (fileIdx % 1000 == 0) {
       std::cout << "finished " << fileIdx << " out of " << inputFiles.size()
                 << " images " << std::endl;
     }
-    double score = 0.0;
-    cv::Mat descriptors;
-    std::vector<cv::KeyPoint> keypoints;
-    SiftHelpers::extractSiftFeatures(inputFiles[fileIdx], descriptors,
-                                     keypoints);
+    const QString path = QString::fromStdString(inputFiles[fileIdx]);
 
-    for (size_t i = 0; i < queryBows.size(); ++i) {
+    // the gallery BoW is computed once and used for every query
+    bool valid = true;
+    if (cache != nullptr && cache->lookup(path, imgBow)) {
+      ++cacheHits;
+    } else {
+      cv::Mat descriptors;
+      std::vector<cv::KeyPoint> keypoints;
+      SiftHelpers::extractSiftFeatures(inputFiles[fileIdx], descriptors,
+                                       keypoints);
       try {
-        const fbow::fBow& imgBow = voc.transform(descriptors);
-
-        score = fbow::fBow::score(queryBows[i], imgBow);
+        imgBow.assign(voc.transform(descriptors));
+        if (cache != nullptr) {
+          cache->insert(path, imgBow);
+        }
       } catch (const std::exception& e) {
         std::cout << inputFiles[fileIdx] << ":" << e.what() << std::endl;
+        valid = false;
       }
+    }
 
-      scores[i][scoreVecOffset + fileIdx] = {scoreVecOffset + fileIdx, score};
+    for (size_t i = 0; i < packedQueries.size(); ++i) {
+      const double score = valid ? packedScore(packedQueries[i], imgBow) : 0.0;
+      collectors[i].push(fileIdxOffset + fileIdx, score);
     }
   }
-}
 
-void calcScoreMultipleWithDB(
-    Database& db, std::vector<std::vector<std::pair<int, double>>>& scores,
-    const std::vector<fbow::fBow>& queryFbows) {
-  auto callback = [&](int id, const QByteArray& fbow) -> bool {
-    std::istringstream iss(std::ios::binary);
-    iss.str(fbow.toStdString());
-    fbow::fBow tempFb;
-    tempFb.fromStream(iss);
-
-    for (size_t i = 0; i < queryFbows.size(); ++i) {
-      double score = 0.;
-      try {
-        score = fbow::fBow::score(queryFbows[i], tempFb);
-      } catch (const std::exception& e) {
-        std::cout << id << ":" << e.what() << std::endl;
-      }
+  if (cache != nullptr) {
+    std::cout << "gallery BoW cache: " << cacheHits << " of "
+              << inputFiles.size() << " images" << std::endl;
+  }
+}
 
-      scores[i].push_back({id, score});
+void calcScoreMultipleWithDB(Database& db,
+                             std::vector<TopKCollector<int>>& collectors,
+                             const std::vector<fbow::fBow>& queryFbows,
+                             unsigned int numThreads) {
+  std::vector<PackedBoW> packedQueries(queryFbows.begin(), queryFbows.end());
+
+  const int parts = std::max(1, static_cast<int>(numThreads));
+  std::vector<std::vector<TopKCollector<int>>> partCollectors(parts,
+                                                              collectors);
+  auto callback = [&](int part, int id, const QByteArray& fbow) -> bool {
+    thread_local PackedBoW imgBow;
+    if (!imgBow.fromByteArray(fbow)) {
+      return true;
     }
 
+    for (size_t q = 0; q < packedQueries.size(); ++q) {
+      partCollectors[part][q].push(id, packedScore(packedQueries[q], imgBow));
+    }
     return true;
   };
+  db.getFBowAllParallel(parts, callback);
+
+  for (const auto& perQuery : partCollectors) {
+    for (size_t i = 0; i < collectors.size(); ++i) {
+      collectors[i].merge(perQuery[i]);
+    }
+  }
+}
 
-  db.getFBowAll(callback);
+void calcScoreMultipleWithIndex(const FbowInvertedIndex& index,
+                                std::vector<TopKCollector<int>>& collectors,
+                                const std::vector<fbow::fBow>& queryFbows,
+                                unsigned int numThreads) {
+  const size_t parts = index.numParts();
+  if (numThreads <= 1 || parts <= 1) {
+    for (size_t i = 0; i < queryFbows.size(); ++i) {
+      index.score(queryFbows[i], collectors[i]);
+    }
+    return;
+  }
+
+  // every thread scores all queries against its share of the index parts,
+  // the per thread top k lists are merged afterwards
+  const size_t n = std::min<size_t>(numThreads, parts);
+  std::vector<std::vector<TopKCollector<int>>> threadCollectors(n,
+                                                                collectors);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < n; ++t) {
+    threads.push_back(std::thread([&, t]() {
+      for (size_t part = t; part < parts; part += n) {
+        for (size_t i = 0; i < queryFbows.size(); ++i) {
+          index.score(queryFbows[i], part, threadCollectors[t][i]);
+        }
+      }
+    }));
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (const auto& perQuery : threadCollectors) {
+    for (size_t i = 0; i < collectors.size(); ++i) {
+      collectors[i].merge(perQuery[i]);
+    }
+  }
 }
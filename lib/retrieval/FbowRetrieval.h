@@ -3,16 +3,35 @@
 #define PPBAFLOC_FBOWRETRIEVAL_H
 
 #include <database/DBHelper.h>
+#include <database/DBImporterMT.h>
 #include <database/database.h>
 #include <types/image.h>
+#include <utils/SiftHelpers.h>
 
+#include <memory>
 #include <opencv2/core.hpp>
 #include <string>
 
 #include "ppbafloc-retrieval_export.h"
 
+class FbowInvertedIndex;
+namespace fbow {
+class Vocabulary;
+struct fBow;
+}
+
 class PPBAFLOC_RETRIEVAL_EXPORT FbowRetrieval {
  public:
+  /**
+   * @brief The VocabularyParams struct: how the training descriptors for
+   * createFbowVocabulary() are collected
+   */
+  struct VocabularyParams {
+    int numThreads = 1;          // threads extracting / loading SIFT
+    size_t maxDescriptors = 0;   // random sample of this many, 0: all
+    bool fromDatabase = false;   // read the siftTable instead of the images
+  };
+
   // Constructors
   FbowRetrieval() = default;
   /**
@@ -52,10 +71,35 @@ class PPBAFLOC_RETRIEVAL_EXPORT FbowRetrieval {
    */
   void setVocabCreationFilterFile(const std::string &filterFile);
   void setVocabPath(const std::string &vocabPath);
+  /**
+   * @brief setIndexMemoryBudget limits the in memory index of the DB FBoW
+   * vectors used by retrieveImagesDB. Without an index every retrieval scans
+   * and parses the fbowTable again.
+   * @param maxBytes 0: no limit, < 0: never keep an index
+   */
+  void setIndexMemoryBudget(long long maxBytes) { mIndexBudget = maxBytes; }
+  /**
+   * @brief setGalleryBowCache file to keep the BoWs of gallery images (no DB)
+   * in between runs, see GalleryBowCache. Empty to disable.
+   */
+  void setGalleryBowCache(const std::string &file) {
+    mGalleryBowCachePath = file;
+  }
+  void setVocabularyParams(const VocabularyParams &params) {
+    mVocabParams = params;
+  }
+  /**
+   * @brief setQuerySiftOptions limits the SIFT extraction of query images
+   * (keypoint cap, downscaling), see SiftHelpers::Options.
+   */
+  void setQuerySiftOptions(const SiftHelpers::Options &options) {
+    mQuerySiftOptions = options;
+  }
 
   /**
    * @brief K-Means "Training" and Vocabulary creation.
-   * Parameters need to be set hardcoded in this function.
+   * Parameters need to be set hardcoded in this function. The training
+   * descriptors are collected as set by setVocabularyParams().
    */
   void createFbowVocabulary();
   /**
@@ -63,15 +107,28 @@ class PPBAFLOC_RETRIEVAL_EXPORT FbowRetrieval {
    */
   void fillDBFbow(int nThreads = 1);
   /**
-   * @brief retrieveImagesDB Retrieval with DB-gallery.
+   * @brief bowFunction for the BoW stage of DBImporterMT, so the FBoW vectors
+   * are written while the database is filled instead of by fillDBFbow.
+   * @return empty function if the vocabulary does not exist yet
+   */
+  DBImporterMT::BowFunction bowFunction();
+  /**
+   * @brief vocabularyKey of the vocabulary file, see
+   * Database::getFBowVocabulary()
+   */
+  QString vocabularyKey() const;
+  /**
+   * @brief retrieveImagesDB Retrieval with DB-gallery. The FBoW vectors of the
+   * DB are loaded into an inverted index on the first call and kept in memory.
    * @param queries list of pointers to Images representing query images
    * @param outRetrievedPerQuery list to write result reference images to
    * @param numRetrieved number of images to retrieve for each query image
+   * @param numThreads threads used to build and to score the index
    */
   void retrieveImagesDB(
       const std::vector<std::shared_ptr<Image>> &queries,
       std::vector<std::vector<std::shared_ptr<Image>>> &outRetrievedPerQuery,
-      int numRetrieved);
+      int numRetrieved, unsigned int numThreads = 1);
   /**
    * @brief retrieveImagesGalleryDir Retrieval with loose images.
    * @param queries list of pointers to Images representing query images
@@ -101,13 +158,29 @@ class PPBAFLOC_RETRIEVAL_EXPORT FbowRetrieval {
       int maxNumberGalleryImages, int numRetrieved,
       unsigned int numThreads = 1);
 
+  /**
+   * @brief benchmarkScoring compares fbow::fBow::score with the packed
+   * scoring kernel (see PackedBoW.h) on the query BoWs against up to
+   * maxGalleryImages FBoW vectors of the DB and prints the timings
+   */
+  void benchmarkScoring(const std::vector<std::shared_ptr<Image>> &queries,
+                        int maxGalleryImages = 10000);
+
  private:
   std::string mVocabPath;        // FBoW
   std::string mGalleryDirPath;   // Possible Reference Images
   std::string mTrainingDirPath;  // Train Images
   std::string mCleanCSV;         // Google Landmarks train_clean.csv
+  std::string mGalleryBowCachePath;
+  std::shared_ptr<fbow::Vocabulary> mVocabulary;  // see vocabulary()
+  VocabularyParams mVocabParams;
+  SiftHelpers::Options mQuerySiftOptions;
   bool mVocabExists;
   Database *mDB = nullptr;
+  std::shared_ptr<FbowInvertedIndex> mIndex;  // built from mDB on demand
+  uint64_t mIndexGeneration = 0;  // Database::getFBowGeneration() of mIndex
+  long long mIndexBudget = 0;
+  bool mIndexOverBudget = false;  // for mIndexGeneration
 
  private:
   /**
@@ -118,6 +191,19 @@ class PPBAFLOC_RETRIEVAL_EXPORT FbowRetrieval {
    * @param maxNumGalleryImgs max amount of galleryimages considered.
    * @param numRetrieved Size of outRetrievedPerQuery
    */
+  /**
+   * @brief vocabulary loaded on first use from mVocabPath, shared with all
+   * other users of the same file (sharedVocabulary())
+   */
+  std::shared_ptr<fbow::Vocabulary> vocabulary();
+  /**
+   * @brief calcQueryBows extracts the SIFT features of the queries on
+   * numThreads threads (see mQuerySiftOptions) and transforms them with voc
+   */
+  std::vector<fbow::fBow> calcQueryBows(
+      const std::vector<std::shared_ptr<Image>> &queries,
+      fbow::Vocabulary &voc, int numThreads) const;
+
   void retrieve(
       const std::vector<std::shared_ptr<Image>> &queries,
       const std::vector<std::shared_ptr<Image>> &galleryImgs,
@@ -127,6 +213,7 @@ class PPBAFLOC_RETRIEVAL_EXPORT FbowRetrieval {
   /**
    * @brief isImageClean: Checks if img_path is mentioned in the google
    * landmarks clean csv. !ONLY FOR GOOGLE LANDMARKS V2!
+   * The csv is parsed once per process, see LandmarkCsv.
    */
   bool isImageClean(const std::string img_path, const std::string &filterFile);
   /**
@@ -0,0 +1,144 @@
+#include "GalleryBowCache.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <iostream>
+
+namespace {
+const quint32 cacheMagic = 0x46424743;  // "FBGC"
+const quint32 cacheVersion = 1;
+}  // namespace
+
+QString GalleryBowCache::vocabularyKey(const QString &vocabPath) {
+  QFileInfo info(vocabPath);
+  return info.absoluteFilePath() + "|" +
+         QString::number(info.lastModified().toMSecsSinceEpoch()) + "|" +
+         QString::number(info.size());
+}
+
+bool GalleryBowCache::load(const QString &file, const QString &vocabPath) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mFile = file;
+  mVocabKey = vocabularyKey(vocabPath);
+  mEntries.clear();
+  mModified = false;
+
+  QFile f(file);
+  if (!f.exists()) {
+    return true;
+  }
+  if (!f.open(QIODevice::ReadOnly)) {
+    std::cout << "Could not read gallery BoW cache " << file.toStdString()
+              << std::endl;
+    return false;
+  }
+
+  QDataStream stream(&f);
+  quint32 magic, version;
+  QString vocabKey;
+  quint32 count;
+  stream >> magic >> version >> vocabKey >> count;
+  if (stream.status() != QDataStream::Ok || magic != cacheMagic ||
+      version != cacheVersion) {
+    std::cout << "Invalid gallery BoW cache " << file.toStdString()
+              << ", it will be rebuilt" << std::endl;
+    return true;
+  }
+  if (vocabKey != mVocabKey) {
+    std::cout << "Gallery BoW cache " << file.toStdString()
+              << " belongs to another vocabulary, it will be rebuilt"
+              << std::endl;
+    return true;
+  }
+
+  mEntries.reserve(count);
+  for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+    QString path;
+    Entry e;
+    stream >> path >> e.mtime >> e.size >> e.bow;
+    mEntries.insert(path, e);
+  }
+  if (stream.status() != QDataStream::Ok) {
+    // truncated file, keep nothing half read
+    mEntries.clear();
+  }
+  return true;
+}
+
+bool GalleryBowCache::save() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (!mModified || mFile.isEmpty()) {
+    return true;
+  }
+
+  // QSaveFile only replaces the old cache once everything is written
+  QSaveFile f(mFile);
+  if (!f.open(QIODevice::WriteOnly)) {
+    std::cout << "Could not write gallery BoW cache " << mFile.toStdString()
+              << std::endl;
+    return false;
+  }
+
+  QDataStream stream(&f);
+  stream << cacheMagic << cacheVersion << mVocabKey
+         << static_cast<quint32>(mEntries.size());
+  for (auto it = mEntries.constBegin(); it != mEntries.constEnd(); ++it) {
+    stream << it.key() << it->mtime << it->size << it->bow;
+  }
+  if (stream.status() != QDataStream::Ok || !f.commit()) {
+    std::cout << "Could not write gallery BoW cache " << mFile.toStdString()
+              << std::endl;
+    return false;
+  }
+  mModified = false;
+  return true;
+}
+
+bool GalleryBowCache::fileKey(const QString &path, qint64 &mtime,
+                              qint64 &size) {
+  QFileInfo info(path);
+  if (!info.exists()) {
+    return false;
+  }
+  mtime = info.lastModified().toMSecsSinceEpoch();
+  size = info.size();
+  return true;
+}
+
+bool GalleryBowCache::lookup(const QString &path, PackedBoW &outBow) const {
+  qint64 mtime, size;
+  if (!fileKey(path, mtime, size)) {
+    return false;
+  }
+
+  QByteArray bow;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.constFind(path);
+    if (it == mEntries.constEnd() || it->mtime != mtime || it->size != size) {
+      return false;
+    }
+    bow = it->bow;  // implicitly shared, no copy
+  }
+  return outBow.fromByteArray(bow);
+}
+
+void GalleryBowCache::insert(const QString &path, const PackedBoW &bow) {
+  Entry e;
+  if (!fileKey(path, e.mtime, e.size)) {
+    return;
+  }
+  e.bow = bow.toByteArray();
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mEntries.insert(path, e);
+  mModified = true;
+}
+
+size_t GalleryBowCache::size() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mEntries.size();
+}
@@ -0,0 +1,65 @@
+#ifndef PPBAFLOC_GALLERYBOWCACHE_H
+#define PPBAFLOC_GALLERYBOWCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <mutex>
+
+#include "PackedBoW.h"
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The GalleryBowCache class: FBoW vectors of gallery images (no DB)
+ * kept in a sidecar file between runs. An entry is only used while the image
+ * file still has the same modification time and size, and the whole cache is
+ * dropped when the vocabulary changes, so runs over the same gallery
+ * directory only compute the BoWs of new or modified images.
+ *
+ * lookup() and insert() may be called from several threads.
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT GalleryBowCache {
+ public:
+  /**
+   * @brief load reads file if it exists and was written for vocabPath
+   * @return false if file exists but could not be read; the cache is empty
+   */
+  bool load(const QString &file, const QString &vocabPath);
+  /**
+   * @brief save writes all entries back to the file given to load(), if any
+   * were added
+   */
+  bool save();
+
+  /**
+   * @brief lookup BoW of the image at path
+   * @return false if there is no entry or the image changed since
+   */
+  bool lookup(const QString &path, PackedBoW &outBow) const;
+  void insert(const QString &path, const PackedBoW &bow);
+
+  size_t size() const;
+
+  /**
+   * @brief vocabularyKey identifies the vocabulary file: path, modification
+   * time and size
+   */
+  static QString vocabularyKey(const QString &vocabPath);
+
+ private:
+  struct Entry {
+    qint64 mtime;
+    qint64 size;
+    QByteArray bow;  // PackedBoW::toByteArray
+  };
+
+  static bool fileKey(const QString &path, qint64 &mtime, qint64 &size);
+
+  QString mFile;
+  QString mVocabKey;
+  QHash<QString, Entry> mEntries;
+  bool mModified = false;
+  mutable std::mutex mMutex;
+};
+
+#endif  // PPBAFLOC_GALLERYBOWCACHE_H
@@ -0,0 +1,417 @@
+#include "IvfPqIndex.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include "EmbeddingScorer.h"
+#include "TopKCollector.h"
+
+namespace {
+const char kMagic[8] = {'P', 'P', 'B', 'A', 'I', 'V', 'F', '1'};
+const quint32 kVersion = 2;  // 2: data fingerprint
+const int kMaxCodebookSize = 256;  // codes are stored as uint8_t
+const int kAssignChunk = 4096;
+
+void parallelFor(int n, int numThreads, const std::function<void(int)> &f) {
+  numThreads = std::max(1, std::min(numThreads, n));
+  if (numThreads == 1) {
+    for (int i = 0; i < n; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    threads.push_back(std::thread([&, t]() {
+      for (int i = t; i < n; i += numThreads) {
+        f(i);
+      }
+    }));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+float l2Sqr(const float *a, const float *b, int dim) {
+  float sum = 0.f;
+  for (int d = 0; d < dim; ++d) {
+    const float diff = a[d] - b[d];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+cv::Mat sampleRows(const cv::Mat &data, int maxRows) {
+  if (maxRows <= 0 || data.rows <= maxRows) {
+    return data.clone();
+  }
+
+  std::vector<int> idx(data.rows);
+  std::iota(idx.begin(), idx.end(), 0);
+  std::mt19937 rng(42);
+  std::shuffle(idx.begin(), idx.end(), rng);
+
+  cv::Mat sample(maxRows, data.cols, CV_32F);
+  for (int i = 0; i < maxRows; ++i) {
+    data.row(idx[i]).copyTo(sample.row(i));
+  }
+  return sample;
+}
+
+void writeMat(QDataStream &s, const cv::Mat &m) {
+  s << qint32(m.rows) << qint32(m.cols);
+  s.writeRawData(reinterpret_cast<const char *>(m.ptr<float>()),
+                 static_cast<int>(m.total() * sizeof(float)));
+}
+
+bool readMat(QDataStream &s, cv::Mat &m) {
+  qint32 rows, cols;
+  s >> rows >> cols;
+  if (s.status() != QDataStream::Ok || rows < 0 || cols < 0) {
+    return false;
+  }
+  m.create(rows, cols, CV_32F);
+  const int bytes = static_cast<int>(m.total() * sizeof(float));
+  return s.readRawData(reinterpret_cast<char *>(m.ptr<float>()), bytes) ==
+         bytes;
+}
+}  // namespace
+
+void IvfPqIndex::clear() {
+  mDim = mNumLists = mM = mSubDim = mKsub = 0;
+  mRows = 0;
+  mDataFingerprint = 0;
+  mCoarse = cv::Mat();
+  mCodebooks = cv::Mat();
+  mListRows.clear();
+  mListCodes.clear();
+}
+
+bool IvfPqIndex::build(const cv::Mat &data, const Params &params) {
+  clear();
+  if (data.empty() || data.type() != CV_32F || params.numSubquantizers <= 0 ||
+      data.cols % params.numSubquantizers != 0) {
+    std::cout << "IvfPqIndex: cannot split " << data.cols << " x "
+              << data.rows << " matrix into " << params.numSubquantizers
+              << " subquantizers" << std::endl;
+    return false;
+  }
+
+  const cv::TermCriteria criteria(
+      cv::TermCriteria::COUNT + cv::TermCriteria::EPS, params.iterations,
+      1e-4);
+
+  mDim = data.cols;
+  mM = params.numSubquantizers;
+  mSubDim = mDim / mM;
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  // coarse quantizer
+  cv::Mat train = sampleRows(data, params.trainSize);
+  mNumLists = std::max(1, std::min(params.numLists, train.rows));
+  cv::Mat labels;
+  cv::kmeans(train, mNumLists, labels, criteria, 1, cv::KMEANS_PP_CENTERS,
+             mCoarse);
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  // product quantizer on the residuals of the training rows
+  cv::Mat residuals(train.rows, mDim, CV_32F);
+  for (int i = 0; i < train.rows; ++i) {
+    cv::subtract(train.row(i), mCoarse.row(labels.at<int>(i)),
+                 residuals.row(i));
+  }
+
+  mKsub = std::min(kMaxCodebookSize, train.rows);
+  mCodebooks.create(mM * mKsub, mSubDim, CV_32F);
+  for (int m = 0; m < mM; ++m) {
+    cv::Mat sub = residuals.colRange(m * mSubDim, (m + 1) * mSubDim).clone();
+    cv::Mat subLabels, centers;
+    cv::kmeans(sub, mKsub, subLabels, criteria, 1, cv::KMEANS_PP_CENTERS,
+               centers);
+    centers.copyTo(mCodebooks.rowRange(m * mKsub, (m + 1) * mKsub));
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  // assign and encode all rows
+  mRows = data.rows;
+  mListRows.assign(mNumLists, {});
+  mListCodes.assign(mNumLists, {});
+
+  std::vector<int> listIds(mNumLists);
+  std::iota(listIds.begin(), listIds.end(), 0);
+
+  for (int begin = 0; begin < data.rows; begin += kAssignChunk) {
+    const int end = std::min(begin + kAssignChunk, data.rows);
+    const int n = end - begin;
+
+    std::vector<cv::Mat> chunk;
+    for (int r = begin; r < end; ++r) {
+      chunk.push_back(data.row(r));
+    }
+    EmbeddingScorer assign(chunk, 1, params.numThreads);
+    assign.score(mCoarse, listIds.data());
+    auto nearest = assign.results();
+
+    std::vector<uint8_t> codes(static_cast<size_t>(n) * mM);
+    parallelFor(n, params.numThreads, [&](int i) {
+      std::vector<float> residual(mDim);
+      encode(data.ptr<float>(begin + i), nearest[i][0].first, residual.data(),
+             &codes[static_cast<size_t>(i) * mM]);
+    });
+
+    for (int i = 0; i < n; ++i) {
+      const int list = nearest[i][0].first;
+      mListRows[list].push_back(static_cast<uint32_t>(begin + i));
+      mListCodes[list].insert(mListCodes[list].end(), codes.begin() + i * mM,
+                              codes.begin() + (i + 1) * mM);
+    }
+
+    std::cout << "\rIvfPqIndex: encoded " << end << "/" << data.rows
+              << std::flush;
+  }
+  std::cout << std::endl;
+
+  auto t3 = std::chrono::high_resolution_clock::now();
+  std::cout << "IvfPqIndex: coarse k-means "
+            << std::chrono::duration<double>(t1 - t0).count()
+            << " s - pq k-means "
+            << std::chrono::duration<double>(t2 - t1).count()
+            << " s - encode " << std::chrono::duration<double>(t3 - t2).count()
+            << " s" << std::endl;
+  return true;
+}
+
+void IvfPqIndex::encode(const float *vec, int list, float *residual,
+                        uint8_t *code) const {
+  const float *centroid = mCoarse.ptr<float>(list);
+  for (int d = 0; d < mDim; ++d) {
+    residual[d] = vec[d] - centroid[d];
+  }
+
+  for (int m = 0; m < mM; ++m) {
+    const float *sub = residual + m * mSubDim;
+    float best = std::numeric_limits<float>::max();
+    int bestIdx = 0;
+    for (int j = 0; j < mKsub; ++j) {
+      const float d =
+          l2Sqr(sub, mCodebooks.ptr<float>(m * mKsub + j), mSubDim);
+      if (d < best) {
+        best = d;
+        bestIdx = j;
+      }
+    }
+    code[m] = static_cast<uint8_t>(bestIdx);
+  }
+}
+
+std::vector<std::vector<std::pair<int, double>>> IvfPqIndex::search(
+    const std::vector<cv::Mat> &queries, size_t k, const SearchParams &params,
+    const cv::Mat &data) const {
+  std::vector<std::vector<std::pair<int, double>>> out(queries.size());
+  if (empty()) {
+    return out;
+  }
+
+  for (const auto &q : queries) {
+    if (q.type() != CV_32F || q.total() != static_cast<size_t>(mDim) ||
+        !q.isContinuous()) {
+      throw std::runtime_error("IvfPqIndex: query does not match index");
+    }
+  }
+
+  parallelFor(static_cast<int>(queries.size()), params.numThreads,
+              [&](int i) {
+                searchOne(queries[i].ptr<float>(), k, params, data, out[i]);
+              });
+  return out;
+}
+
+void IvfPqIndex::searchOne(const float *query, size_t k,
+                           const SearchParams &params, const cv::Mat &data,
+                           std::vector<std::pair<int, double>> &out) const {
+  // nearest coarse centroids
+  std::vector<std::pair<float, int>> coarse(mNumLists);
+  for (int l = 0; l < mNumLists; ++l) {
+    coarse[l] = {l2Sqr(query, mCoarse.ptr<float>(l), mDim), l};
+  }
+  const int nprobe = std::max(1, std::min(params.nprobe, mNumLists));
+  std::partial_sort(coarse.begin(), coarse.begin() + nprobe, coarse.end());
+
+  const bool rerank = params.rerank > 0 && !data.empty() &&
+                      static_cast<size_t>(data.rows) == mRows;
+  const size_t numCandidates =
+      rerank ? std::max(k, static_cast<size_t>(params.rerank)) : k;
+
+  TopKCollector<int, std::less<double>> candidates(numCandidates);
+  std::vector<float> residual(mDim);
+  std::vector<float> table(static_cast<size_t>(mM) * mKsub);
+
+  for (int p = 0; p < nprobe; ++p) {
+    const int list = coarse[p].second;
+    const float *centroid = mCoarse.ptr<float>(list);
+    for (int d = 0; d < mDim; ++d) {
+      residual[d] = query[d] - centroid[d];
+    }
+
+    // distance of every residual chunk to every codebook entry
+    for (int m = 0; m < mM; ++m) {
+      for (int j = 0; j < mKsub; ++j) {
+        table[m * mKsub + j] =
+            l2Sqr(residual.data() + m * mSubDim,
+                  mCodebooks.ptr<float>(m * mKsub + j), mSubDim);
+      }
+    }
+
+    const std::vector<uint32_t> &rows = mListRows[list];
+    const uint8_t *codes = mListCodes[list].data();
+    for (size_t e = 0; e < rows.size(); ++e) {
+      const uint8_t *code = codes + e * mM;
+      float dist = 0.f;
+      for (int m = 0; m < mM; ++m) {
+        dist += table[m * mKsub + code[m]];
+      }
+      if (candidates.accepts(dist)) {
+        candidates.push(static_cast<int>(rows[e]), dist);
+      }
+    }
+  }
+
+  out = candidates.sorted();
+  if (rerank) {
+    TopKCollector<int, std::less<double>> exact(k);
+    for (const auto &c : out) {
+      exact.push(c.first, l2Sqr(query, data.ptr<float>(c.first), mDim));
+    }
+    out = exact.sorted();
+  } else if (out.size() > k) {
+    out.resize(k);
+  }
+
+  for (auto &o : out) {
+    o.second = std::sqrt(o.second);
+  }
+}
+
+bool IvfPqIndex::save(const QString &file) const {
+  QFile f(file + ".tmp");
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    std::cout << "IvfPqIndex: could not open " << file.toStdString()
+              << std::endl;
+    return false;
+  }
+
+  QDataStream s(&f);
+  s.writeRawData(kMagic, sizeof(kMagic));
+  s << kVersion << qint32(mDim) << qint32(mNumLists) << qint32(mM)
+    << qint32(mKsub) << quint64(mRows) << quint64(mDataFingerprint);
+  writeMat(s, mCoarse);
+  writeMat(s, mCodebooks);
+  for (int l = 0; l < mNumLists; ++l) {
+    s << quint32(mListRows[l].size());
+    s.writeRawData(reinterpret_cast<const char *>(mListRows[l].data()),
+                   static_cast<int>(mListRows[l].size() * sizeof(uint32_t)));
+    s.writeRawData(reinterpret_cast<const char *>(mListCodes[l].data()),
+                   static_cast<int>(mListCodes[l].size()));
+  }
+
+  const bool ok = s.status() == QDataStream::Ok;
+  f.close();
+  if (!ok) {
+    QFile::remove(f.fileName());
+    return false;
+  }
+  QFile::remove(file);
+  return QFile::rename(f.fileName(), file);
+}
+
+bool IvfPqIndex::load(const QString &file) {
+  clear();
+
+  QFile f(file);
+  if (!f.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+
+  QDataStream s(&f);
+  char magic[sizeof(kMagic)];
+  quint32 version;
+  qint32 dim, numLists, m, ksub;
+  quint64 rows, fingerprint;
+  s.readRawData(magic, sizeof(magic));
+  s >> version >> dim >> numLists >> m >> ksub >> rows >> fingerprint;
+  if (s.status() != QDataStream::Ok ||
+      std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+      version != kVersion || dim <= 0 || numLists <= 0 || m <= 0 ||
+      dim % m != 0 || ksub <= 0 || ksub > kMaxCodebookSize) {
+    std::cout << "IvfPqIndex: invalid file " << file.toStdString()
+              << std::endl;
+    return false;
+  }
+
+  mDim = dim;
+  mNumLists = numLists;
+  mM = m;
+  mSubDim = dim / m;
+  mKsub = ksub;
+  mRows = rows;
+  mDataFingerprint = fingerprint;
+
+  bool ok = readMat(s, mCoarse) && readMat(s, mCodebooks);
+  // search indexes them by the header values
+  if (ok && (mCoarse.rows != mNumLists || mCoarse.cols != mDim ||
+             mCodebooks.rows != mM * mKsub || mCodebooks.cols != mSubDim)) {
+    std::cout << "IvfPqIndex: invalid file " << file.toStdString()
+              << std::endl;
+    clear();
+    return false;
+  }
+  mListRows.resize(mNumLists);
+  mListCodes.resize(mNumLists);
+  for (int l = 0; ok && l < mNumLists; ++l) {
+    quint32 n;
+    s >> n;
+    if (s.status() != QDataStream::Ok || n > mRows) {
+      ok = false;
+      break;
+    }
+    mListRows[l].resize(n);
+    mListCodes[l].resize(static_cast<size_t>(n) * mM);
+    const int rowBytes = static_cast<int>(n * sizeof(uint32_t));
+    const int codeBytes = static_cast<int>(mListCodes[l].size());
+    ok = s.status() == QDataStream::Ok &&
+         s.readRawData(reinterpret_cast<char *>(mListRows[l].data()),
+                       rowBytes) == rowBytes &&
+         s.readRawData(reinterpret_cast<char *>(mListCodes[l].data()),
+                       codeBytes) == codeBytes;
+    // row ids index the embedding matrix, codes the codebooks
+    for (size_t i = 0; ok && i < mListRows[l].size(); ++i) {
+      ok = mListRows[l][i] < mRows;
+    }
+    for (size_t i = 0; ok && i < mListCodes[l].size(); ++i) {
+      ok = mListCodes[l][i] < mKsub;
+    }
+  }
+
+  if (!ok) {
+    std::cout << "IvfPqIndex: truncated or invalid file "
+              << file.toStdString() << std::endl;
+    clear();
+  }
+  return ok;
+}
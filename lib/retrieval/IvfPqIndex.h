@@ -0,0 +1,97 @@
+#ifndef PPBAFLOC_IVFPQINDEX_H
+#define PPBAFLOC_IVFPQINDEX_H
+
+#include <QString>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <utility>
+#include <vector>
+
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The IvfPqIndex class: approximate nearest neighbour index (inverted
+ * file + product quantization) over the rows of an embedding matrix.
+ *
+ * Every row is assigned to its nearest of numLists coarse k-means centroids.
+ * The residual to that centroid is split into numSubquantizers chunks, each
+ * encoded as one byte (index into a 256 entry codebook). A query only visits
+ * the nprobe nearest lists and estimates distances from per query lookup
+ * tables; the best candidates can be re-ranked with the exact vectors.
+ */
+class PPBAFLOC_RETRIEVAL_EXPORT IvfPqIndex {
+ public:
+  struct Params {
+    int numLists = 1024;        // coarse centroids
+    int numSubquantizers = 64;  // bytes per code, must divide the dimension
+    int trainSize = 100000;     // rows sampled for k-means training
+    int iterations = 20;        // k-means iterations
+    int numThreads = 1;
+  };
+
+  struct SearchParams {
+    int nprobe = 16;   // lists visited per query: recall vs. latency
+    int rerank = 200;  // candidates re-ranked exactly, 0 to disable
+    int numThreads = 1;
+  };
+
+  /**
+   * @brief build trains the quantizers and encodes all rows of data
+   * @param data n x dim CV_32F matrix, e.g. EmbeddingMatrix::mat()
+   */
+  bool build(const cv::Mat &data, const Params &params);
+
+  bool save(const QString &file) const;
+  bool load(const QString &file);
+  void clear();
+
+  bool empty() const { return mRows == 0; }
+  /**
+   * @return number of rows of the matrix the index was built from
+   */
+  size_t rows() const { return mRows; }
+  int numLists() const { return mNumLists; }
+
+  /**
+   * @brief data fingerprint saved with the index, e.g.
+   * EmbeddingMatrix::fingerprint() of the matrix it was built from. The
+   * index stores row numbers, so it is only valid for the same row layout.
+   */
+  void setDataFingerprint(uint64_t fingerprint) {
+    mDataFingerprint = fingerprint;
+  }
+  uint64_t dataFingerprint() const { return mDataFingerprint; }
+
+  /**
+   * @brief search finds the approximate k nearest rows for every query
+   * @param queries query embeddings (1 x dim, CV_32F each)
+   * @param data matrix the index was built from, used for re-ranking. May be
+   * empty if params.rerank is 0
+   * @return per query list of <row in data, L2 distance>, nearest first
+   */
+  std::vector<std::vector<std::pair<int, double>>> search(
+      const std::vector<cv::Mat> &queries, size_t k,
+      const SearchParams &params, const cv::Mat &data) const;
+
+ private:
+  void encode(const float *vec, int list, float *residual,
+              uint8_t *code) const;
+  void searchOne(const float *query, size_t k, const SearchParams &params,
+                 const cv::Mat &data,
+                 std::vector<std::pair<int, double>> &out) const;
+
+  int mDim = 0;
+  int mNumLists = 0;
+  int mM = 0;       // subquantizers
+  int mSubDim = 0;  // mDim / mM
+  int mKsub = 0;    // codebook size, at most 256
+  size_t mRows = 0;
+  uint64_t mDataFingerprint = 0;
+
+  cv::Mat mCoarse;     // mNumLists x mDim
+  cv::Mat mCodebooks;  // (mM * mKsub) x mSubDim
+  std::vector<std::vector<uint32_t>> mListRows;
+  std::vector<std::vector<uint8_t>> mListCodes;  // mM bytes per entry
+};
+
+#endif  // PPBAFLOC_IVFPQINDEX_H
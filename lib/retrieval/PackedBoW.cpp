@@ -0,0 +1,204 @@
+#include "PackedBoW.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "Fbow.h"
+
+void PackedBoW::assign(const fbow::fBow &bow) {
+  words.clear();
+  weights.clear();
+  words.reserve(bow.size());
+  weights.reserve(bow.size());
+  for (const auto &word : bow) {
+    words.push_back(word.first);
+    weights.push_back(word.second);
+  }
+}
+
+bool PackedBoW::fromByteArray(const QByteArray &data) {
+  return decodeFBoW(data, words, weights);
+}
+
+QByteArray PackedBoW::toByteArray() const {
+  // layout of fbow::fBow::toStream, see decodeFBoW
+  const uint32_t count = static_cast<uint32_t>(words.size());
+  const size_t entrySize = sizeof(uint32_t) + sizeof(float);
+  QByteArray data(static_cast<int>(sizeof(count) + count * entrySize),
+                  Qt::Uninitialized);
+  char *p = data.data();
+  std::memcpy(p, &count, sizeof(count));
+  p += sizeof(count);
+  for (uint32_t i = 0; i < count; ++i, p += entrySize) {
+    std::memcpy(p, &words[i], sizeof(uint32_t));
+    std::memcpy(p + sizeof(uint32_t), &weights[i], sizeof(float));
+  }
+  return data;
+}
+
+namespace {
+// merges a[i, aEnd) with b[j, bEnd), adds the products of equal words to dot
+inline void mergeRange(const uint32_t *aWords, const float *aWeights,
+                       size_t &i, size_t aEnd, const uint32_t *bWords,
+                       const float *bWeights, size_t &j, size_t bEnd,
+                       double &dot) {
+  while (i < aEnd && j < bEnd) {
+    if (aWords[i] < bWords[j]) {
+      ++i;
+    } else if (bWords[j] < aWords[i]) {
+      ++j;
+    } else {
+      dot += aWeights[i++] * bWeights[j++];
+    }
+  }
+}
+}  // namespace
+
+double sparseDotScalar(const uint32_t *aWords, const float *aWeights,
+                       size_t na, const uint32_t *bWords,
+                       const float *bWeights, size_t nb) {
+  double dot = 0.;
+  size_t i = 0, j = 0;
+  mergeRange(aWords, aWeights, i, na, bWords, bWeights, j, nb, dot);
+  return dot;
+}
+
+// Block intersection: compare a block of W words of a against a block of W
+// words of b (all W rotations), and only if any of them are equal merge the
+// two blocks with the scalar code. Then drop the block(s) with the smaller
+// last word. Matches are still found in ascending word order, so the sum is
+// the same as the scalar merge.
+double sparseDot(const uint32_t *aWords, const float *aWeights, size_t na,
+                 const uint32_t *bWords, const float *bWeights, size_t nb) {
+  double dot = 0.;
+  size_t i = 0, j = 0;
+
+#if defined(__AVX2__)
+  const int W = 8;
+  const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  while (i + W <= na && j + W <= nb) {
+    const __m256i a = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(aWords + i));
+    __m256i b = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(bWords + j));
+    __m256i eq = _mm256_cmpeq_epi32(a, b);
+    for (int r = 1; r < W; ++r) {
+      b = _mm256_permutevar8x32_epi32(b, rotate);
+      eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, b));
+    }
+
+    const uint32_t aLast = aWords[i + W - 1];
+    const uint32_t bLast = bWords[j + W - 1];
+    if (!_mm256_testz_si256(eq, eq)) {
+      size_t ii = i, jj = j;
+      mergeRange(aWords, aWeights, ii, i + W, bWords, bWeights, jj, j + W,
+                 dot);
+    }
+    if (aLast <= bLast) {
+      i += W;
+    }
+    if (bLast <= aLast) {
+      j += W;
+    }
+  }
+#elif defined(__SSE2__)
+  const int W = 4;
+  while (i + W <= na && j + W <= nb) {
+    const __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(aWords + i));
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bWords + j));
+    const __m128i b1 = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+    const __m128i b2 = _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2));
+    const __m128i b3 = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+    const __m128i eq = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi32(a, b), _mm_cmpeq_epi32(a, b1)),
+        _mm_or_si128(_mm_cmpeq_epi32(a, b2), _mm_cmpeq_epi32(a, b3)));
+
+    const uint32_t aLast = aWords[i + W - 1];
+    const uint32_t bLast = bWords[j + W - 1];
+    if (_mm_movemask_epi8(eq) != 0) {
+      size_t ii = i, jj = j;
+      mergeRange(aWords, aWeights, ii, i + W, bWords, bWeights, jj, j + W,
+                 dot);
+    }
+    if (aLast <= bLast) {
+      i += W;
+    }
+    if (bLast <= aLast) {
+      j += W;
+    }
+  }
+#endif
+
+  // tail, and the whole merge without SIMD
+  mergeRange(aWords, aWeights, i, na, bWords, bWeights, j, nb, dot);
+  return dot;
+}
+
+double packedScore(const PackedBoW &a, const PackedBoW &b) {
+  return scoreFromDotProduct(sparseDot(a, b));
+}
+
+void benchmarkPackedScore(const std::vector<fbow::fBow> &queries,
+                          const std::vector<fbow::fBow> &gallery) {
+  std::vector<PackedBoW> packedQueries(queries.begin(), queries.end());
+  std::vector<PackedBoW> packedGallery(gallery.begin(), gallery.end());
+  const double pairs = static_cast<double>(queries.size()) * gallery.size();
+  if (pairs == 0) {
+    std::cout << "FBoW score benchmark: no vectors" << std::endl;
+    return;
+  }
+
+  // the sums keep the compiler from dropping the loops
+  double sumMap = 0., sumPacked = 0., maxDiff = 0.;
+  auto t0 = std::chrono::high_resolution_clock::now();
+  for (const auto &q : queries) {
+    for (const auto &g : gallery) {
+      sumMap += fbow::fBow::score(q, g);
+    }
+  }
+  auto t1 = std::chrono::high_resolution_clock::now();
+  for (const auto &q : packedQueries) {
+    for (const auto &g : packedGallery) {
+      sumPacked += packedScore(q, g);
+    }
+  }
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  for (size_t q = 0; q < queries.size(); ++q) {
+    for (size_t g = 0; g < gallery.size(); ++g) {
+      maxDiff = std::max(maxDiff, std::abs(fbow::fBow::score(queries[q],
+                                                             gallery[g]) -
+                                           packedScore(packedQueries[q],
+                                                       packedGallery[g])));
+    }
+  }
+
+  const double msMap =
+      std::chrono::duration<double, std::milli>(t1 - t0).count();
+  const double msPacked =
+      std::chrono::duration<double, std::milli>(t2 - t1).count();
+#if defined(__AVX2__)
+  const char *kernel = "AVX2";
+#elif defined(__SSE2__)
+  const char *kernel = "SSE2";
+#else
+  const char *kernel = "scalar";
+#endif
+  std::cout << "FBoW score benchmark (" << queries.size() << " x "
+            << gallery.size() << " pairs)" << std::endl
+            << "  fBow::score:          " << msMap << " ms, "
+            << 1e6 * msMap / pairs << " ns/pair" << std::endl
+            << "  packedScore (" << kernel << "): " << msPacked << " ms, "
+            << 1e6 * msPacked / pairs << " ns/pair" << std::endl
+            << "  max score difference: " << maxDiff << " (sums " << sumMap
+            << " / " << sumPacked << ")" << std::endl;
+}
@@ -0,0 +1,77 @@
+#ifndef PPBAFLOC_PACKEDBOW_H
+#define PPBAFLOC_PACKEDBOW_H
+
+#include <fbow/fbow.h>
+
+#include <QByteArray>
+#include <cstdint>
+#include <vector>
+
+#include "ppbafloc-retrieval_export.h"
+
+/**
+ * @brief The PackedBoW struct: FBoW vector as two flat arrays, the word ids
+ * in ascending order and the weight of every word. Scoring two of them with
+ * packedScore() gives exactly fbow::fBow::score, but without walking two
+ * std::maps.
+ */
+struct PPBAFLOC_RETRIEVAL_EXPORT PackedBoW {
+  std::vector<uint32_t> words;
+  std::vector<float> weights;
+
+  PackedBoW() = default;
+  explicit PackedBoW(const fbow::fBow &bow) { assign(bow); }
+
+  void assign(const fbow::fBow &bow);
+  /**
+   * @brief fromByteArray decodes a blob written by FBoW::toByteArray
+   * @return false if data is not a valid FBoW blob
+   */
+  bool fromByteArray(const QByteArray &data);
+  /**
+   * @brief toByteArray same format as FBoW::toByteArray
+   */
+  QByteArray toByteArray() const;
+
+  size_t size() const { return words.size(); }
+};
+
+/**
+ * @brief sparseDot dot product of two sparse vectors given as ascending word
+ * ids and weights. The products are summed in ascending word order like
+ * fbow::fBow::score does, so the result is bit identical to it. Uses an AVX2
+ * or SSE2 block intersection when compiled for it.
+ */
+PPBAFLOC_RETRIEVAL_EXPORT double sparseDot(const uint32_t *aWords,
+                                           const float *aWeights, size_t na,
+                                           const uint32_t *bWords,
+                                           const float *bWeights, size_t nb);
+
+/**
+ * @brief sparseDotScalar plain merge, reference for sparseDot
+ */
+PPBAFLOC_RETRIEVAL_EXPORT double sparseDotScalar(
+    const uint32_t *aWords, const float *aWeights, size_t na,
+    const uint32_t *bWords, const float *bWeights, size_t nb);
+
+inline double sparseDot(const PackedBoW &a, const PackedBoW &b) {
+  return sparseDot(a.words.data(), a.weights.data(), a.size(), b.words.data(),
+                   b.weights.data(), b.size());
+}
+
+/**
+ * @brief packedScore same as fbow::fBow::score for the unpacked vectors
+ */
+PPBAFLOC_RETRIEVAL_EXPORT double packedScore(const PackedBoW &a,
+                                             const PackedBoW &b);
+
+/**
+ * @brief benchmarkPackedScore prints the time of scoring every query against
+ * every gallery vector with fbow::fBow::score and with packedScore, and the
+ * largest difference of the scores
+ */
+PPBAFLOC_RETRIEVAL_EXPORT void benchmarkPackedScore(
+    const std::vector<fbow::fBow> &queries,
+    const std::vector<fbow::fBow> &gallery);
+
+#endif  // PPBAFLOC_PACKEDBOW_H
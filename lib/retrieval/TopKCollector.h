@@ -0,0 +1,75 @@
+#ifndef PPBAFLOC_TOPKCOLLECTOR_H
+#define PPBAFLOC_TOPKCOLLECTOR_H
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief The TopKCollector class keeps the k best (id, score) pairs pushed
+ * into it in a bounded heap, so a whole gallery can be ranked in O(k) memory.
+ * @tparam Id identifier stored with every score (db id, file index, ...)
+ * @tparam Better Better()(a, b) is true if score a ranks before score b.
+ * std::greater for similarities (FBoW), std::less for distances (CNN).
+ */
+template <typename Id, typename Better = std::greater<double>>
+class TopKCollector {
+ public:
+  using Entry = std::pair<Id, double>;
+
+  explicit TopKCollector(size_t k = 0) : mK(k) { mHeap.reserve(k); }
+
+  /**
+   * @return true if a pair with this score would currently be kept
+   */
+  bool accepts(double score) const {
+    return mHeap.size() < mK || Better()(score, mHeap.front().second);
+  }
+
+  void push(const Id &id, double score) {
+    if (mHeap.size() < mK) {
+      mHeap.emplace_back(id, score);
+      std::push_heap(mHeap.begin(), mHeap.end(), compare);
+    } else if (mK > 0 && Better()(score, mHeap.front().second)) {
+      // front is the worst kept entry
+      std::pop_heap(mHeap.begin(), mHeap.end(), compare);
+      mHeap.back() = Entry(id, score);
+      std::push_heap(mHeap.begin(), mHeap.end(), compare);
+    }
+  }
+
+  /**
+   * @brief merge adds all entries of another collector (e.g. of another
+   * thread)
+   */
+  void merge(const TopKCollector &other) {
+    for (const auto &e : other.mHeap) {
+      push(e.first, e.second);
+    }
+  }
+
+  /**
+   * @return the collected entries, best first
+   */
+  std::vector<Entry> sorted() const {
+    std::vector<Entry> result = mHeap;
+    std::sort_heap(result.begin(), result.end(), compare);
+    return result;
+  }
+
+  size_t size() const { return mHeap.size(); }
+  size_t k() const { return mK; }
+  void clear() { mHeap.clear(); }
+
+ private:
+  // heap order: the worst entry is on top
+  static bool compare(const Entry &a, const Entry &b) {
+    return Better()(a.second, b.second);
+  }
+
+  size_t mK;
+  std::vector<Entry> mHeap;
+};
+
+#endif  // PPBAFLOC_TOPKCOLLECTOR_H
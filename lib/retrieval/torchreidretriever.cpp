@@ -6,54 +6,28 @@
 #include <QtCore/QDataStream>
 #include <QtCore/QDirIterator>
 #include <QtCore/QStringList>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <thread>
 
+#include <utils/BoundedQueue.h>
+
+#include "EmbeddingMatrix.h"
+#include "EmbeddingScorer.h"
+#include "IvfPqIndex.h"
+
 namespace {
 bool comp(std::pair<double, std::shared_ptr<Image>> &a,
           std::pair<double, std::shared_ptr<Image>> &b) {
   return a.first < b.first;
 }
-bool compPath(std::pair<double, std::string> &a,
-              std::pair<double, std::string> &b) {
-  return a.first < b.first;
-}
-
-bool compId(std::pair<int, double> &a, std::pair<int, double> &b) {
-  return a.second < b.second;
-}
-
-void calcScoreMultipleWithDB(
-    Database &db, std::vector<std::vector<std::pair<int, double>>> &scores,
-    const std::vector<cv::Mat> &queryHashes) {
-  auto callback = [&](int id, QByteArray &hash) -> bool {
-    QDataStream stream(&hash, QIODevice::ReadOnly);
-    int matType, rows, cols;
-    stream >> matType >> rows >> cols;
-    QByteArray hashByte;
-    stream >> hashByte;
-    cv::Mat hashMat =
-        cv::Mat(rows, cols, matType, (void *)hashByte.data()).clone();
-
-    for (size_t i = 0; i < queryHashes.size(); ++i) {
-      double dist = 0.;
-      try {
-        dist = cv::norm(queryHashes[i], hashMat, cv::NORM_L2);
-      } catch (const std::exception &e) {
-        std::cout << id << ":" << e.what() << std::endl;
-      }
-
-      scores[i].push_back({id, dist});
-    }
-
-    return true;
-  };
-  db.getHashAll(callback);
-}
-
 }  // namespace
 TorchreidRetriever::TorchreidRetriever(){};
 
@@ -79,53 +53,369 @@ TorchreidRetriever::TorchreidRetriever(const QString &modelpath,
   mDB = db;
 }
 
-void TorchreidRetriever::fillDatabaseHashes(int batchSize) {
+void TorchreidRetriever::fillDatabaseHashes(int batchSize, int numThreads) {
   if (mDB == nullptr) {
     throw std::runtime_error(
         "TorchreidRetriever::fillDatabaseHashes no DB given!");
   }
 
-  if (batchSize < 1) {
-    batchSize = 1;
-  }
-
   std::vector<std::pair<int, std::string>> paths;
   mDB->getPathList(paths);
-  size_t n = paths.size();
+  std::vector<std::string> files(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    files[i] = paths[i].second;
+  }
 
-  size_t batches = std::ceil(n / static_cast<float>(batchSize));
+  mEmbeddings = nullptr;
+  mAnnIndex = nullptr;
+  EmbeddingMatrixWriter writer;
 
-  for (size_t b = 0; b < batches; ++b) {
-    auto t0 = std::chrono::high_resolution_clock::now();
+  // every batch is written as soon as the network is done with it
+  size_t done = 0;
+  auto t0 = std::chrono::high_resolution_clock::now();
+  embedFiles(files, batchSize, numThreads,
+             [&](const std::vector<size_t> &indices,
+                 const std::vector<cv::Mat> &embeddings) {
+               mDB->transaction();
+               for (size_t i = 0; i < embeddings.size(); ++i) {
+                 mDB->addHashVector(paths[indices[i]].first, embeddings[i]);
+               }
+               mDB->commit();
+
+               if (!writer.isOpen() && !embeddings.empty()) {
+                 writer.open(embeddingFilePath(), embeddings[0].cols);
+               }
+               for (size_t i = 0; i < embeddings.size(); ++i) {
+                 writer.append(paths[indices[i]].first, embeddings[i]);
+               }
+               done += indices.size();
+               std::cout << "\rHashes " << done << "/" << files.size()
+                         << std::flush;
+             });
+  auto t1 = std::chrono::high_resolution_clock::now();
+  std::cout << std::endl
+            << "Elapsed: " << std::chrono::duration<double>(t1 - t0).count()
+            << " s" << std::endl;
+
+  if (writer.isOpen() && !writer.finish()) {
+    std::cout << "Could not write embedding matrix "
+              << embeddingFilePath().toStdString() << std::endl;
+  }
+}
+
+void TorchreidRetriever::embedFiles(
+    const std::vector<std::string> &paths, int batchSize, int numThreads,
+    const std::function<void(const std::vector<size_t> &indices,
+                             const std::vector<cv::Mat> &embeddings)>
+        &callback) {
+  struct ReadyBatch {
+    size_t batch = 0;
+    std::vector<size_t> indices;
+    std::vector<cv::Mat> inputs;  // normalizeInput() of paths[indices]
+  };
 
-    size_t offset = b * batchSize;
-    size_t bsize = batchSize;
-    if (b == batches - 1) {
-      bsize = n - offset;
+  const size_t bsize = static_cast<size_t>(std::max(1, batchSize));
+  const size_t numBatches = (paths.size() + bsize - 1) / bsize;
+  numThreads = std::max(1, numThreads);
+
+  // producers decode and normalize whole batches; at most numThreads
+  // prepared batches wait for the network
+  BoundedQueue<ReadyBatch> ready(numThreads);
+  std::atomic<size_t> nextBatch(0);
+  auto produce = [&]() {
+    for (size_t b = nextBatch++; b < numBatches; b = nextBatch++) {
+      ReadyBatch batch;
+      batch.batch = b;
+      const size_t end = std::min(paths.size(), (b + 1) * bsize);
+      for (size_t i = b * bsize; i < end; ++i) {
+        cv::Mat img;
+        if (!paths[i].empty()) {
+          img = cv::imread(paths[i], cv::IMREAD_COLOR);
+        }
+        if (img.empty()) {
+          std::cout << "Empty image " << paths[i] << std::endl;
+          continue;
+        }
+        batch.indices.push_back(i);
+        batch.inputs.push_back(normalizeInput(img));
+      }
+      if (!ready.push(std::move(batch))) {
+        return;  // consumer stopped
+      }
     }
+  };
 
-    std::vector<std::string> imgPathList(bsize);
-    for (size_t i = 0; i < bsize; ++i) {
-      imgPathList[i] = paths[offset + i].second;
+  std::vector<std::thread> producers;
+  for (int t = 0; t < numThreads; ++t) {
+    producers.push_back(std::thread(produce));
+  }
+  std::thread closer([&producers, &ready]() {
+    for (auto &t : producers) {
+      t.join();
     }
+    ready.close();
+  });
 
-    auto t1 = std::chrono::high_resolution_clock::now();
+  // the network runs on this thread. Batches arrive in any order, finished
+  // ones wait until all batches before them are delivered, so the callbacks
+  // see paths in order on every run
+  try {
+    std::map<size_t, std::pair<std::vector<size_t>, std::vector<cv::Mat>>>
+        finished;
+    size_t nextDelivered = 0;
+    ReadyBatch batch;
+    while (ready.pop(batch)) {
+      std::vector<cv::Mat> embeddings;
+      if (!batch.inputs.empty()) {
+        embeddings = applyModel(batch.inputs);
+      }
+      batch.indices.resize(embeddings.size());
+      finished[batch.batch] = {std::move(batch.indices), std::move(embeddings)};
 
-    std::vector<cv::Mat> results = applyModel(imgPathList);
+      for (auto it = finished.find(nextDelivered); it != finished.end();
+           it = finished.find(++nextDelivered)) {
+        if (!it->second.first.empty()) {
+          callback(it->second.first, it->second.second);
+        }
+        finished.erase(it);
+      }
+    }
+  } catch (...) {
+    ready.close();
+    closer.join();
+    throw;
+  }
+  closer.join();
+}
 
-    auto t2 = std::chrono::high_resolution_clock::now();
+QString TorchreidRetriever::embeddingFilePath() const {
+  if (mDB == nullptr) {
+    return QString();
+  }
+  return mDB->getFilePath() + ".emb";
+}
+
+bool TorchreidRetriever::exportEmbeddingMatrix(int numThreads) {
+  if (mDB == nullptr) {
+    throw std::runtime_error(
+        "TorchreidRetriever::exportEmbeddingMatrix no DB given!");
+  }
+
+  mEmbeddings = nullptr;
+  mAnnIndex = nullptr;
+  EmbeddingMatrixWriter writer;
+  std::mutex writerMutex;
+  std::atomic<bool> ok(true);
+
+  // every part decodes its id range on its own thread and read connection,
+  // the rows are written in chunks
+  const size_t chunkRows = 1024;
+  numThreads = std::max(1, numThreads);
+  std::vector<std::vector<std::pair<int, cv::Mat>>> pending(numThreads);
+  auto flush = [&](std::vector<std::pair<int, cv::Mat>> &rows) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    for (const auto &r : rows) {
+      if (!writer.isOpen()) {
+        ok = ok && writer.open(embeddingFilePath(),
+                               static_cast<int>(r.second.total()));
+      }
+      if (!ok || !writer.append(r.first, r.second)) {
+        ok = false;
+        break;
+      }
+    }
+    rows.clear();
+  };
+  auto callback = [&](int part, int id, const QByteArray &hash) -> bool {
+    QDataStream stream(hash);
+    int matType, rows, cols;
+    stream >> matType >> rows >> cols;
+    QByteArray hashByte;
+    stream >> hashByte;
+    if (stream.status() != QDataStream::Ok || rows <= 0 || cols <= 0 ||
+        static_cast<size_t>(hashByte.size()) <
+            static_cast<size_t>(rows) * cols * CV_ELEM_SIZE(matType)) {
+      return true;  // no valid hash for this image
+    }
+    cv::Mat hashMat =
+        cv::Mat(rows, cols, matType, (void *)hashByte.data()).clone();
+
+    std::vector<std::pair<int, cv::Mat>> &rowsOfPart = pending[part];
+    rowsOfPart.emplace_back(id, hashMat);
+    if (rowsOfPart.size() >= chunkRows) {
+      flush(rowsOfPart);
+    }
+    return ok;
+  };
+  mDB->getHashAllParallel(numThreads, callback);
+  for (auto &rows : pending) {
+    flush(rows);
+  }
+
+  if (!ok || !writer.isOpen()) {
+    std::cout << "Could not export embedding matrix "
+              << embeddingFilePath().toStdString() << std::endl;
+    return false;
+  }
+  return writer.finish();
+}
+
+bool TorchreidRetriever::loadEmbeddingMatrix() {
+  if (mEmbeddings != nullptr) {
+    return true;
+  }
+
+  auto matrix = std::make_shared<EmbeddingMatrix>();
+  if (!matrix->open(embeddingFilePath())) {
+    std::cout << "Embedding matrix not found, exporting hash table to "
+              << embeddingFilePath().toStdString() << std::endl;
+    if (!exportEmbeddingMatrix() || !matrix->open(embeddingFilePath())) {
+      return false;
+    }
+  }
+
+  mEmbeddings = matrix;
+  return true;
+}
+
+QString TorchreidRetriever::annIndexFilePath() const {
+  if (mDB == nullptr) {
+    return QString();
+  }
+  return mDB->getFilePath() + ".ivfpq";
+}
+
+bool TorchreidRetriever::buildAnnIndex(const IvfPqIndex::Params &params) {
+  if (mDB == nullptr) {
+    throw std::runtime_error("TorchreidRetriever::buildAnnIndex no DB given!");
+  }
+
+  if (!loadEmbeddingMatrix()) {
+    return false;
+  }
 
-    mDB->transaction();
-    for (size_t i = 0; i < bsize; ++i) {
-      mDB->addHashVector(paths[offset + i].first, results[i]);
+  auto index = std::make_shared<IvfPqIndex>();
+  if (!index->build(mEmbeddings->mat(), params)) {
+    std::cout << "Could not build ANN index " << annIndexFilePath().toStdString()
+              << std::endl;
+    return false;
+  }
+  index->setDataFingerprint(mEmbeddings->fingerprint());
+  if (!index->save(annIndexFilePath())) {
+    std::cout << "Could not build ANN index " << annIndexFilePath().toStdString()
+              << std::endl;
+    return false;
+  }
+  mAnnIndex = index;
+  return true;
+}
+
+bool TorchreidRetriever::loadAnnIndex() {
+  if (mAnnIndex != nullptr) {
+    return true;
+  }
+
+  if (!loadEmbeddingMatrix()) {
+    return false;
+  }
+
+  auto index = std::make_shared<IvfPqIndex>();
+  if (!index->load(annIndexFilePath())) {
+    std::cout << "ANN index " << annIndexFilePath().toStdString()
+              << " not found. Fill the database with use_ann_index set."
+              << std::endl;
+    return false;
+  }
+  // the index refers to rows of the embedding matrix: after the matrix was
+  // written again its rows may belong to other images
+  if (index->rows() != mEmbeddings->rows() ||
+      index->dataFingerprint() != mEmbeddings->fingerprint()) {
+    std::cout << "ANN index is outdated (" << index->rows() << " rows, "
+              << mEmbeddings->rows()
+              << " embeddings, or the embedding matrix was rewritten). "
+                 "Rebuild it."
+              << std::endl;
+    return false;
+  }
+
+  mAnnIndex = index;
+  return true;
+}
+
+void TorchreidRetriever::setAnnSearch(bool enabled,
+                                      const IvfPqIndex::SearchParams &params) {
+  mUseAnnIndex = enabled;
+  mAnnSearchParams = params;
+}
+
+void TorchreidRetriever::benchmarkAnnIndex(
+    const std::vector<std::shared_ptr<Image>> &queryImages, size_t k) {
+  if (!loadEmbeddingMatrix() || !loadAnnIndex() || queryImages.empty()) {
+    std::cout << "ANN benchmark: nothing to compare" << std::endl;
+    return;
+  }
+
+  std::vector<cv::Mat> queryHashes;
+  for (const auto &query : queryImages) {
+    queryHashes.push_back(applyModel(query).clone());
+  }
+  const double numQueries = static_cast<double>(queryHashes.size());
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+  EmbeddingScorer exact(queryHashes, k, mAnnSearchParams.numThreads);
+  exact.score(mEmbeddings->mat(), mEmbeddings->ids());
+  std::vector<std::vector<std::pair<int, double>>> truth = exact.results();
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  std::cout << "ANN benchmark: " << queryHashes.size() << " queries, "
+            << mEmbeddings->rows() << " gallery images, k = " << k
+            << std::endl;
+  std::cout << "  exact scan: "
+            << std::chrono::duration<double, std::milli>(t1 - t0).count() /
+                   numQueries
+            << " ms/query" << std::endl;
+
+  std::vector<int> probes = {1, 2, 4, 8, 16, 32, 64, 128,
+                             mAnnSearchParams.nprobe};
+  std::sort(probes.begin(), probes.end());
+  probes.erase(std::unique(probes.begin(), probes.end()), probes.end());
+
+  for (int nprobe : probes) {
+    if (nprobe < 1 || nprobe > mAnnIndex->numLists()) {
+      continue;
     }
-    mDB->commit();
 
+    IvfPqIndex::SearchParams params = mAnnSearchParams;
+    params.nprobe = nprobe;
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    auto approx =
+        mAnnIndex->search(queryHashes, k, params, mEmbeddings->mat());
     auto t3 = std::chrono::high_resolution_clock::now();
-    std::cout << "Batch " << b + 1 << "/" << batches << " "
-              << std::chrono::duration<double>(t1 - t0).count() << " - "
-              << std::chrono::duration<double>(t2 - t1).count() << " - "
-              << std::chrono::duration<double>(t3 - t2).count() << std::endl;
+
+    double recall = 0.;
+    for (size_t q = 0; q < truth.size(); ++q) {
+      if (truth[q].empty()) {
+        continue;
+      }
+      size_t hits = 0;
+      for (const auto &a : approx[q]) {
+        const int id = mEmbeddings->id(a.first);
+        for (const auto &t : truth[q]) {
+          if (t.first == id) {
+            ++hits;
+            break;
+          }
+        }
+      }
+      recall += static_cast<double>(hits) / truth[q].size();
+    }
+
+    std::cout << "  nprobe " << nprobe << " rerank " << params.rerank
+              << ": recall@" << k << " " << recall / numQueries << " - "
+              << std::chrono::duration<double, std::milli>(t3 - t2).count() /
+                     numQueries
+              << " ms/query" << std::endl;
   }
 }
 
@@ -142,33 +432,55 @@ TorchreidRetriever::findReferenceImagesMultipleQueries(
     queryHash = applyModel(query).clone();
     queryHashes.push_back(queryHash);
   }
-  int endIndex = 0;
 
-  std::vector<std::vector<std::pair<int, double>>> scores(queryHashes.size());
-  std::vector<std::vector<std::pair<double, std::string>>> scoresWithPaths(
-      queryHashes.size());
+  std::vector<std::vector<std::pair<double, std::shared_ptr<Image>>>>
+      scoresWithImages(queryHashes.size());
   std::vector<std::string> files;
   // std::cout << "number of images found " << n << std::endl;
 
+  EmbeddingScorer scorer(queryHashes, maxReferenceCount + 1, numThreads);
+
   auto tStart = std::chrono::high_resolution_clock::now();
   if (useDatabase) {
     auto t0 = std::chrono::high_resolution_clock::now();
-    calcScoreMultipleWithDB(*mDB, scores, queryHashes);
+    if (!loadEmbeddingMatrix()) {
+      throw std::runtime_error(
+          "TorchreidRetriever: could not load embedding matrix");
+    }
+    std::vector<std::vector<std::pair<int, double>>> scores;
+    if (mUseAnnIndex && loadAnnIndex()) {
+      scores = mAnnIndex->search(queryHashes, maxReferenceCount + 1,
+                                 mAnnSearchParams, mEmbeddings->mat());
+      for (auto &s : scores) {
+        for (auto &e : s) {
+          e.first = mEmbeddings->id(e.first);  // row -> db id
+        }
+      }
+    } else {
+      scorer.score(mEmbeddings->mat(), mEmbeddings->ids());
+      scores = scorer.results();
+    }
     auto t1 = std::chrono::high_resolution_clock::now();
-    std::vector<std::pair<double, std::string>> scoresOneQueryImage;
+    // resolve all retrieved db ids in one go
+    std::vector<int> ids;
+    for (const auto &s : scores) {
+      for (const auto &e : s) {
+        ids.push_back(e.first);
+      }
+    }
+    std::vector<std::shared_ptr<Image>> images;
+    if (!mDB->getImages(ids, images)) {
+      throw std::runtime_error(
+          "TorchreidRetriever: could not load retrieved images");
+    }
+    size_t imageIdx = 0;
     for (size_t i = 0; i < queryHashes.size(); i++) {
-      sort(scores[i].begin(), scores[i].end(), compId);
-      size_t limit = maxReferenceCount + 1;
-      scores[i].resize(std::min(scores[i].size(), limit));
-
-      for (size_t j = 0; j < scores[i].size(); j++) {
-        scoresOneQueryImage.push_back(
-            {scores[i][j].second, this->mDB->getPath(scores[i][j].first)});
+      for (size_t j = 0; j < scores[i].size(); j++, imageIdx++) {
+        if (images[imageIdx] != nullptr) {
+          scoresWithImages[i].push_back(
+              {scores[i][j].second, images[imageIdx]});
+        }
       }
-      scoresWithPaths[i].insert(std::end(scoresWithPaths[i]),
-                                std::begin(scoresOneQueryImage),
-                                std::end(scoresOneQueryImage));
-      scoresOneQueryImage.clear();
     }
     auto t2 = std::chrono::high_resolution_clock::now();
     std::cout << "Retrieved CNN DB - "
@@ -209,54 +521,35 @@ TorchreidRetriever::findReferenceImagesMultipleQueries(
       queryImage->csvrow->gallerySize = n;
     }
 
-    if (numThreads > 1) {
-      std::cout << "WARNING MULTIPLE THREADS FOR CNN RETRIEVAL WITHOUT DB NOT "
-                   "IMPLEMENTED"
-                << std::endl;
-    }
-
-    int numBatches = n / batchSize;
-    std::vector<std::shared_ptr<Image>> batch;
-    std::vector<cv::Mat> results;
-    std::vector<std::pair<double, std::string>> oneQueryImageDists;
-    for (int i = 0; i < numBatches + 1; i++) {
-      if ((i + 1) * batchSize > n) {
-        endIndex = numBatches * batchSize + (n % batchSize);
-      } else {
-        endIndex = (i + 1) * batchSize;
-      }
-
-      auto t0 = std::chrono::high_resolution_clock::now();
-      results = applyModel(std::vector<std::string>(
-          files.begin() + i * batchSize, files.begin() + endIndex));
-      auto t1 = std::chrono::high_resolution_clock::now();
-
-      for (size_t k = 0; k < queryImages.size(); k++) {
-        // std::cout << "Calculating retrieval distances for query image " <<
-        // queryImages[k]->path << std::endl;
-        for (int j = 0; j < results.size(); j++) {
-          double dist = cv::norm(queryHashes[k], results[j], cv::NORM_L2);
-          oneQueryImageDists.push_back({dist, files.at(i * batchSize + j)});
-        }
-        scoresWithPaths[k].insert(std::end(scoresWithPaths[k]),
-                                  std::begin(oneQueryImageDists),
-                                  std::end(oneQueryImageDists));
-        oneQueryImageDists.clear();
-      }
-      results.clear();
-
-      auto t2 = std::chrono::high_resolution_clock::now();
-      std::chrono::duration<double, std::milli> dtScore = t2 - t1;
-      std::cout << "Batch " << i + 1 << "/" << numBatches + 1
-                << ": Apply Model: "
-                << std::chrono::duration<double>(t1 - t0).count()
-                << " s - Score Calc: " << dtScore.count() << " ms" << std::endl;
-    }
+    // images are decoded on numThreads threads while the network runs,
+    // every batch is scored as soon as it is done
+    cv::Mat stacked;
+    std::vector<int> fileIdx;
+    size_t done = 0;
+    double dtScore = 0.;
+    embedFiles(files, static_cast<int>(batchSize),
+               static_cast<int>(numThreads),
+               [&](const std::vector<size_t> &indices,
+                   const std::vector<cv::Mat> &embeddings) {
+                 auto t0 = std::chrono::high_resolution_clock::now();
+                 cv::vconcat(embeddings, stacked);
+                 fileIdx.assign(indices.begin(), indices.end());
+                 scorer.score(stacked, fileIdx.data());
+                 dtScore += std::chrono::duration<double, std::milli>(
+                                std::chrono::high_resolution_clock::now() - t0)
+                                .count();
+                 done += indices.size();
+                 std::cout << "\rScored " << done << "/" << n << std::flush;
+               });
+    std::cout << std::endl << "Score Calc: " << dtScore << " ms" << std::endl;
     std::cout << "Finished calculating distances" << std::endl;
+    std::vector<std::vector<std::pair<int, double>>> scores = scorer.results();
     for (size_t i = 0; i < queryImages.size(); i++) {
-      sort(scoresWithPaths[i].begin(), scoresWithPaths[i].end(), compPath);
-      // if (scoresWithPaths.size() > static_cast<size_t>(maxReferenceCount))
-      scoresWithPaths[i].resize(maxReferenceCount + 1);
+      for (const auto &score : scores[i]) {
+        auto img = std::make_shared<Image>();
+        img->path = files.at(score.first);
+        scoresWithImages[i].push_back({score.second, img});
+      }
     }
   }
 
@@ -267,17 +560,13 @@ TorchreidRetriever::findReferenceImagesMultipleQueries(
 
   std::vector<std::vector<std::shared_ptr<Image>>> retrievalImages(
       queryHashes.size());
-  for (size_t i = 0; i < scoresWithPaths.size(); i++) {
-    for (const auto &score : scoresWithPaths[i]) {
-      if (score.second == queryImages[i]->path) {
+  for (size_t i = 0; i < scoresWithImages.size(); i++) {
+    for (const auto &score : scoresWithImages[i]) {
+      if (score.second->path == queryImages[i]->path) {
         std::cout << "Removing query images from retrieved images" << std::endl;
         continue;
       }
-      // std::cout << score.second << "distance is " << score.first <<
-      // std::endl;
-      std::shared_ptr<Image> t = std::shared_ptr<Image>(new Image);
-      t->path = score.second;
-      retrievalImages[i].push_back(t);
+      retrievalImages[i].push_back(score.second);
     }
   }
   return retrievalImages;
@@ -294,25 +583,13 @@ cv::Mat TorchreidRetriever::applyModel(const std::string &imagePath) {
 
 cv::Mat TorchreidRetriever::applyModel(const cv::Mat &image) {
   cv::Mat detections = cv::Mat::zeros(1, 512, CV_32F);
-  cv::Mat img = image;
-  if (img.empty() || img.cols == 0 || img.rows == 0) {
+  if (image.empty() || image.cols == 0 || image.rows == 0) {
     std::cout << "Empty image " << std::endl;
     return detections;
   }
-  float rMean = 0.485, gMean = 0.456, bMean = 0.406;
-  float rStd = 0.229, gStd = 0.224, bStd = 0.225;
-  cv::cvtColor(img, img, cv::COLOR_BGR2RGB);
-  img.convertTo(img, CV_32F, 1.0 / 255.0);
-  cv::resize(img, img, mInputFormat);
-  cv::Mat srcN = img.clone();
-  srcN.forEach<cv::Vec3f>([rMean, gMean, bMean, rStd, gStd, bStd](
-                              cv::Vec3f &pixel, const int *position) -> void {
-    pixel[0] = (pixel[0] - rMean) / rStd;
-    pixel[1] = (pixel[1] - gMean) / gStd;
-    pixel[2] = (pixel[2] - bMean) / bStd;
-  });
-  cv::Mat blob = cv::dnn::blobFromImage(srcN, 1.0, mInputFormat,
-                                        cv::Scalar(0, 0, 0), false);
+  cv::Mat blob = cv::dnn::blobFromImage(normalizeInput(image), 1.0,
+                                        mInputFormat, cv::Scalar(0, 0, 0),
+                                        false);
 
   mModel.setInput(blob);
 
@@ -326,13 +603,59 @@ cv::Mat TorchreidRetriever::applyModel(const cv::Mat &image) {
   return detections.clone();
 }
 
+cv::Mat TorchreidRetriever::normalizeInput(const cv::Mat &bgrImage) const {
+  const float rMean = 0.485, gMean = 0.456, bMean = 0.406;
+  const float rStd = 0.229, gStd = 0.224, bStd = 0.225;
+  cv::Mat img;
+  cv::cvtColor(bgrImage, img, cv::COLOR_BGR2RGB);
+  img.convertTo(img, CV_32F, 1.0 / 255.0);
+  cv::resize(img, img, mInputFormat);
+
+  // next few lines based on:
+  // https://stackoverflow.com/questions/47632756/the-fast-efficient-way-to-normalize-each-channel-of-an-image-with-different-valu
+  // post by user Ja_cpp
+  img.forEach<cv::Vec3f>([rMean, gMean, bMean, rStd, gStd, bStd](
+                             cv::Vec3f &pixel, const int *position) -> void {
+    pixel[0] = (pixel[0] - rMean) / rStd;
+    pixel[1] = (pixel[1] - gMean) / gStd;
+    pixel[2] = (pixel[2] - bMean) / bStd;
+  });
+  return img;
+}
+
+std::vector<cv::Mat> TorchreidRetriever::computeEmbeddings(
+    const std::vector<cv::Mat> &images) {
+  // unreadable images keep an empty result, so the results stay aligned
+  // with images
+  std::vector<cv::Mat> results(images.size());
+  std::vector<cv::Mat> inputs;
+  std::vector<size_t> inputIdx;
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (images[i].empty()) {
+      continue;
+    }
+    inputs.push_back(normalizeInput(images[i]));
+    inputIdx.push_back(i);
+  }
+  if (!inputs.empty()) {
+    std::vector<cv::Mat> embeddings = applyModel(inputs);
+    for (size_t j = 0; j < embeddings.size() && j < inputIdx.size(); ++j) {
+      results[inputIdx[j]] = embeddings[j];
+    }
+  }
+  return results;
+}
+
+DBImporterMT::EmbeddingFunction TorchreidRetriever::embeddingFunction() {
+  return [this](const std::vector<cv::Mat> &images) {
+    return computeEmbeddings(images);
+  };
+}
+
 std::vector<cv::Mat> TorchreidRetriever::applyModel(
     const std::vector<std::string> &imagePaths) {
   std::vector<cv::Mat> img_list;
   cv::Mat img;
-  float rMean = 0.485, gMean = 0.456, bMean = 0.406;
-  float rStd = 0.229, gStd = 0.224, bStd = 0.225;
-  cv::Mat srcN;
 
   double dtImread = 0.0, dtNormalize = 0.0;
   for (const auto &i : imagePaths) {
@@ -348,27 +671,11 @@ std::vector<cv::Mat> TorchreidRetriever::applyModel(
       std::cout << "Empty image " << i << std::endl;
       continue;
     }
-    cv::cvtColor(img, img, cv::COLOR_BGR2RGB);
-    img.convertTo(img, CV_32F, 1.0 / 255.0);
-    cv::resize(img, img, mInputFormat);
-
-    srcN = img.clone();
 
     auto t2 = std::chrono::high_resolution_clock::now();
-
-    // next few lines based on:
-    // https://stackoverflow.com/questions/47632756/the-fast-efficient-way-to-normalize-each-channel-of-an-image-with-different-valu
-    // post by user Ja_cpp
-    srcN.forEach<cv::Vec3f>([rMean, gMean, bMean, rStd, gStd, bStd](
-                                cv::Vec3f &pixel, const int *position) -> void {
-      pixel[0] = (pixel[0] - rMean) / rStd;
-      pixel[1] = (pixel[1] - gMean) / gStd;
-      pixel[2] = (pixel[2] - bMean) / bStd;
-    });
+    img_list.push_back(normalizeInput(img));
     auto t3 = std::chrono::high_resolution_clock::now();
     dtNormalize += std::chrono::duration<double, std::milli>(t3 - t2).count();
-
-    img_list.push_back(srcN);
   }
 
   auto t0 = std::chrono::high_resolution_clock::now();
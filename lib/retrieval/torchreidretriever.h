@@ -1,15 +1,21 @@
 #ifndef TORCHREIDRETRIEVER_H
 #define TORCHREIDRETRIEVER_H
 
+#include <database/DBImporterMT.h>
 #include <database/database.h>
 
 #include <QString>
+#include <functional>
+#include <memory>
 #include <opencv2/core.hpp>
 #include <opencv2/dnn.hpp>
 
+#include "IvfPqIndex.h"
 #include "ppbafloc-retrieval_export.h"
 #include "types/image.h"
 
+class EmbeddingMatrix;
+
 class PPBAFLOC_RETRIEVAL_EXPORT TorchreidRetriever {
  public:
   // Constructors
@@ -58,15 +64,108 @@ class PPBAFLOC_RETRIEVAL_EXPORT TorchreidRetriever {
       const uint64 numThreads, const uint64 batchSize, bool useDatabase);
   /**
    * @brief fillDatabaseHashes pre calculation when using database. Should be
-   * used before findReferenceImagesMultipleQueries is called for queryimages
+   * used before findReferenceImagesMultipleQueries is called for queryimages.
+   * Besides the hashTable this also writes the embedding matrix file next to
+   * the database (see embeddingFilePath()).
+   * @param numThreads threads decoding and preprocessing the next batches
+   * while the network runs
+   */
+  void fillDatabaseHashes(int batchSize = 1, int numThreads = 1);
+
+  /**
+   * @brief computeEmbeddings runs the CNN on one batch of decoded BGR images
+   * @return one normalized embedding per image, an empty matrix for empty
+   * images (they are left out of the gallery like in fillDatabaseHashes)
+   */
+  std::vector<cv::Mat> computeEmbeddings(const std::vector<cv::Mat> &images);
+
+  /**
+   * @brief embeddingFunction for the CNN stage of DBImporterMT, so the
+   * embeddings are calculated while the database is filled. The embedding
+   * matrix file has to be exported afterwards (exportEmbeddingMatrix).
+   * The retriever must outlive the import.
+   */
+  DBImporterMT::EmbeddingFunction embeddingFunction();
+
+  /**
+   * @brief exportEmbeddingMatrix writes all hash vectors of the database into
+   * the embedding matrix file. Only needed for databases filled before the
+   * file was introduced, retrieval calls it if the file is missing.
+   * @param numThreads threads reading and decoding the hash table
+   */
+  bool exportEmbeddingMatrix(int numThreads = 1);
+
+  /**
+   * @return path of the memory mapped embedding matrix: <database file>.emb
+   */
+  QString embeddingFilePath() const;
+
+  /**
+   * @brief buildAnnIndex trains an approximate nearest neighbour index over
+   * the embedding matrix of the database and saves it to annIndexFilePath().
+   * Has to be repeated after fillDatabaseHashes.
+   */
+  bool buildAnnIndex(const IvfPqIndex::Params &params);
+
+  /**
+   * @brief setAnnSearch if enabled, findReferenceImagesMultipleQueries queries
+   * the ANN index instead of scanning all embeddings (database only)
    */
-  void fillDatabaseHashes(int batchSize = 1);
+  void setAnnSearch(bool enabled, const IvfPqIndex::SearchParams &params);
+
+  /**
+   * @brief benchmarkAnnIndex prints latency and recall@k of the ANN index
+   * against the exact scan for a range of nprobe values
+   */
+  void benchmarkAnnIndex(const std::vector<std::shared_ptr<Image>> &queryImages,
+                         size_t k);
+
+  /**
+   * @return path of the ANN index: <database file>.ivfpq
+   */
+  QString annIndexFilePath() const;
 
  private:
   cv::dnn::Net mModel;
   cv::Size mInputFormat;
   Database *mDB = nullptr;
   QString mGalleryDirPath;
+  std::shared_ptr<EmbeddingMatrix> mEmbeddings;  // mmapped gallery of mDB
+  std::shared_ptr<IvfPqIndex> mAnnIndex;         // rows of mEmbeddings
+  bool mUseAnnIndex = false;
+  IvfPqIndex::SearchParams mAnnSearchParams;
+
+  /**
+   * @brief loadEmbeddingMatrix maps the embedding file of mDB into memory,
+   * exports it first if it does not exist yet
+   */
+  bool loadEmbeddingMatrix();
+
+  /**
+   * @brief loadAnnIndex loads the ANN index of mDB, false if it does not
+   * exist or does not match the embedding matrix
+   */
+  bool loadAnnIndex();
+
+  /**
+   * @brief normalizeInput converts a BGR image into the (not yet blobbed)
+   * input of the CNN: RGB, resized to mInputFormat, ImageNet normalization
+   */
+  cv::Mat normalizeInput(const cv::Mat &bgrImage) const;
+
+  /**
+   * @brief embedFiles runs the model on all paths in batches of batchSize.
+   * numThreads threads read and normalize the following batches while the
+   * network runs on the calling thread, at most numThreads batches are kept
+   * ready. callback is called on the calling thread for every batch, in the
+   * order of paths. Unreadable images are left out.
+   * @param callback gets the indices into paths and their embeddings
+   */
+  void embedFiles(
+      const std::vector<std::string> &paths, int batchSize, int numThreads,
+      const std::function<void(const std::vector<size_t> &indices,
+                               const std::vector<cv::Mat> &embeddings)>
+          &callback);
 
   // these functions call the model with different parameters
   /**